@@ -0,0 +1,810 @@
+////////////////////////////////////////////////////////////////////////////
+//                        **** AUDIO-STRETCH ****                         //
+//                      Time Domain Harmonic Scaler                       //
+//                    Copyright (c) 2022 David Bryant                     //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// apitest.c
+
+// This module is a regression test of the library's interface, for the behavior
+// that the quality harness (quality.c) doesn't measure, such as which settings
+// survive the calls that reset a handle. Every test uses the same deterministic
+// synthetic signal (a voiced tone with vibrato, alternating with noise and with
+// silence, and slightly different in the two channels), and the program fails
+// (exit code 1) if any test does.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "stretch.h"
+
+#define SAMPLE_RATE     44100
+#define SHORTEST        (SAMPLE_RATE / 333)     // same period limits as the demo program
+#define LONGEST         (SAMPLE_RATE / 55)
+#define SIGNAL_SECONDS  4
+#define POOL_HANDLES    3           // small, so that a cache can hold all of them
+#define POOL_EXCHANGES  2000
+#define POOL_FLAGS      (STRETCH_DUAL_FLAG | STRETCH_PITCH_FLAG)   // so that every setting applies
+#define GAP_WINDOW      (SAMPLE_RATE / 40)
+#define FANOUT_OUTPUTS  4
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static const char *sign_on = "\n"
+" AUDIO-APITEST  TDHS Interface Regression Test  Version 0.4\n"
+" Copyright (c) 2022 David Bryant. All Rights Reserved.\n\n";
+
+static const char *usage =
+" Usage:     AUDIO-APITEST [-options] [test ...]\n\n"
+" Options:  -l      = list the tests\n"
+"           -v      = verbose (display the details of every test)\n\n"
+" With no test names given, all tests are run. The exit code is 0 if all of them\n"
+" pass, 1 if any fails, and 2 for other errors.\n\n";
+
+typedef struct {
+    const char *name, *description;
+    int (*run) (void);
+} Test;
+
+static int map_keeps_settings (void);
+static int pool_cross_thread (void);
+static int pool_restores_defaults (void);
+static int reset_keeps_settings (void);
+static int gap_out_of_memory (void);
+static int step_matches_samples (void);
+static int fanout_matches_handles (void);
+
+static const Test tests [] = {
+    { "map-settings", "hook, governor and ratio set before a map is loaded are kept", map_keeps_settings },
+    { "pool-threads", "handles released on one thread can be acquired on another", pool_cross_thread },
+    { "pool-defaults", "a handle acquired again has none of the settings of its last user", pool_restores_defaults },
+    { "reset-settings", "stretch_reset() keeps every setting and repeats the render", reset_keeps_settings },
+    { "gap-nomem", "a pitch-shifting handle still works after stretch_set_gap() runs out of memory", gap_out_of_memory },
+    { "step-samples", "push/step/read output matches stretch_samples(), also in gap mode", step_matches_samples },
+    { "fanout", "fan-out outputs match separate handles, also after stretch_fanout_reset()", fanout_matches_handles },
+};
+
+#define NUM_TESTS   ((int) (sizeof (tests) / sizeof (tests [0])))
+
+static int16_t *make_signal (int num_chans, int *num_samples);
+static int16_t *render (StretchHandle stretcher, const int16_t *samples, int num_samples, int num_chans, int chunk, float ratio, int *num_rendered);
+
+static int verbose_mode;
+
+int main (argc, argv) int argc; char **argv;
+{
+    int selected [NUM_TESTS] = { 0 }, num_selected = 0, failures = 0, i;
+
+    while (--argc) {
+        if (**++argv == '-' && (*argv)[1]) {
+            while (*++*argv)
+                switch (**argv) {
+                    case 'L': case 'l':
+                        for (i = 0; i < NUM_TESTS; ++i)
+                            printf ("  %-16s %s\n", tests [i].name, tests [i].description);
+
+                        return 0;
+
+                    case 'V': case 'v':
+                        verbose_mode = 1;
+                        break;
+
+                    default:
+                        fprintf (stderr, "%s%s", sign_on, usage);
+                        return 2;
+                }
+        }
+        else {
+            for (i = 0; i < NUM_TESTS && strcmp (*argv, tests [i].name); ++i);
+
+            if (i == NUM_TESTS) {
+                fprintf (stderr, "unknown test \"%s\" (see -l)\n", *argv);
+                return 2;
+            }
+
+            selected [i] = 1;
+            num_selected++;
+        }
+    }
+
+    for (i = 0; i < NUM_TESTS; ++i)
+        if (!num_selected || selected [i]) {
+            int passed = tests [i].run ();
+
+            printf ("  %-16s %s\n", tests [i].name, passed ? "ok" : "FAILED");
+            failures += !passed;
+        }
+
+    if (failures)
+        printf ("\n %d test%s FAILED\n", failures, failures > 1 ? "s" : "");
+    else
+        printf ("\n all tests passed\n");
+
+    return failures ? 1 : 0;
+}
+
+typedef struct {
+    int blocks, other_levels, level;
+} BlockCount;
+
+static void count_blocks (void *context, const StretchBlockEvent *event)
+{
+    BlockCount *count = (BlockCount *) context;
+
+    count->blocks++;
+    count->other_levels += event->search_level != count->level;
+}
+
+/*
+ * Loading a period map (like setting the gap detection) resets the handle, which must
+ * only drop the state of the stream and not what was configured for it, so a trace hook,
+ * a governor level and a fixed ratio set beforehand still apply to the render.
+ */
+
+static int map_keeps_settings (void)
+{
+    int num_samples, num_rendered = 0, map_bytes, passed = 0;
+    int16_t *signal = make_signal (2, &num_samples), *output = NULL;
+    StretchHandle stretcher = stretch_init (SHORTEST, LONGEST, 2, 0);
+    BlockCount count = { 0, 0, 3 };
+    unsigned char *map = NULL;
+    uint32_t checksum;
+
+    if (!signal || !stretcher || !stretch_analyze (stretcher, signal, num_samples) ||
+        !(map_bytes = stretch_map_bytes (stretcher)) || !(map = malloc (map_bytes)))
+            goto done;
+
+    stretch_map_save (stretcher, map);
+    checksum = stretch_map_checksum (stretcher, 0, signal, num_samples);
+
+    stretch_set_block_hook (stretcher, count_blocks, &count);
+    stretch_set_governor (stretcher, SAMPLE_RATE, 0.0, count.level);
+    stretch_set_ratio (stretcher, 1.5, 0.0);
+
+    if (!stretch_map_load (stretcher, map, map_bytes, num_samples, checksum) ||
+        !(output = render (stretcher, signal, num_samples, 2, 1024, 1.0, &num_rendered)))
+            goto done;
+
+    if (verbose_mode)
+        printf ("  map-settings: %d blocks, %d at another level, %d -> %d samples\n",
+            count.blocks, count.other_levels, num_samples, num_rendered);
+
+    passed = count.blocks && !count.other_levels && fabs (num_rendered / 1.5 - num_samples) < num_samples * 0.01;
+
+done:
+    if (stretcher)
+        stretch_deinit (stretcher);
+
+    free (output);
+    free (signal);
+    free (map);
+    return passed;
+}
+
+/*
+ * A producer thread (this one) acquires pool handles and hands them to a consumer thread,
+ * which stretches a little audio with each and releases it, as a server handing sessions
+ * to workers would. The handles end up in the consumer's cache, but a semaphore counts
+ * the handles that are free, so the producer's acquire must never fail.
+ */
+
+typedef struct {
+    StretchPool pool;
+    StretchHandle ring [POOL_HANDLES];
+    sem_t free_handles, queued;
+    const int16_t *signal;
+    int processed, failures;
+} PoolExchange;
+
+static void semaphore_wait (sem_t *sem)
+{
+    while (sem_wait (sem) && errno == EINTR);
+}
+
+static void *pool_consumer (void *arg)
+{
+    PoolExchange *exchange = (PoolExchange *) arg;
+    int16_t output [4096 * 2];
+    int i;
+
+    for (i = 0; i < POOL_EXCHANGES; ++i) {
+        StretchHandle stretcher;
+
+        semaphore_wait (&exchange->queued);
+        stretcher = exchange->ring [i % POOL_HANDLES];
+
+        if (stretch_output_capacity (stretcher, 512, 2.0) > 4096)
+            exchange->failures++;
+        else
+            exchange->processed += stretch_samples (stretcher, exchange->signal + (i % 64) * 1024, 512, output, 1.25) >= 0;
+
+        stretch_pool_release (exchange->pool, stretcher);
+        sem_post (&exchange->free_handles);
+    }
+
+    return NULL;
+}
+
+static int pool_cross_thread (void)
+{
+    int num_samples, passed = 0, i;
+    PoolExchange exchange = { 0 };
+    pthread_t consumer;
+
+    if (!(exchange.signal = make_signal (2, &num_samples)) ||
+        !(exchange.pool = stretch_pool_init (SHORTEST, LONGEST, 2, 0, POOL_HANDLES))) {
+            free ((void *) exchange.signal);
+            return 0;
+    }
+
+    sem_init (&exchange.free_handles, 0, POOL_HANDLES);
+    sem_init (&exchange.queued, 0, 0);
+
+    if (pthread_create (&consumer, NULL, pool_consumer, &exchange))
+        goto done;
+
+    for (i = 0; i < POOL_EXCHANGES; ++i) {
+        StretchHandle stretcher;
+
+        semaphore_wait (&exchange.free_handles);
+
+        if (!(stretcher = stretch_pool_acquire (exchange.pool))) {
+            exchange.failures++;
+            break;
+        }
+
+        exchange.ring [i % POOL_HANDLES] = stretcher;
+        sem_post (&exchange.queued);
+    }
+
+    // a failed acquire leaves the consumer waiting for handles that won't come
+
+    if (i < POOL_EXCHANGES)
+        pthread_cancel (consumer);
+
+    pthread_join (consumer, NULL);
+
+    if (verbose_mode)
+        printf ("  pool-threads: %d of %d handed over, %d processed, %d failures\n",
+            i, POOL_EXCHANGES, exchange.processed, exchange.failures);
+
+    passed = i == POOL_EXCHANGES && exchange.processed == POOL_EXCHANGES && !exchange.failures;
+
+done:
+    sem_destroy (&exchange.free_handles);
+    sem_destroy (&exchange.queued);
+    stretch_pool_deinit (exchange.pool);
+    free ((void *) exchange.signal);
+    return passed;
+}
+
+/*
+ * A pool handle must come back from stretch_pool_acquire() as if just created, whatever
+ * its last user set, because the next user is a different session. For every setting,
+ * the one handle of a pool is acquired, given the setting and some audio, and released,
+ * and then the output of the next user (who sets nothing) must match a new handle's.
+ */
+
+static const char *handle_settings [] = {
+    "ratio", "error policy", "governor", "block hook", "gap", "pitch ratio",
+    "unvoiced", "adaptive", "search threads", "period map"
+};
+
+#define NUM_SETTINGS   ((int) (sizeof (handle_settings) / sizeof (handle_settings [0])))
+
+static int apply_setting (StretchHandle stretcher, int setting, const int16_t *signal, int num_samples, BlockCount *count)
+{
+    unsigned char *map;
+    int map_bytes, loaded;
+
+    switch (setting) {
+        case 0: stretch_set_ratio (stretcher, 0.6, 0.0); return 1;
+        case 1: return stretch_set_error_policy (stretcher, STRETCH_ERROR_RAMP);
+        case 2: return stretch_set_governor (stretcher, SAMPLE_RATE, 0.0, 3);
+        case 3: stretch_set_block_hook (stretcher, count_blocks, count); return 1;
+        case 4: return stretch_set_gap (stretcher, 0.5, -40.0, GAP_WINDOW);
+        case 5: stretch_set_pitch_ratio (stretcher, 1.5); return 1;
+        case 6: return stretch_set_unvoiced (stretcher, 16.0);
+        case 7: return stretch_set_adaptive (stretcher, SAMPLE_RATE, 0.5);
+        case 8: return stretch_set_search_threads (stretcher, 4);
+
+        case 9:
+            if (!stretch_analyze (stretcher, signal, num_samples) || !(map_bytes = stretch_map_bytes (stretcher)) || !(map = malloc (map_bytes)))
+                return 0;
+
+            stretch_map_save (stretcher, map);
+            loaded = stretch_map_load (stretcher, map, map_bytes, num_samples, stretch_map_checksum (stretcher, 0, signal, num_samples));
+            free (map);
+            return loaded;
+    }
+
+    return 0;
+}
+
+static int pool_restores_defaults (void)
+{
+    int num_samples, num_expected = 0, failures = 0, setting;
+    int16_t *signal = make_signal (2, &num_samples), *expected = NULL, *output = NULL;
+    StretchPool pool = stretch_pool_init (SHORTEST, LONGEST, 2, POOL_FLAGS, 1);
+    StretchHandle stretcher = stretch_init (SHORTEST, LONGEST, 2, POOL_FLAGS);
+    int capacity = stretcher ? stretch_output_capacity (stretcher, 1024, 4.0) : 0;
+
+    if (signal && stretcher)
+        expected = render (stretcher, signal, num_samples, 2, 1024, 1.3, &num_expected);
+
+    if (stretcher)
+        stretch_deinit (stretcher);
+
+    if (!pool || !expected || !(output = malloc (capacity * 2 * sizeof (int16_t)))) {
+        failures++;
+        goto done;
+    }
+
+    for (setting = 0; setting < NUM_SETTINGS; ++setting) {
+        BlockCount count = { 0, 0, 0 };
+        int16_t *rendered = NULL;
+        int num_rendered = 0, matched = 0, i;
+
+        if ((stretcher = stretch_pool_acquire (pool)) && apply_setting (stretcher, setting, signal, num_samples, &count)) {
+            for (i = 0; i < 8; ++i)
+                stretch_samples (stretcher, signal + i * 1024 * 2, 1024, output, 1.3);
+
+            stretch_pool_release (pool, stretcher);
+            count.blocks = 0;
+
+            if ((stretcher = stretch_pool_acquire (pool))) {
+                rendered = render (stretcher, signal, num_samples, 2, 1024, 1.3, &num_rendered);
+                stretch_pool_release (pool, stretcher);
+            }
+
+            matched = rendered && !count.blocks && num_rendered == num_expected &&
+                !memcmp (rendered, expected, num_expected * 2 * sizeof (int16_t));
+        }
+        else if (stretcher)
+            stretch_pool_release (pool, stretcher);
+
+        if (verbose_mode)
+            printf ("  pool-defaults: %s: %d / %d samples, %s\n", handle_settings [setting],
+                num_rendered, num_expected, matched ? "same" : "DIFFERENT");
+
+        failures += !matched;
+        free (rendered);
+    }
+
+done:
+    if (pool)
+        stretch_pool_deinit (pool);
+
+    free (expected);
+    free (output);
+    free (signal);
+    return !failures;
+}
+
+/*
+ * stretch_reset() is for the same caller starting a new stream, so it must keep all of
+ * those settings (and the loaded map): a handle given every one of them must render the
+ * signal the same way again after a reset, with the hook seeing the same blocks, and
+ * differently from a handle without them.
+ */
+
+static int reset_keeps_settings (void)
+{
+    int num_samples, num_first = 0, num_second = 0, num_plain = 0, first_blocks = 0, passed = 0, setting;
+    int16_t *signal = make_signal (2, &num_samples), *first = NULL, *second = NULL, *plain = NULL;
+    StretchHandle stretcher = stretch_init (SHORTEST, LONGEST, 2, POOL_FLAGS);
+    BlockCount count = { 0, 0, 0 };
+
+    if (!signal || !stretcher)
+        goto done;
+
+    for (setting = 0; setting < NUM_SETTINGS; ++setting)
+        if (!apply_setting (stretcher, setting, signal, num_samples, &count))
+            goto done;
+
+    if (!(first = render (stretcher, signal, num_samples, 2, 1024, 1.3, &num_first)))
+        goto done;
+
+    first_blocks = count.blocks;
+    count.blocks = 0;
+    stretch_reset (stretcher);
+
+    if (!(second = render (stretcher, signal, num_samples, 2, 1024, 1.3, &num_second)))
+        goto done;
+
+    stretch_deinit (stretcher);
+
+    if (!(stretcher = stretch_init (SHORTEST, LONGEST, 2, POOL_FLAGS)) ||
+        !(plain = render (stretcher, signal, num_samples, 2, 1024, 1.3, &num_plain)))
+            goto done;
+
+    if (verbose_mode)
+        printf ("  reset-settings: %d / %d samples (%d without the settings), %d / %d blocks\n",
+            num_second, num_first, num_plain, count.blocks, first_blocks);
+
+    passed = first_blocks && count.blocks == first_blocks && num_second == num_first &&
+        !memcmp (first, second, num_first * 2 * sizeof (int16_t)) &&
+        (num_plain != num_first || memcmp (first, plain, num_first * 2 * sizeof (int16_t)));
+
+done:
+    if (stretcher)
+        stretch_deinit (stretcher);
+
+    free (first);
+    free (second);
+    free (plain);
+    free (signal);
+    return passed;
+}
+
+/*
+ * stretch_set_gap() reallocates the pitch-shift resampler (which is sized from the input
+ * buffer), so an allocation failure there must not leave a half-built one in the handle.
+ * The call is failed at every allocation in turn through an allocator with a limit, and
+ * the handle must then still stretch the signal, and give back all its memory when freed.
+ */
+
+typedef struct {
+    int allocations, limit, live;
+} LimitedHeap;
+
+static void *limited_allocate (void *context, size_t bytes, size_t alignment)
+{
+    LimitedHeap *heap = context;
+    void *ptr;
+
+    (void) alignment;
+
+    if (heap->limit >= 0 && heap->allocations >= heap->limit)
+        return NULL;
+
+    if ((ptr = malloc (bytes))) {
+        heap->allocations++;
+        heap->live++;
+    }
+
+    return ptr;
+}
+
+static void limited_deallocate (void *context, void *ptr, size_t bytes, size_t alignment)
+{
+    LimitedHeap *heap = context;
+
+    (void) bytes; (void) alignment;
+    heap->live--;
+    free (ptr);
+}
+
+static int gap_out_of_memory (void)
+{
+    int num_samples, num_rendered, failures = 0, limit, set;
+    int16_t *signal = make_signal (2, &num_samples), *output;
+    LimitedHeap heap = { 0, -1, 0 };
+    StretchAllocator allocator = { limited_allocate, limited_deallocate, &heap };
+    StretchHandle stretcher;
+
+    if (!signal)
+        return 0;
+
+    for (limit = 0, set = 0; !set; ++limit) {
+        heap.limit = -1;
+
+        if (!(stretcher = stretch_init_ex (SHORTEST, LONGEST, 2, STRETCH_PITCH_FLAG, &allocator))) {
+            ++failures;
+            break;
+        }
+
+        stretch_set_pitch_ratio (stretcher, 1.5);
+        heap.allocations = 0;
+        heap.limit = limit;
+        set = stretch_set_gap (stretcher, 0.5, -40.0, GAP_WINDOW);
+        heap.limit = -1;
+
+        if ((output = render (stretcher, signal, num_samples, 2, 1024, 1.3, &num_rendered)) && num_rendered)
+            free (output);
+        else
+            ++failures;
+
+        stretch_deinit (stretcher);
+
+        if (heap.live) {
+            ++failures;
+            heap.live = 0;
+        }
+    }
+
+    if (verbose_mode)
+        printf ("  gap-nomem: stretch_set_gap() failed at each of %d allocations, %d failures\n", limit - 1, failures);
+
+    free (signal);
+    return limit > 1 && !failures;
+}
+
+/*
+ * The output of stretch_push(), stretch_step() and stretch_read(), in randomly sized pieces,
+ * must be the same as that of stretch_samples() for the same stream, because the blocks
+ * (and the ratio each gets in gap mode) may depend only on the audio, not on how it was
+ * delivered.
+ */
+
+typedef struct {
+    int flags;
+    float ratio, gap_ratio;
+} StepConfig;
+
+static const StepConfig step_configs [] = {
+    { 0, 0.55, 0.0 }, { 0, 0.55, 2.0 }, { 0, 1.3, 0.5 }, { STRETCH_DUAL_FLAG, 3.0, 0.5 }
+};
+
+static uint32_t step_random (uint32_t *seed, int range)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) % range;
+}
+
+static StretchHandle step_stretcher (const StepConfig *config)
+{
+    StretchHandle stretcher = stretch_init (SHORTEST, LONGEST, 2, config->flags);
+
+    if (stretcher && config->gap_ratio && !stretch_set_gap (stretcher, config->gap_ratio, -40.0, GAP_WINDOW)) {
+        stretch_deinit (stretcher);
+        return NULL;
+    }
+
+    return stretcher;
+}
+
+static int step_matches_samples (void)
+{
+    int num_samples, num_configs = sizeof (step_configs) / sizeof (step_configs [0]), failures = 0, c;
+    int16_t *signal = make_signal (2, &num_samples);
+    int i;
+
+    if (!signal)
+        return 0;
+
+    // a quiet hum (below the gap threshold) in each channel, so that the gaps still have
+    // periods to splice
+
+    for (i = 0; i < num_samples; ++i) {
+        signal [i * 2] += (int16_t) floor (200.0 * sin (i * 97.0 / SAMPLE_RATE * 2.0 * M_PI) + 0.5);
+        signal [i * 2 + 1] += (int16_t) floor (300.0 * sin (i * 143.0 / SAMPLE_RATE * 2.0 * M_PI) + 0.5);
+    }
+
+    for (c = 0; c < num_configs; ++c) {
+        const StepConfig *config = step_configs + c;
+        StretchHandle stretcher = step_stretcher (config);
+        int16_t *expected = NULL, *stepped = NULL;
+        int num_expected = 0, num_stepped = 0, pushed = 0, more = 1, matched = 0;
+        uint32_t seed = c + 1;
+
+        if (stretcher)
+            expected = render (stretcher, signal, num_samples, 2, 1024, config->ratio, &num_expected);
+
+        if (stretcher)
+            stretch_deinit (stretcher);
+
+        if (expected && (stretcher = step_stretcher (config)) && (stepped = malloc ((num_expected + 1) * 2 * sizeof (int16_t)))) {
+            while (pushed < num_samples || more) {
+                int available;
+
+                if (pushed < num_samples && !step_random (&seed, 3)) {
+                    int samples_to_push = 1 + step_random (&seed, 3000);
+
+                    if (samples_to_push > num_samples - pushed)
+                        samples_to_push = num_samples - pushed;
+
+                    if (!stretch_push (stretcher, signal + pushed * 2, samples_to_push))
+                        break;
+
+                    if ((pushed += samples_to_push) == num_samples)
+                        stretch_push (stretcher, NULL, 0);
+                }
+
+                more = stretch_step (stretcher, 1 + step_random (&seed, 3), config->ratio);
+                available = stretch_read (stretcher, NULL, 0);
+
+                if (num_stepped + available > num_expected + 1)
+                    break;
+
+                if (!more || step_random (&seed, 2))
+                    num_stepped += stretch_read (stretcher, stepped + num_stepped * 2, available);
+            }
+
+            matched = pushed == num_samples && !more && num_stepped == num_expected &&
+                !memcmp (stepped, expected, num_expected * 2 * sizeof (int16_t));
+        }
+
+        if (stretcher)
+            stretch_deinit (stretcher);
+
+        if (verbose_mode)
+            printf ("  step-samples: flags 0x%02x, ratio %.2f, gap ratio %.2f: %d / %d samples, %s\n",
+                config->flags, config->ratio, config->gap_ratio, num_stepped, num_expected, matched ? "same" : "DIFFERENT");
+
+        failures += !matched;
+        free (expected);
+        free (stepped);
+    }
+
+    free (signal);
+    return !failures;
+}
+
+/*
+ * The outputs of a fan-out share the periods searched at the same positions, but must
+ * otherwise search for themselves, so each must be the same as a separate handle with
+ * its ratio. The fan-out renders the signal twice, with a reset in between, and the
+ * second render is compared.
+ */
+
+static int fanout_matches_handles (void)
+{
+    static const float ratios [FANOUT_OUTPUTS] = { 0.55, 0.8, 1.3, 1.9 };
+    int num_samples, num_generated [FANOUT_OUTPUTS], num_rendered [FANOUT_OUTPUTS], failures = 0, passed = 0, pass, i, j;
+    int16_t *signal = make_signal (2, &num_samples), *outputs [FANOUT_OUTPUTS] = { NULL }, *output_ptrs [FANOUT_OUTPUTS];
+    StretchFanout fanout = stretch_fanout_init (SHORTEST, LONGEST, 2, 0, FANOUT_OUTPUTS);
+    int capacity = fanout ? stretch_fanout_output_capacity (fanout, 1024, 2.0) : 0;
+
+    for (i = 0; i < FANOUT_OUTPUTS; ++i)
+        if (signal && fanout && !(outputs [i] = malloc ((num_samples * 2 + capacity * 2) * 2 * sizeof (int16_t))))
+            failures++;
+
+    if (!signal || !fanout || failures)
+        goto done;
+
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < FANOUT_OUTPUTS; ++i)
+            num_rendered [i] = 0;
+
+        for (j = 0; j < num_samples; j += 1024) {
+            for (i = 0; i < FANOUT_OUTPUTS; ++i)
+                output_ptrs [i] = outputs [i] + num_rendered [i] * 2;
+
+            stretch_fanout_samples (fanout, signal + j * 2, num_samples - j < 1024 ? num_samples - j : 1024, output_ptrs, ratios, num_generated);
+
+            for (i = 0; i < FANOUT_OUTPUTS; ++i)
+                num_rendered [i] += num_generated [i];
+        }
+
+        do {
+            for (i = 0; i < FANOUT_OUTPUTS; ++i)
+                output_ptrs [i] = outputs [i] + num_rendered [i] * 2;
+
+            j = stretch_fanout_flush (fanout, output_ptrs, num_generated);
+
+            for (i = 0; i < FANOUT_OUTPUTS; ++i)
+                num_rendered [i] += num_generated [i];
+        } while (j);
+
+        if (!pass)
+            stretch_fanout_reset (fanout);
+    }
+
+    for (i = 0; i < FANOUT_OUTPUTS; ++i) {
+        StretchHandle stretcher = stretch_init (SHORTEST, LONGEST, 2, 0);
+        int16_t *expected = NULL;
+        int num_expected = 0, matched;
+
+        if (stretcher) {
+            expected = render (stretcher, signal, num_samples, 2, 1024, ratios [i], &num_expected);
+            stretch_deinit (stretcher);
+        }
+
+        matched = expected && num_expected == num_rendered [i] && !memcmp (expected, outputs [i], num_expected * 2 * sizeof (int16_t));
+
+        if (verbose_mode)
+            printf ("  fanout: ratio %.2f: %d / %d samples, %s\n", ratios [i], num_rendered [i], num_expected, matched ? "same" : "DIFFERENT");
+
+        failures += !matched;
+        free (expected);
+    }
+
+    passed = !failures;
+
+done:
+    if (fanout)
+        stretch_fanout_deinit (fanout);
+
+    for (i = 0; i < FANOUT_OUTPUTS; ++i)
+        free (outputs [i]);
+
+    free (signal);
+    return passed;
+}
+
+/*
+ * The test signal: a voiced tone (a harmonic series with vibrato, its fundamental gliding
+ * slowly over most of the period range) for a second and a half, then a quarter second
+ * of noise and a quarter second of silence, repeated. The second channel is the same
+ * tone a little detuned and delayed, with its own noise.
+ */
+
+static int16_t *make_signal (int num_chans, int *num_samples)
+{
+    int16_t *signal;
+    uint32_t seed = 1;
+    int i, ch, k;
+
+    *num_samples = SAMPLE_RATE * SIGNAL_SECONDS;
+
+    if (!(signal = calloc (*num_samples * num_chans, sizeof (int16_t))))
+        return NULL;
+
+    for (ch = 0; ch < num_chans; ++ch) {
+        double phase = 0.0;
+
+        for (i = 0; i < *num_samples; ++i) {
+            int segment = i % (SAMPLE_RATE * 2);
+            double value = 0.0;
+
+            if (segment < SAMPLE_RATE * 3 / 2) {
+                double t = (double) i / SAMPLE_RATE;
+                double f0 = (90.0 + 60.0 * sin (t * 0.9)) * (1.0 + 0.02 * sin (t * 5.5 * 2.0 * M_PI)) * (1.0 + ch * 0.03);
+
+                phase += f0 / SAMPLE_RATE;
+
+                for (k = 1; k <= 12; ++k)
+                    value += sin ((phase - ch * 0.11) * k * 2.0 * M_PI) / k;
+
+                value *= 6000.0;
+            }
+            else if (segment < SAMPLE_RATE * 7 / 4) {
+                seed = seed * 1664525 + 1013904223;
+                value = (int32_t) seed / 2147483648.0 * 3000.0;
+            }
+
+            signal [i * num_chans + ch] = (int16_t) floor (value + 0.5);
+        }
+    }
+
+    return signal;
+}
+
+// stretch the whole signal in chunks of "chunk" samples and flush, returning the output (or NULL)
+
+static int16_t *render (StretchHandle stretcher, const int16_t *samples, int num_samples, int num_chans, int chunk, float ratio, int *num_rendered)
+{
+    int capacity = stretch_output_capacity (stretcher, chunk, ratio > 1.5 ? ratio : 1.5), max_output = (int) (num_samples * 4.5) + capacity * 2;
+    int16_t *output = malloc (max_output * num_chans * sizeof (int16_t));
+    int i, num_generated;
+
+    *num_rendered = 0;
+
+    if (!output)
+        return NULL;
+
+    for (i = 0; i < num_samples; i += chunk) {
+        int samples_to_process = num_samples - i < chunk ? num_samples - i : chunk;
+
+        if (*num_rendered + capacity > max_output) {
+            free (output);
+            return NULL;
+        }
+
+        num_generated = stretch_samples (stretcher, samples + i * num_chans, samples_to_process, output + *num_rendered * num_chans, ratio);
+        *num_rendered += num_generated;
+    }
+
+    do {
+        if (*num_rendered + capacity > max_output) {
+            free (output);
+            return NULL;
+        }
+
+        num_generated = stretch_flush (stretcher, output + *num_rendered * num_chans);
+        *num_rendered += num_generated;
+    } while (num_generated);
+
+    return output;
+}
@@ -0,0 +1,355 @@
+////////////////////////////////////////////////////////////////////////////
+//                        **** AUDIO-STRETCH ****                         //
+//                      Time Domain Harmonic Scaler                       //
+//                    Copyright (c) 2022 David Bryant                     //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// bench.c
+
+// This module is a multi-core scaling benchmark for the TDHS library. It runs
+// independent streams (one handle each) on 1, 2, 4 ... up to N threads, either
+// pinned to successive CPUs or left to the scheduler, all stretching the same
+// synthetic speech-like signal, and reports the aggregate throughput (as times
+// real time) and the scaling efficiency relative to a single thread.
+//
+// All the handles are created by the main thread before any stream starts, as
+// a handle pool or a server would do, so that their allocations are adjacent.
+// "build.sh bench" also builds a copy of the benchmark with the library's
+// cache-line alignment disabled (audio-bench-unaligned) to show the cost of
+// handles sharing cache lines between threads.
+//
+// This is Linux-only (thread affinity).
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stretch.h"
+
+#define UPPER_FREQUENCY     333     // same period limits as the demo program
+#define LOWER_FREQUENCY     55
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static const char *sign_on = "\n"
+" AUDIO-BENCH  TDHS Multi-Core Scaling Benchmark  Version 0.4\n"
+" Copyright (c) 2022 David Bryant. All Rights Reserved.\n\n";
+
+static const char *usage =
+" Usage:     AUDIO-BENCH [-options]\n\n"
+" Options:  -n<n>   = maximum number of threads (default = number of CPUs)\n"
+"           -t<n.n> = seconds of audio per stream (default = 10)\n"
+"           -r<n.n> = stretch ratio (0.25 to 4.0, default = 1.25)\n"
+"           -k<n>   = sample rate (8000 to 48000 Hz, default = 44100)\n"
+"           -c<n>   = number of channels (1 or 2, default = 2)\n"
+"           -b<n>   = audio buffer length (ms, default = 25)\n"
+"           -a      = pin each thread to its own CPU\n"
+"           -f      = fast pitch detection\n"
+"           -d      = force dual instance even for shallow ratios\n"
+"           -v      = verbose (display the time of every stream)\n\n"
+" Web:      Visit www.github.com/dbry/audio-stretch for latest version\n\n";
+
+typedef struct {
+    pthread_t thread;
+    int index, cpu;
+    StretchHandle stretcher;
+    int16_t *output;
+    double seconds;
+} Stream;
+
+static int sample_rate = 44100, num_chans = 2, buffer_samples, total_samples, flags, verbose_mode;
+static float ratio = 1.25;
+static int16_t *signal_samples;
+static pthread_barrier_t start_barrier;
+
+static void *stream_thread (void *arg);
+static void generate_signal (void);
+static double clock_seconds (void);
+
+int main (argc, argv) int argc; char **argv;
+{
+    int asked_help = 0, max_threads = sysconf (_SC_NPROCESSORS_ONLN), num_cpus = max_threads;
+    int buffer_ms = 25, force_dual = 0, pin_threads = 0, output_samples, num_threads, i;
+    double seconds = 10.0, single_rate = 0.0;
+    Stream *streams;
+
+    // loop through command-line arguments
+
+    while (--argc) {
+        if ((**++argv == '-') && (*argv)[1])
+            while (*++*argv)
+                switch (**argv) {
+
+                    case 'N': case 'n':
+                        max_threads = strtol (++*argv, argv, 10);
+
+                        if (max_threads < 1 || max_threads > 1024) {
+                            fprintf (stderr, "\nnumber of threads must be from 1 to 1024!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'T': case 't':
+                        seconds = strtod (++*argv, argv);
+
+                        if (seconds <= 0.0 || seconds > 3600.0) {
+                            fprintf (stderr, "\nstream length must be up to 3600 seconds!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'R': case 'r':
+                        ratio = strtod (++*argv, argv);
+
+                        if (ratio < 0.25 || ratio > 4.0) {
+                            fprintf (stderr, "\nratio must be from 0.25 to 4.0!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'K': case 'k':
+                        sample_rate = strtol (++*argv, argv, 10);
+
+                        if (sample_rate < 8000 || sample_rate > 48000) {
+                            fprintf (stderr, "\nsample rate must be from 8000 to 48000 Hz!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'C': case 'c':
+                        num_chans = strtol (++*argv, argv, 10);
+
+                        if (num_chans < 1 || num_chans > 2) {
+                            fprintf (stderr, "\nnumber of channels must be 1 or 2!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'B': case 'b':
+                        buffer_ms = strtol (++*argv, argv, 10);
+
+                        if (buffer_ms < 1 || buffer_ms > 1000) {
+                            fprintf (stderr, "\nbuffer length must be from 1 to 1000 ms!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'A': case 'a':
+                        pin_threads = 1;
+                        break;
+
+                    case 'F': case 'f':
+                        flags |= STRETCH_FAST_FLAG;
+                        break;
+
+                    case 'D': case 'd':
+                        force_dual = 1;
+                        break;
+
+                    case 'H': case 'h':
+                        asked_help = 1;
+                        break;
+
+                    case 'V': case 'v':
+                        verbose_mode = 1;
+                        break;
+
+                    default:
+                        fprintf (stderr, "\nillegal option: %c !\n", **argv);
+                        return -1;
+                }
+        else {
+            fprintf (stderr, "\nextra unknown argument: %s !\n", *argv);
+            return -1;
+        }
+    }
+
+    fprintf (stderr, "%s", sign_on);
+
+    if (asked_help) {
+        printf ("%s", usage);
+        return 0;
+    }
+
+    if (force_dual || ratio < 0.5 || ratio > 2.0)
+        flags |= STRETCH_DUAL_FLAG;
+
+    buffer_samples = sample_rate * (buffer_ms / 1000.0);
+    total_samples = sample_rate * seconds;
+    generate_signal ();
+
+    if (!signal_samples || !(streams = calloc (max_threads, sizeof (Stream)))) {
+        fprintf (stderr, "can't allocate required memory!\n");
+        return 1;
+    }
+
+    // create every handle (and output buffer) up front on this thread
+
+    for (i = 0; i < max_threads; ++i) {
+        streams [i].index = i;
+        streams [i].cpu = i % num_cpus;
+        streams [i].stretcher = stretch_init (sample_rate / UPPER_FREQUENCY, sample_rate / LOWER_FREQUENCY, num_chans, flags);
+
+        if (!streams [i].stretcher) {
+            fprintf (stderr, "can't initialize stretcher!\n");
+            return 1;
+        }
+
+        output_samples = stretch_output_capacity (streams [i].stretcher, buffer_samples, ratio);
+
+        if (!(streams [i].output = malloc (output_samples * num_chans * sizeof (int16_t)))) {
+            fprintf (stderr, "can't allocate required memory!\n");
+            return 1;
+        }
+    }
+
+    fprintf (stderr, "%d CPUs, %d %s threads, %d channels at %d Hz, ratio = %.3f%s\n\n", num_cpus, max_threads,
+        pin_threads ? "pinned" : "unpinned", num_chans, sample_rate, ratio, (flags & STRETCH_FAST_FLAG) ? ", fast" : "");
+    fprintf (stderr, "threads    X real time    per thread    efficiency\n");
+    fprintf (stderr, "-------    -----------    ----------    ----------\n");
+
+    for (num_threads = 1;; num_threads = num_threads * 2 < max_threads ? num_threads * 2 : max_threads) {
+        double start_time, elapsed, rate;
+
+        pthread_barrier_init (&start_barrier, NULL, num_threads + 1);
+
+        for (i = 0; i < num_threads; ++i) {
+            stretch_reset (streams [i].stretcher);
+
+            if (pthread_create (&streams [i].thread, NULL, stream_thread, streams + i)) {
+                fprintf (stderr, "can't start stream %d!\n", i);
+                return 1;
+            }
+
+            if (pin_threads) {
+                cpu_set_t cpus;
+
+                CPU_ZERO (&cpus);
+                CPU_SET (streams [i].cpu, &cpus);
+
+                if (pthread_setaffinity_np (streams [i].thread, sizeof (cpus), &cpus))
+                    fprintf (stderr, "warning: can't pin stream %d to CPU %d\n", i, streams [i].cpu);
+            }
+        }
+
+        pthread_barrier_wait (&start_barrier);
+        start_time = clock_seconds ();
+
+        for (i = 0; i < num_threads; ++i)
+            pthread_join (streams [i].thread, NULL);
+
+        elapsed = clock_seconds () - start_time;
+        pthread_barrier_destroy (&start_barrier);
+        rate = seconds * num_threads / elapsed;
+
+        if (num_threads == 1)
+            single_rate = rate;
+
+        fprintf (stderr, "%7d    %10.1fX    %9.1fX    %9.1f%%\n", num_threads, rate, rate / num_threads,
+            rate * 100.0 / num_threads / single_rate);
+
+        if (verbose_mode)
+            for (i = 0; i < num_threads; ++i)
+                fprintf (stderr, "    stream %d (CPU %d): %.3f seconds\n", i, pin_threads ? streams [i].cpu : -1, streams [i].seconds);
+
+        if (num_threads == max_threads)
+            break;
+    }
+
+    for (i = 0; i < max_threads; ++i) {
+        stretch_deinit (streams [i].stretcher);
+        free (streams [i].output);
+    }
+
+    free (signal_samples);
+    free (streams);
+    return 0;
+}
+
+// Run one stream: stretch the whole signal a buffer at a time (as a streaming
+// application would), then flush, once every stream has reached the barrier.
+
+static void *stream_thread (void *arg)
+{
+    Stream *stream = arg;
+    double start_time;
+    int position;
+
+    pthread_barrier_wait (&start_barrier);
+    start_time = clock_seconds ();
+
+    for (position = 0; position < total_samples; position += buffer_samples) {
+        int num_samples = total_samples - position < buffer_samples ? total_samples - position : buffer_samples;
+
+        stretch_samples (stream->stretcher, signal_samples + position * num_chans, num_samples, stream->output, ratio);
+    }
+
+    stretch_flush (stream->stretcher, stream->output);
+    stream->seconds = clock_seconds () - start_time;
+    return NULL;
+}
+
+// A speech-like test signal: a harmonic series gliding between 100 and 250 Hz
+// with a little noise, interrupted every second by a short burst of noise.
+
+static void generate_signal (void)
+{
+    uint32_t random = 0x3c6ef372;
+    double phase = 0.0;
+    int i, j;
+
+    if (!(signal_samples = malloc (total_samples * num_chans * sizeof (int16_t))))
+        return;
+
+    for (i = 0; i < total_samples; ++i) {
+        double t = (double) i / sample_rate, value = 0.0, noise;
+        int h;
+
+        phase += 2.0 * M_PI * (175.0 + 75.0 * sin (2.0 * M_PI * 0.7 * t)) / sample_rate;
+        random = random * 1664525 + 1013904223;
+        noise = ((int32_t) random >> 16) / 32768.0;
+
+        if (fmod (t, 1.0) < 0.1)
+            value = noise * 0.3;
+        else
+            for (h = 1; h <= 8; ++h)
+                value += sin (phase * h) * 0.25 / h;
+
+        value += noise * 0.01;
+
+        for (j = 0; j < num_chans; ++j)
+            signal_samples [i * num_chans + j] = (int16_t) floor (value * 32767.0 + 0.5);
+    }
+}
+
+static double clock_seconds (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
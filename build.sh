@@ -2,16 +2,30 @@
 
 if [ -z "$1" ] || [ "$1" = "rel" ]; then
   echo "building release .."
-  gcc -Ofast main.c stretch.c -lm -o audio-stretch
+  gcc -Ofast main.c stretch.c -lm -lpthread -o audio-stretch
 elif [ "$1" = "dbg" ]; then
   echo "building debug .."
-  gcc -O0 -g main.c stretch.c -lm -o audio-stretch
+  gcc -O0 -g main.c stretch.c -lm -lpthread -o audio-stretch
 elif [ "$1" = "ubsan" ]; then
   echo "building debug with undefined behaviour sanitizer .."
-  gcc -O0 -g main.c stretch.c -fsanitize=undefined -lm -o audio-stretch
+  gcc -O0 -g main.c stretch.c -fsanitize=undefined -lm -lpthread -o audio-stretch
 elif [ "$1" = "asan" ]; then
   echo "building debug with address sanitizer .."
-  gcc -O0 -g main.c stretch.c -fsanitize=address -lm -o audio-stretch
+  gcc -O0 -g main.c stretch.c -fsanitize=address -lm -lpthread -o audio-stretch
+elif [ "$1" = "quality" ]; then
+  echo "building quality-regression harness .."
+  gcc -Ofast quality.c stretch.c -lm -lpthread -o audio-quality
+elif [ "$1" = "api" ]; then
+  echo "building interface regression test .."
+  gcc -O2 -g apitest.c stretch.c -lm -lpthread -o audio-apitest
+elif [ "$1" = "daemon" ]; then
+  echo "building stretch daemon and load generator .."
+  gcc -Ofast stretchd.c stretch.c -lm -lpthread -o stretchd
+  gcc -O2 stretchload.c -lm -lpthread -o stretchload
+elif [ "$1" = "bench" ]; then
+  echo "building scaling benchmark (aligned and unaligned) .."
+  gcc -Ofast bench.c stretch.c -lm -lpthread -o audio-bench
+  gcc -Ofast -DSTRETCH_UNALIGNED bench.c stretch.c -lm -lpthread -o audio-bench-unaligned
 else
   echo "error: unknown option '$1'"
 fi
@@ -16,6 +16,12 @@
 #include <stdio.h>
 #include <math.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include "stretch.h"
 
 #define SILENCE_THRESHOLD_DB    -40
@@ -36,11 +42,29 @@ static const char *usage =
 "           -c      = cycle through all ratios, starting higher\n"
 "           -cc     = cycle through all ratios, starting lower\n"
 "           -d      = force dual instance even for shallow ratios\n"
-"           -s      = scale rate to preserve duration (not pitch)\n"
+"           -dd     = force dual instance and run it on two threads\n"
+"           -s      = resample to preserve duration (not pitch)\n"
+"           -w      = write Sony Wave64 output (default is WAV, or RF64\n"
+"                     when the output will not fit in a WAV file)\n"
+"           -m<file> = period map file (created if missing, else used\n"
+"                      to skip pitch detection when rendering)\n"
 "           -f      = fast pitch detection (default >= 32 kHz)\n"
 "           -n      = normal pitch detection (default < 32 kHz)\n"
+"           -p<n.n> = pitch detection budget (% of real time, degrades\n"
+"                     the detection as required to stay within it)\n"
+"           -z<n.n> = skip pitch detection on noise-like blocks with more\n"
+"                     zero crossings per shortest period (16 suggested)\n"
+"           -a<n.n> = narrow the period range to the pitch found over the\n"
+"                     first n seconds of speech (re-widened as needed)\n"
+"           -k<n>   = split the pitch detection of each block over n\n"
+"                     threads (for very long period ranges, e.g. -l20)\n"
 "           -q      = quiet mode (display errors only)\n"
-"           -v      = verbose (display lots of info)\n"
+"           -v      = verbose (display lots of info, including the\n"
+"                     latency of the stretch calls)\n"
+"           -x<file> = write the timing of every block processed to a\n"
+"                      CSV file\n"
+"           -j<file> = write a trace of every block processed to a\n"
+"                      JSON file (Chrome trace-event format)\n"
 "           -y      = overwrite outfile if it exists\n\n"
 " Web:      Visit www.github.com/dbry/audio-stretch for latest version\n\n";
 
@@ -73,24 +97,86 @@ typedef struct {
 #define WAVE_FORMAT_PCM         0x1
 #define WAVE_FORMAT_EXTENSIBLE  0xfffe
 
-static int write_pcm_wav_header (FILE *outfile, uint32_t num_samples, int num_channels, int bytes_per_sample, uint32_t sample_rate);
-double rms_level_dB (int16_t *audio, int samples, int channels);
+// RF64 files (EBU Tech 3306) store the 64-bit sizes in a "ds64" chunk that
+// immediately follows the header, and put 0xffffffff in the 32-bit fields
+
+typedef struct {
+    uint64_t riffSize, dataSize, sampleCount;
+    uint32_t tableLength;
+} DS64Chunk;
+
+#define DS64_CHUNK_BYTES        28
+
+// Sony Wave64 files use GUIDs instead of FourCCs, 64-bit sizes that include
+// the chunk header itself, and chunks aligned to 8 bytes
+
+typedef struct {
+    unsigned char ckID [16];
+    uint64_t ckSize;
+    unsigned char formType [16];
+} Wave64FileHeader;
+
+typedef struct {
+    unsigned char ckGUID [16];
+    uint64_t ckSize;
+} Wave64ChunkHeader;
+
+static const unsigned char w64_riff_guid [16] = { 'r','i','f','f', 0x2e,0x91,0xcf,0x11,0xa5,0xd6,0x28,0xdb,0x04,0xc1,0x00,0x00 };
+static const unsigned char w64_wave_guid [16] = { 'w','a','v','e', 0xf3,0xac,0xd3,0x11,0x8c,0xd1,0x00,0xc0,0x4f,0x8e,0xdb,0x8a };
+static const unsigned char w64_fmt_guid [16]  = { 'f','m','t',' ', 0xf3,0xac,0xd3,0x11,0x8c,0xd1,0x00,0xc0,0x4f,0x8e,0xdb,0x8a };
+static const unsigned char w64_data_guid [16] = { 'd','a','t','a', 0xf3,0xac,0xd3,0x11,0x8c,0xd1,0x00,0xc0,0x4f,0x8e,0xdb,0x8a };
+
+#define FILE_FORMAT_WAV         0   // classic RIFF WAV
+#define FILE_FORMAT_RF64        1   // RIFF WAV with room reserved for promotion to RF64
+#define FILE_FORMAT_W64         2   // Sony Wave64
+
+// timing of one call to stretch_samples() or stretch_flush()
+
+typedef struct {
+    double seconds;
+    int input_samples, output_samples, flush;
+    float ratio;
+} CallTiming;
+
+// the blocks processed, recorded by block_timing_hook() (one array per stage because
+// with STRETCH_THREADED_FLAG the cascaded instance calls the hook from its own thread)
+
+typedef struct {
+    StretchBlockEvent *blocks [2];
+    int num_blocks [2], failed [2];
+    FILE *tracefile;
+} BlockTiming;
+
+static int write_pcm_wav_header (FILE *outfile, int file_format, uint64_t num_samples, int num_channels, int bytes_per_sample, uint32_t sample_rate);
+static int check_wave_format (WaveHeader *wave_header, int chunk_size, char *infilename);
+static int skip_bytes (FILE *file, uint64_t bytes_to_skip);
+static int prepare_period_map (StretchHandle stretcher, FILE *infile, char *map_filename, uint64_t num_samples, int block_align, int buffer_samples);
+static double clock_seconds (void);
+static int record_call (CallTiming **calls, int *num_calls, double seconds, int input_samples, int output_samples, float ratio, int flush);
+static void block_timing_hook (void *context, const StretchBlockEvent *event);
+static void report_latency (CallTiming *calls, int num_calls, double dsp_seconds, double io_seconds, double audio_seconds);
+static int write_timing_csv (BlockTiming *timing, char *timing_filename);
 
 static int verbose_mode, quiet_mode;
 
 int main (argc, argv) int argc; char **argv;
 {
     int asked_help = 0, overwrite = 0, scale_rate = 0, force_fast = 0, force_normal = 0, force_dual = 0, cycle_ratio = 0;
-    float ratio = 1.0, silence_ratio = 0.0, silence_threshold_dB = SILENCE_THRESHOLD_DB;
-    uint32_t samples_to_process, insamples = 0, outsamples = 0;
+    int search_threads = 1;
+    float ratio = 1.0, silence_ratio = 0.0, silence_threshold_dB = SILENCE_THRESHOLD_DB, budget_percent = 0.0, unvoiced_threshold = 0.0;
+    float adaptive_seconds = 0.0;
+    int search_level = 0, max_search_level = 0;
+    uint64_t samples_to_process, insamples = 0, outsamples = 0, data_chunk_size = 0;
+    int file_format = FILE_FORMAT_WAV;
     int upper_frequency = 333, lower_frequency = 55;
-    char *infilename = NULL, *outfilename = NULL;
+    char *infilename = NULL, *outfilename = NULL, *map_filename = NULL, *timing_filename = NULL, *trace_filename = NULL;
     int audio_window_ms = AUDIO_WINDOW_MS;
     RiffChunkHeader riff_chunk_header;
     WaveHeader WaveHeader = { 0 };
     ChunkHeader chunk_header;
     StretchHandle stretcher;
-    FILE *infile, *outfile;
+    FILE *infile, *outfile, *tracefile = NULL;
+    BlockTiming timing = { { NULL, NULL }, { 0, 0 }, { 0, 0 }, NULL };
 
     // loop through command-line arguments
 
@@ -169,16 +255,97 @@ int main (argc, argv) int argc; char **argv;
                         --*argv;
                         break;
 
+                    case 'P': case 'p':
+                        budget_percent = strtod (++*argv, argv);
+
+                        if (budget_percent <= 0.0 || budget_percent > 100.0) {
+                            fprintf (stderr, "\npitch detection budget must be from 0 to 100%%!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'Z': case 'z':
+                        unvoiced_threshold = strtod (++*argv, argv);
+
+                        if (unvoiced_threshold <= 0.0) {
+                            fprintf (stderr, "\nzero-crossing threshold must be positive!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'A': case 'a':
+                        adaptive_seconds = strtod (++*argv, argv);
+
+                        if (adaptive_seconds <= 0.0 || adaptive_seconds > 3600.0) {
+                            fprintf (stderr, "\nadaptive learning time must be up to 3600 seconds!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'K': case 'k':
+                        search_threads = strtol (++*argv, argv, 10);
+
+                        if (search_threads < 1 || search_threads > 16) {
+                            fprintf (stderr, "\nsearch threads must be 1 to 16!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
                     case 'S': case 's':
                         scale_rate = 1;
                         break;
 
+                    case 'W': case 'w':
+                        file_format = FILE_FORMAT_W64;
+                        break;
+
                     case 'C': case 'c':
                         cycle_ratio++;
                         break;
 
+                    case 'M': case 'm':
+                        map_filename = ++*argv;
+
+                        if (!*map_filename) {
+                            fprintf (stderr, "\nno period map file specified!\n");
+                            return -1;
+                        }
+
+                        *argv += strlen (*argv) - 1;
+                        break;
+
+                    case 'X': case 'x':
+                        timing_filename = ++*argv;
+
+                        if (!*timing_filename) {
+                            fprintf (stderr, "\nno timing file specified!\n");
+                            return -1;
+                        }
+
+                        *argv += strlen (*argv) - 1;
+                        break;
+
+                    case 'J': case 'j':
+                        trace_filename = ++*argv;
+
+                        if (!*trace_filename) {
+                            fprintf (stderr, "\nno trace file specified!\n");
+                            return -1;
+                        }
+
+                        *argv += strlen (*argv) - 1;
+                        break;
+
                     case 'D': case 'd':
-                        force_dual = 1;
+                        force_dual++;
                         break;
 
                     case 'F': case 'f':
@@ -243,107 +410,135 @@ int main (argc, argv) int argc; char **argv;
         return 1;
     }
 
-    // read initial RIFF form header
+    // read initial RIFF (or RF64) form header, or the start of a Sony Wave64 header
 
-    if (!fread (&riff_chunk_header, sizeof (RiffChunkHeader), 1, infile) ||
-        strncmp (riff_chunk_header.ckID, "RIFF", 4) ||
-        strncmp (riff_chunk_header.formType, "WAVE", 4)) {
-            fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-            return 1;
+    if (!fread (&riff_chunk_header, sizeof (RiffChunkHeader), 1, infile)) {
+        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+        return 1;
     }
 
-    // loop through all elements of the RIFF wav header (until the data chuck)
+    if (!memcmp (&riff_chunk_header, w64_riff_guid, sizeof (RiffChunkHeader))) {
+        char w64_remainder [sizeof (Wave64FileHeader) - sizeof (RiffChunkHeader)];
+        Wave64FileHeader w64_file_header;
 
-    while (1) {
-        if (!fread (&chunk_header, sizeof (ChunkHeader), 1, infile)) {
-            fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+        if (!fread (w64_remainder, sizeof (w64_remainder), 1, infile)) {
+            fprintf (stderr, "\"%s\" is not a valid .W64 file!\n", infilename);
             return 1;
         }
 
-        // if it's the format chunk, we want to get some info out of there and
-        // make sure it's a .wav file we can handle
-
-        if (!strncmp (chunk_header.ckID, "fmt ", 4)) {
-            int format, bits_per_sample;
+        memcpy (&w64_file_header, &riff_chunk_header, sizeof (RiffChunkHeader));
+        memcpy ((char *) &w64_file_header + sizeof (RiffChunkHeader), w64_remainder, sizeof (w64_remainder));
 
-            if (chunk_header.ckSize < 16 || chunk_header.ckSize > sizeof (WaveHeader) ||
-                !fread (&WaveHeader, chunk_header.ckSize, 1, infile)) {
-                    fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                    return 1;
-            }
+        if (memcmp (w64_file_header.formType, w64_wave_guid, 16)) {
+            fprintf (stderr, "\"%s\" is not a valid .W64 file!\n", infilename);
+            return 1;
+        }
 
-            format = (WaveHeader.FormatTag == WAVE_FORMAT_EXTENSIBLE && chunk_header.ckSize == 40) ?
-                WaveHeader.SubFormat : WaveHeader.FormatTag;
+        // loop through all elements of the Wave64 header (until the data chunk)
 
-            bits_per_sample = (chunk_header.ckSize == 40 && WaveHeader.Samples.ValidBitsPerSample) ?
-                WaveHeader.Samples.ValidBitsPerSample : WaveHeader.BitsPerSample;
+        while (1) {
+            Wave64ChunkHeader w64_chunk_header;
 
-            if (bits_per_sample != 16) {
-                fprintf (stderr, "\"%s\" is not a 16-bit .WAV file!\n", infilename);
-                return 1;
+            if (!fread (&w64_chunk_header, sizeof (Wave64ChunkHeader), 1, infile) ||
+                w64_chunk_header.ckSize < sizeof (Wave64ChunkHeader)) {
+                    fprintf (stderr, "\"%s\" is not a valid .W64 file!\n", infilename);
+                    return 1;
             }
 
-            if (WaveHeader.NumChannels < 1 || WaveHeader.NumChannels > 2) {
-                fprintf (stderr, "\"%s\" is not a mono or stereo .WAV file!\n", infilename);
-                return 1;
-            }
+            w64_chunk_header.ckSize -= sizeof (Wave64ChunkHeader);
 
-            if (WaveHeader.BlockAlign != WaveHeader.NumChannels * 2) {
-                fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                return 1;
-            }
+            if (!memcmp (w64_chunk_header.ckGUID, w64_fmt_guid, 16)) {
+                if (w64_chunk_header.ckSize < 16 || w64_chunk_header.ckSize > sizeof (WaveHeader) ||
+                    !fread (&WaveHeader, (size_t) w64_chunk_header.ckSize, 1, infile) ||
+                    !skip_bytes (infile, ((w64_chunk_header.ckSize + 7) & ~7ULL) - w64_chunk_header.ckSize)) {
+                        fprintf (stderr, "\"%s\" is not a valid .W64 file!\n", infilename);
+                        return 1;
+                }
 
-            if (format == WAVE_FORMAT_PCM) {
-                if (WaveHeader.SampleRate < 8000 || WaveHeader.SampleRate > 48000) {
-                    fprintf (stderr, "\"%s\" sample rate is %lu, must be 8000 to 48000!\n", infilename, (unsigned long) WaveHeader.SampleRate);
+                if (!check_wave_format (&WaveHeader, (int) w64_chunk_header.ckSize, infilename))
                     return 1;
-                }
             }
-            else {
-                fprintf (stderr, "\"%s\" is not a PCM .WAV file!\n", infilename);
+            else if (!memcmp (w64_chunk_header.ckGUID, w64_data_guid, 16)) {
+                data_chunk_size = w64_chunk_header.ckSize;
+                break;
+            }
+            else if (!skip_bytes (infile, (w64_chunk_header.ckSize + 7) & ~7ULL)) {
+                fprintf (stderr, "\"%s\" is not a valid .W64 file!\n", infilename);
                 return 1;
             }
         }
-        else if (!strncmp (chunk_header.ckID, "data", 4)) {
+    }
+    else if ((strncmp (riff_chunk_header.ckID, "RIFF", 4) && strncmp (riff_chunk_header.ckID, "RF64", 4)) ||
+        strncmp (riff_chunk_header.formType, "WAVE", 4)) {
+            fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+            return 1;
+    }
+    else {
+        DS64Chunk ds64_chunk = { 0 };
+        int is_rf64 = !strncmp (riff_chunk_header.ckID, "RF64", 4);
 
-            // on the data chunk, get size and exit parsing loop
+        // loop through all elements of the RIFF wav header (until the data chuck)
 
-            if (!WaveHeader.SampleRate) {      // make sure we saw a "fmt" chunk...
+        while (1) {
+            if (!fread (&chunk_header, sizeof (ChunkHeader), 1, infile)) {
                 fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
                 return 1;
             }
 
-            if (!chunk_header.ckSize) {
-                fprintf (stderr, "this .WAV file has no audio samples, probably is corrupt!\n");
-                return 1;
+            // if it's the format chunk, we want to get some info out of there and
+            // make sure it's a .wav file we can handle
+
+            if (!strncmp (chunk_header.ckID, "fmt ", 4)) {
+                if (chunk_header.ckSize < 16 || chunk_header.ckSize > sizeof (WaveHeader) ||
+                    !fread (&WaveHeader, chunk_header.ckSize, 1, infile) ||
+                    !skip_bytes (infile, chunk_header.ckSize & 1)) {
+                        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+                        return 1;
+                }
+
+                if (!check_wave_format (&WaveHeader, chunk_header.ckSize, infilename))
+                    return 1;
             }
+            else if (is_rf64 && !strncmp (chunk_header.ckID, "ds64", 4)) {
+
+                // the RF64 "ds64" chunk holds the 64-bit sizes for the chunks that can't fit them
 
-            if (chunk_header.ckSize % WaveHeader.BlockAlign) {
+                if (chunk_header.ckSize < DS64_CHUNK_BYTES || !fread (&ds64_chunk, DS64_CHUNK_BYTES, 1, infile) ||
+                    !skip_bytes (infile, ((chunk_header.ckSize + 1) & ~1L) - DS64_CHUNK_BYTES)) {
+                        fprintf (stderr, "\"%s\" is not a valid RF64 file!\n", infilename);
+                        return 1;
+                }
+            }
+            else if (!strncmp (chunk_header.ckID, "data", 4)) {
+                data_chunk_size = (is_rf64 && chunk_header.ckSize == 0xffffffff) ? ds64_chunk.dataSize : chunk_header.ckSize;
+                break;
+            }
+            else if (!skip_bytes (infile, (chunk_header.ckSize + 1) & ~1L)) {      // just ignore unknown chunks
                 fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
                 return 1;
             }
+        }
+    }
 
-            samples_to_process = chunk_header.ckSize / WaveHeader.BlockAlign;
+    // on the data chunk, get size (common to all formats)
 
-            if (!samples_to_process) {
-                fprintf (stderr, "this .WAV file has no audio samples, probably is corrupt!\n");
-                return 1;
-            }
+    if (!WaveHeader.SampleRate) {      // make sure we saw a "fmt" chunk...
+        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+        return 1;
+    }
 
-            break;
-        }
-        else {          // just ignore unknown chunks
-            uint32_t bytes_to_eat = (chunk_header.ckSize + 1) & ~1L;
-            char dummy;
+    if (!data_chunk_size) {
+        fprintf (stderr, "this .WAV file has no audio samples, probably is corrupt!\n");
+        return 1;
+    }
 
-            while (bytes_to_eat--)
-                if (!fread (&dummy, 1, 1, infile)) {
-                    fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                    return 1;
-                }
-        }
+    if (data_chunk_size % WaveHeader.BlockAlign) {
+        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+        return 1;
     }
 
+    samples_to_process = data_chunk_size / WaveHeader.BlockAlign;
+
     if (upper_frequency < lower_frequency * 2 || upper_frequency >= WaveHeader.SampleRate / 2) {
         fprintf (stderr, "invalid frequencies specified!\n");
         fclose (infile);
@@ -360,22 +555,29 @@ int main (argc, argv) int argc; char **argv;
         (silence_mode && (silence_ratio < 0.5 || silence_ratio > 2.0)))
             flags |= STRETCH_DUAL_FLAG;
 
+    if (force_dual > 1)
+        flags |= STRETCH_THREADED_FLAG;
+
     if ((force_fast || WaveHeader.SampleRate >= 32000) && !force_normal)
         flags |= STRETCH_FAST_FLAG;
 
+    if (scale_rate)
+        flags |= STRETCH_PITCH_FLAG;
+
     if (verbose_mode) {
         fprintf (stderr, "file sample rate is %lu Hz (%s), buffer size is %d samples\n",
             (unsigned long) WaveHeader.SampleRate, WaveHeader.NumChannels == 2 ? "stereo" : "mono", buffer_samples);
-        fprintf (stderr, "stretch period range = %d to %d, %d channels, %s, %s\n",
+        fprintf (stderr, "stretch period range = %d to %d, %d channels, %s, %s%s%s\n",
             min_period, max_period, WaveHeader.NumChannels, (flags & STRETCH_FAST_FLAG) ? "fast mode" : "normal mode",
-            (flags & STRETCH_DUAL_FLAG) ? "dual instance" : "single instance");
+            (flags & STRETCH_DUAL_FLAG) ? ((flags & STRETCH_THREADED_FLAG) ? "threaded dual instance" : "dual instance") : "single instance",
+            scale_rate ? ", pitch shift" : "", search_threads > 1 ? ", threaded pitch detection" : "");
     }
 
     if (!quiet_mode && ratio == 1.0 && !silence_mode && !cycle_ratio)
         fprintf (stderr, "warning: a ratio of 1.0 will do nothing but copy the WAV file!\n");
 
     if (!quiet_mode && ratio != 1.0 && cycle_ratio && !scale_rate)
-        fprintf (stderr, "warning: specifying ratio with cycling doesn't do anything (unless scaling rate)\n");
+        fprintf (stderr, "warning: specifying ratio with cycling doesn't do anything (unless resampling)\n");
 
     stretcher = stretch_init (min_period, max_period, WaveHeader.NumChannels, flags);
 
@@ -385,33 +587,90 @@ int main (argc, argv) int argc; char **argv;
         return 1;
     }
 
+    if (silence_mode && !stretch_set_gap (stretcher, silence_ratio, silence_threshold_dB, buffer_samples)) {
+        fprintf (stderr, "can't allocate required memory!\n");
+        fclose (infile);
+        return 1;
+    }
+
+    if (unvoiced_threshold)
+        stretch_set_unvoiced (stretcher, unvoiced_threshold);
+
+    if (adaptive_seconds)
+        stretch_set_adaptive (stretcher, WaveHeader.SampleRate, adaptive_seconds);
+
+    if (search_threads > 1)
+        stretch_set_search_threads (stretcher, search_threads);
+
+    // the map is made (or checked) with the settings above, which change the periods found
+
+    if (map_filename && !prepare_period_map (stretcher, infile, map_filename, samples_to_process, WaveHeader.BlockAlign, buffer_samples)) {
+        fclose (infile);
+        return 1;
+    }
+
+    if (budget_percent)
+        stretch_set_governor (stretcher, WaveHeader.SampleRate, budget_percent / 100.0, 4);
+
+    // the trace is a JSON array of events, which the library's hook appends to
+
+    if (trace_filename) {
+        if (!(tracefile = fopen (trace_filename, "w"))) {
+            fprintf (stderr, "can't open file \"%s\" for writing!\n", trace_filename);
+            fclose (infile);
+            return 1;
+        }
+
+        fprintf (tracefile, "[\n");
+        stretch_set_block_hook (stretcher, stretch_trace_hook, tracefile);
+    }
+
+    // the timing hook records every block, and passes them on to the trace if there is one
+
+    if (timing_filename) {
+        timing.tracefile = tracefile;
+        stretch_set_block_hook (stretcher, block_timing_hook, &timing);
+    }
+
+    // the pitch shift is fixed at the specified ratio, even when cycling or stretching gaps
+
+    if (scale_rate)
+        stretch_set_pitch_ratio (stretcher, ratio);
+
     if (!(outfile = fopen (outfilename, "wb"))) {
         fprintf (stderr, "can't open file \"%s\" for writing!\n", outfilename);
         fclose (infile);
         return 1;
     }
 
-    uint32_t scaled_rate = scale_rate ? (uint32_t)(WaveHeader.SampleRate * ratio + 0.5) : WaveHeader.SampleRate;
-    write_pcm_wav_header (outfile, 0, WaveHeader.NumChannels, 2, scaled_rate);
-
     if (cycle_ratio)
         max_ratio = (flags & STRETCH_DUAL_FLAG) ? 4.0 : 2.0;
     else if (silence_mode && silence_ratio > max_ratio)
         max_ratio = silence_ratio;
 
     int max_expected_samples = stretch_output_capacity (stretcher, buffer_samples, max_ratio);
-    int16_t *inbuffer = malloc (buffer_samples * WaveHeader.BlockAlign), *prebuffer = NULL;
-    int16_t *outbuffer = malloc (max_expected_samples * WaveHeader.BlockAlign);
-    int non_silence_frames = 0, silence_frames = 0, used_silence_frames = 0;
-    int max_generated_stretch = 0, max_generated_flush = 0;
-    int samples_to_stretch = 0, consecutive_silence_frames = 1;
+    double max_length_ratio = ceil (max_ratio * 2.0) / 2.0;
 
-    /* in the gap/silence mode we need an additional buffer to scan the "next" buffer for level */
+    if (scale_rate)
+        max_length_ratio /= ratio;      // resampled back down (or up) by the pitch ratio
 
-    if (silence_mode)
-        prebuffer = malloc (buffer_samples * WaveHeader.BlockAlign);
+    // if the output could possibly overflow a WAV file, reserve room for the RF64 "ds64" chunk
 
-    if (!inbuffer || !outbuffer || (silence_mode && !prebuffer)) {
+    if (file_format == FILE_FORMAT_WAV &&
+        (samples_to_process * max_length_ratio + max_expected_samples) * WaveHeader.BlockAlign > 0xffffff00)
+            file_format = FILE_FORMAT_RF64;
+
+    write_pcm_wav_header (outfile, file_format, 0, WaveHeader.NumChannels, 2, WaveHeader.SampleRate);
+    int16_t *inbuffer = malloc (buffer_samples * WaveHeader.BlockAlign);
+    int16_t *outbuffer = malloc (max_expected_samples * WaveHeader.BlockAlign);
+    int total_frames, silence_frames, used_silence_frames, unvoiced_blocks;
+    int adaptive_shortest, adaptive_longest, adaptive_widenings;
+    int max_generated_stretch = 0, max_generated_flush = 0;
+    double dsp_seconds = 0.0, io_seconds = 0.0, start_time, call_seconds;
+    CallTiming *calls = NULL;
+    int num_calls = 0;
+
+    if (!inbuffer || !outbuffer) {
         fprintf (stderr, "can't allocate required memory!\n");
         fclose (infile);
         return 1;
@@ -420,34 +679,19 @@ int main (argc, argv) int argc; char **argv;
     /* read the entire file in frames and process with stretch */
 
     while (1) {
-        int samples_read = fread (silence_mode ? prebuffer : inbuffer, WaveHeader.BlockAlign,
+        int samples_read, samples_generated;
+
+        start_time = clock_seconds ();
+        samples_read = fread (inbuffer, WaveHeader.BlockAlign,
             samples_to_process >= buffer_samples ? buffer_samples : samples_to_process, infile);
+        io_seconds += clock_seconds () - start_time;
 
-        if (!silence_mode && !samples_read)
+        if (!samples_read)
             break;
 
         insamples += samples_read;
         samples_to_process -= samples_read;
 
-        /* this is where we scan the frame we just read to see if it's below the silence threshold */
-
-        if (silence_mode) {
-            if (samples_read) {
-                double level = rms_level_dB (prebuffer, samples_read, WaveHeader.NumChannels);
-
-                if (level > silence_threshold_dB) {
-                    consecutive_silence_frames = 0;
-                    non_silence_frames++;
-                }
-                else {
-                    consecutive_silence_frames++;
-                    silence_frames++;
-                }
-            }
-        }
-        else
-            samples_to_stretch = samples_read;
-
         if (cycle_ratio) {
             if (flags & STRETCH_DUAL_FLAG)
                 ratio = (sin ((double) outsamples / WaveHeader.SampleRate / 2.0) * (cycle_ratio & 1 ? 1.875 : -1.875)) + 2.125;
@@ -455,47 +699,61 @@ int main (argc, argv) int argc; char **argv;
                 ratio = (sin ((double) outsamples / WaveHeader.SampleRate) * (cycle_ratio & 1 ? 0.75 : -0.75)) + 1.25;
         }
 
-        if (samples_to_stretch) {
-            int samples_generated;
+        /* in gap/silence mode, the library switches to the gap ratio itself wherever it detects silence */
 
-            /* we use the gap/silence stretch ratio if the current frame, and the ones on either side, measure below the threshold */
+        start_time = clock_seconds ();
+        samples_generated = stretch_samples (stretcher, inbuffer, samples_read, outbuffer, ratio);
+        call_seconds = clock_seconds () - start_time;
+        dsp_seconds += call_seconds;
 
-            if (consecutive_silence_frames >= 3) {
-                samples_generated = stretch_samples (stretcher, inbuffer, samples_to_stretch, outbuffer, silence_ratio);
-                used_silence_frames++;
-            }
-            else
-                samples_generated = stretch_samples (stretcher, inbuffer, samples_to_stretch, outbuffer, ratio);
+        if (!record_call (&calls, &num_calls, call_seconds, samples_read, samples_generated, ratio, 0)) {
+            fprintf (stderr, "can't allocate required memory!\n");
+            fclose (infile);
+            return 1;
+        }
 
-            if (samples_generated) {
-                if (samples_generated > max_generated_stretch)
-                    max_generated_stretch = samples_generated;
+        if (budget_percent && stretch_governor_level (stretcher) != search_level) {
+            search_level = stretch_governor_level (stretcher);
 
-                fwrite (outbuffer, WaveHeader.BlockAlign, samples_generated, outfile);
-                outsamples += samples_generated;
+            if (search_level > max_search_level)
+                max_search_level = search_level;
 
-                if (samples_generated > max_expected_samples) {
-                    fprintf (stderr, "stretch: generated samples (%d) exceeded expected (%d)!\n", samples_generated, max_expected_samples);
-                    fclose (infile);
-                    return 1;
-                }
-            }
+            if (verbose_mode)
+                fprintf (stderr, "pitch detection level %d at %.2f seconds\n", search_level, (double) insamples / WaveHeader.SampleRate);
         }
 
-        if (silence_mode) {
-            if (samples_read) {
-                memcpy (inbuffer, prebuffer, samples_read * WaveHeader.BlockAlign);
-                samples_to_stretch = samples_read;
+        if (samples_generated) {
+            if (samples_generated > max_generated_stretch)
+                max_generated_stretch = samples_generated;
+
+            start_time = clock_seconds ();
+            fwrite (outbuffer, WaveHeader.BlockAlign, samples_generated, outfile);
+            io_seconds += clock_seconds () - start_time;
+            outsamples += samples_generated;
+
+            if (samples_generated > max_expected_samples) {
+                fprintf (stderr, "stretch: generated samples (%d) exceeded expected (%d)!\n", samples_generated, max_expected_samples);
+                fclose (infile);
+                return 1;
             }
-            else
-                break;
         }
     }
 
     /* next call the stretch flush function until it returns zero */
 
     while (1) {
-        int samples_flushed = stretch_flush (stretcher, outbuffer);
+        int samples_flushed;
+
+        start_time = clock_seconds ();
+        samples_flushed = stretch_flush (stretcher, outbuffer);
+        call_seconds = clock_seconds () - start_time;
+        dsp_seconds += call_seconds;
+
+        if (!record_call (&calls, &num_calls, call_seconds, 0, samples_flushed, ratio, 1)) {
+            fprintf (stderr, "can't allocate required memory!\n");
+            fclose (infile);
+            return 1;
+        }
 
         if (!samples_flushed)
             break;
@@ -503,7 +761,9 @@ int main (argc, argv) int argc; char **argv;
         if (samples_flushed > max_generated_flush)
             max_generated_flush = samples_flushed;
 
+        start_time = clock_seconds ();
         fwrite (outbuffer, WaveHeader.BlockAlign, samples_flushed, outfile);
+        io_seconds += clock_seconds () - start_time;
         outsamples += samples_flushed;
 
         if (samples_flushed > max_expected_samples) {
@@ -515,42 +775,80 @@ int main (argc, argv) int argc; char **argv;
 
     free (inbuffer);
     free (outbuffer);
-    free (prebuffer);
+    stretch_gap_stats (stretcher, &total_frames, &silence_frames, &used_silence_frames);
+    unvoiced_blocks = stretch_unvoiced_blocks (stretcher);
+    adaptive_widenings = stretch_adaptive_range (stretcher, &adaptive_shortest, &adaptive_longest);
     stretch_deinit (stretcher);
 
+    if (tracefile) {
+        fprintf (tracefile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"audio-stretch\"}}\n]\n");
+
+        if (fclose (tracefile)) {
+            fprintf (stderr, "can't write file \"%s\"!\n", trace_filename);
+            fclose (infile);
+            return 1;
+        }
+    }
+
     fclose (infile);
 
     rewind (outfile);
-    write_pcm_wav_header (outfile, outsamples, WaveHeader.NumChannels, 2, scaled_rate);
+
+    if (!write_pcm_wav_header (outfile, file_format, outsamples, WaveHeader.NumChannels, 2, WaveHeader.SampleRate)) {
+        fprintf (stderr, "can't write final header to \"%s\", output is too large for a WAV file!\n", outfilename);
+        fclose (outfile);
+        return 1;
+    }
+
     fclose (outfile);
 
     if (insamples && verbose_mode) {
-        fprintf (stderr, "done, %lu samples --> %lu samples (ratio = %.3f)\n",
-            (unsigned long) insamples, (unsigned long) outsamples, (float) outsamples / insamples);
+        fprintf (stderr, "done, %llu samples --> %llu samples (ratio = %.3f)\n",
+            (unsigned long long) insamples, (unsigned long long) outsamples, (float) outsamples / insamples);
+        if (file_format != FILE_FORMAT_WAV)
+            fprintf (stderr, "output file written in %s format\n", file_format == FILE_FORMAT_W64 ? "Sony Wave64" :
+                (outsamples * WaveHeader.BlockAlign > 0xffffff00 ? "RF64" : "WAV (with RF64 reserve)"));
         if (scale_rate)
-            fprintf (stderr, "sample rate changed from %lu Hz to %lu Hz\n",
-                (unsigned long) WaveHeader.SampleRate, (unsigned long) scaled_rate);
+            fprintf (stderr, "pitch shifted by %.3f (%+.2f semitones)\n", ratio, log2 (ratio) * 12.0);
         fprintf (stderr, "max expected samples = %d, actually seen = %d stretch, %d flush\n",
             max_expected_samples, max_generated_stretch, max_generated_flush);
-        if (silence_frames || non_silence_frames) {
-            int total_frames = silence_frames + non_silence_frames;
+        if (budget_percent)
+            fprintf (stderr, "pitch detection budget %.2f%%, worst detection level used = %d\n", budget_percent, max_search_level);
+        if (unvoiced_threshold)
+            fprintf (stderr, "%d noise-like blocks skipped pitch detection\n", unvoiced_blocks);
+        if (adaptive_seconds)
+            fprintf (stderr, "adaptive period range at end = %d to %d samples (widened %d times)\n",
+                adaptive_shortest, adaptive_longest, adaptive_widenings);
+        if (total_frames)
             fprintf (stderr, "%d silence frames detected (%.2f%%), %d actually used (%.2f%%)\n",
                 silence_frames, silence_frames * 100.0 / total_frames,
-                used_silence_frames, used_silence_frames * 100.0 / total_frames); 
-        }
+                used_silence_frames, used_silence_frames * 100.0 / total_frames);
+        report_latency (calls, num_calls, dsp_seconds, io_seconds, (double) insamples / WaveHeader.SampleRate);
+    }
+
+    free (calls);
+
+    if (timing_filename && !write_timing_csv (&timing, timing_filename)) {
+        free (timing.blocks [0]);
+        free (timing.blocks [1]);
+        return 1;
     }
 
+    free (timing.blocks [0]);
+    free (timing.blocks [1]);
     return 0;
 }
 
-static int write_pcm_wav_header (FILE *outfile, uint32_t num_samples, int num_channels, int bytes_per_sample, uint32_t sample_rate)
+static int write_pcm_wav_header (FILE *outfile, int file_format, uint64_t num_samples, int num_channels, int bytes_per_sample, uint32_t sample_rate)
 {
     RiffChunkHeader riffhdr;
-    ChunkHeader datahdr, fmthdr;
+    ChunkHeader datahdr, fmthdr, ds64hdr;
+    DS64Chunk ds64chunk;
     WaveHeader wavhdr;
 
     int wavhdrsize = 16;
-    uint32_t total_data_bytes = num_samples * bytes_per_sample * num_channels;
+    uint64_t total_data_bytes = num_samples * bytes_per_sample * num_channels;
+    uint64_t total_riff_bytes = 4 + sizeof (fmthdr) + wavhdrsize + sizeof (datahdr) + total_data_bytes;
 
     memset (&wavhdr, 0, sizeof (wavhdr));
 
@@ -561,34 +859,361 @@ static int write_pcm_wav_header (FILE *outfile, uint32_t num_samples, int num_ch
     wavhdr.BlockAlign = bytes_per_sample * num_channels;
     wavhdr.BitsPerSample = bytes_per_sample * 8;
 
+    if (file_format == FILE_FORMAT_W64) {
+        Wave64ChunkHeader fmt64hdr, data64hdr;
+        Wave64FileHeader filehdr;
+
+        memcpy (filehdr.ckID, w64_riff_guid, sizeof (filehdr.ckID));
+        memcpy (filehdr.formType, w64_wave_guid, sizeof (filehdr.formType));
+        memcpy (fmt64hdr.ckGUID, w64_fmt_guid, sizeof (fmt64hdr.ckGUID));
+        memcpy (data64hdr.ckGUID, w64_data_guid, sizeof (data64hdr.ckGUID));
+        fmt64hdr.ckSize = sizeof (fmt64hdr) + wavhdrsize;
+        data64hdr.ckSize = sizeof (data64hdr) + total_data_bytes;
+        filehdr.ckSize = sizeof (filehdr) + fmt64hdr.ckSize + data64hdr.ckSize;
+
+        return fwrite (&filehdr, sizeof (filehdr), 1, outfile) &&
+            fwrite (&fmt64hdr, sizeof (fmt64hdr), 1, outfile) &&
+            fwrite (&wavhdr, wavhdrsize, 1, outfile) &&
+            fwrite (&data64hdr, sizeof (data64hdr), 1, outfile);
+    }
+
     memcpy (riffhdr.ckID, "RIFF", sizeof (riffhdr.ckID));
     memcpy (riffhdr.formType, "WAVE", sizeof (riffhdr.formType));
-    riffhdr.ckSize = sizeof (riffhdr) + wavhdrsize + sizeof (datahdr) + total_data_bytes;
     memcpy (fmthdr.ckID, "fmt ", sizeof (fmthdr.ckID));
     fmthdr.ckSize = wavhdrsize;
-
     memcpy (datahdr.ckID, "data", sizeof (datahdr.ckID));
-    datahdr.ckSize = total_data_bytes;
+    datahdr.ckSize = (uint32_t) total_data_bytes;
+
+    // the RF64 reserve is written as a "JUNK" chunk unless it's actually needed
+
+    if (file_format == FILE_FORMAT_RF64) {
+        total_riff_bytes += sizeof (ds64hdr) + DS64_CHUNK_BYTES;
+        memset (&ds64chunk, 0, sizeof (ds64chunk));
+        memcpy (ds64hdr.ckID, "JUNK", sizeof (ds64hdr.ckID));
+        ds64hdr.ckSize = DS64_CHUNK_BYTES;
+
+        if (total_riff_bytes > 0xffffffff) {
+            memcpy (riffhdr.ckID, "RF64", sizeof (riffhdr.ckID));
+            memcpy (ds64hdr.ckID, "ds64", sizeof (ds64hdr.ckID));
+            ds64chunk.riffSize = total_riff_bytes;
+            ds64chunk.dataSize = total_data_bytes;
+            ds64chunk.sampleCount = num_samples;
+            datahdr.ckSize = 0xffffffff;
+            total_riff_bytes = 0xffffffff;
+        }
+    }
+    else if (total_riff_bytes > 0xffffffff)
+        return 0;
+
+    riffhdr.ckSize = (uint32_t) total_riff_bytes;
 
     return fwrite (&riffhdr, sizeof (riffhdr), 1, outfile) &&
+        (file_format != FILE_FORMAT_RF64 || (fwrite (&ds64hdr, sizeof (ds64hdr), 1, outfile) &&
+            fwrite (&ds64chunk, DS64_CHUNK_BYTES, 1, outfile))) &&
         fwrite (&fmthdr, sizeof (fmthdr), 1, outfile) &&
         fwrite (&wavhdr, wavhdrsize, 1, outfile) &&
         fwrite (&datahdr, sizeof (datahdr), 1, outfile);
 }
 
-double rms_level_dB (int16_t *audio, int samples, int channels)
+// make sure the format chunk describes audio we can handle (shared by all the file formats)
+
+static int check_wave_format (WaveHeader *wave_header, int chunk_size, char *infilename)
 {
-    double rms_sum = 0.0;
-    int i;
+    int format, bits_per_sample;
+
+    format = (wave_header->FormatTag == WAVE_FORMAT_EXTENSIBLE && chunk_size == 40) ?
+        wave_header->SubFormat : wave_header->FormatTag;
+
+    bits_per_sample = (chunk_size == 40 && wave_header->Samples.ValidBitsPerSample) ?
+        wave_header->Samples.ValidBitsPerSample : wave_header->BitsPerSample;
+
+    if (bits_per_sample != 16) {
+        fprintf (stderr, "\"%s\" is not a 16-bit .WAV file!\n", infilename);
+        return 0;
+    }
+
+    if (wave_header->NumChannels < 1 || wave_header->NumChannels > 2) {
+        fprintf (stderr, "\"%s\" is not a mono or stereo .WAV file!\n", infilename);
+        return 0;
+    }
+
+    if (wave_header->BlockAlign != wave_header->NumChannels * 2) {
+        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+        return 0;
+    }
+
+    if (format == WAVE_FORMAT_PCM) {
+        if (wave_header->SampleRate < 8000 || wave_header->SampleRate > 48000) {
+            fprintf (stderr, "\"%s\" sample rate is %lu, must be 8000 to 48000!\n", infilename, (unsigned long) wave_header->SampleRate);
+            return 0;
+        }
+    }
+    else {
+        fprintf (stderr, "\"%s\" is not a PCM .WAV file!\n", infilename);
+        return 0;
+    }
+
+    return 1;
+}
+
+// read past bytes we don't care about (without seeking, so pipes work too)
+
+static int skip_bytes (FILE *file, uint64_t bytes_to_skip)
+{
+    char dummy [256];
+
+    while (bytes_to_skip) {
+        size_t bytes = bytes_to_skip > sizeof (dummy) ? sizeof (dummy) : (size_t) bytes_to_skip;
+
+        if (fread (dummy, 1, bytes, file) != bytes)
+            return 0;
+
+        bytes_to_skip -= bytes;
+    }
+
+    return 1;
+}
+
+/*
+ * Load the period map for the input file into the stretcher, creating it first (with an
+ * analysis pass over the whole file) if the map file doesn't exist yet. Either way the
+ * input file is left positioned at the start of the audio data.
+ */
+
+static int prepare_period_map (StretchHandle stretcher, FILE *infile, char *map_filename, uint64_t num_samples, int block_align, int buffer_samples)
+{
+    int16_t *buffer = malloc (buffer_samples * block_align);
+    FILE *mapfile = fopen (map_filename, "rb");
+    uint64_t samples_left;
+    long data_start = ftell (infile);
+    unsigned char *map = NULL;
+    uint32_t checksum = 0;
+    int map_bytes = 0;
+
+    if (num_samples > UINT32_MAX) {
+        fprintf (stderr, "input file is too long to use a period map!\n");
+        free (buffer);
+
+        if (mapfile)
+            fclose (mapfile);
+
+        return 0;
+    }
+
+    if (!buffer || data_start < 0) {
+        fprintf (stderr, "can't prepare period map!\n");
+        free (buffer);
+
+        if (mapfile)
+            fclose (mapfile);
+
+        return 0;
+    }
+
+    // read through the audio once, checksumming it (and analyzing it if there's no map yet)
+
+    for (samples_left = num_samples; samples_left;) {
+        int samples_read = fread (buffer, block_align, samples_left >= (uint64_t) buffer_samples ? (uint64_t) buffer_samples : samples_left, infile);
 
-    if (channels == 1)
-        for (i = 0; i < samples; ++i)
-            rms_sum += (double) audio [i] * audio [i];
-    else
-        for (i = 0; i < samples; ++i) {
-            double average = (audio [i * 2] + audio [i * 2 + 1]) / 2.0;
-            rms_sum += average * average;
+        if (!samples_read)
+            break;
+
+        checksum = stretch_map_checksum (stretcher, checksum, buffer, samples_read);
+        samples_left -= samples_read;
+
+        if (!mapfile && !stretch_analyze (stretcher, buffer, samples_read)) {
+            fprintf (stderr, "can't allocate memory for period map!\n");
+            free (buffer);
+            return 0;
         }
+    }
+
+    free (buffer);
+    num_samples -= samples_left;
+
+    if (fseek (infile, data_start, SEEK_SET)) {
+        fprintf (stderr, "can't seek input file to create period map!\n");
+
+        if (mapfile)
+            fclose (mapfile);
+
+        return 0;
+    }
+
+    if (mapfile) {
+        if (!fseek (mapfile, 0, SEEK_END) && (map_bytes = ftell (mapfile)) > 0 && !fseek (mapfile, 0, SEEK_SET) &&
+            (map = malloc (map_bytes)) && fread (map, map_bytes, 1, mapfile) != 1)
+                map_bytes = 0;
+
+        fclose (mapfile);
+    }
+    else if ((map_bytes = stretch_map_bytes (stretcher)) && (map = malloc (map_bytes))) {
+        stretch_map_save (stretcher, map);
+
+        if (!(mapfile = fopen (map_filename, "wb")) || fwrite (map, map_bytes, 1, mapfile) != 1) {
+            fprintf (stderr, "can't write period map file \"%s\"!\n", map_filename);
+            map_bytes = 0;
+        }
+        else if (verbose_mode)
+            fprintf (stderr, "period map with %d bytes written to \"%s\"\n", map_bytes, map_filename);
+
+        if (mapfile)
+            fclose (mapfile);
+    }
+
+    if (!map || map_bytes <= 0 || !stretch_map_load (stretcher, map, map_bytes, (uint32_t) num_samples, checksum)) {
+        fprintf (stderr, "period map \"%s\" is not valid for this input and configuration!\n", map_filename);
+        free (map);
+        return 0;
+    }
+
+    free (map);
+    return 1;
+}
+
+// monotonic time in seconds (from an arbitrary start)
+
+static double clock_seconds (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+
+    QueryPerformanceCounter (&counter);
+    QueryPerformanceFrequency (&frequency);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// append the timing of one stretch call to the (growing) array
+
+static int record_call (CallTiming **calls, int *num_calls, double seconds, int input_samples, int output_samples, float ratio, int flush)
+{
+    if (!*num_calls || (*num_calls >= 1024 && !(*num_calls & (*num_calls - 1)))) {
+        CallTiming *new_calls = realloc (*calls, (*num_calls ? *num_calls * 2 : 1024) * sizeof (**calls));
+
+        if (!new_calls)
+            return 0;
+
+        *calls = new_calls;
+    }
+
+    (*calls) [*num_calls].seconds = seconds;
+    (*calls) [*num_calls].input_samples = input_samples;
+    (*calls) [*num_calls].output_samples = output_samples;
+    (*calls) [*num_calls].ratio = ratio;
+    (*calls) [*num_calls].flush = flush;
+    ++*num_calls;
+    return 1;
+}
+
+// block hook that appends each block to the (growing) array of its stage, and then traces it
+
+static void block_timing_hook (void *context, const StretchBlockEvent *event)
+{
+    BlockTiming *timing = (BlockTiming *) context;
+    int stage = event->stage ? 1 : 0, num_blocks = timing->num_blocks [stage];
+
+    if (!num_blocks || (num_blocks >= 1024 && !(num_blocks & (num_blocks - 1)))) {
+        StretchBlockEvent *new_blocks = realloc (timing->blocks [stage], (num_blocks ? num_blocks * 2 : 1024) * sizeof (*new_blocks));
+
+        if (new_blocks)
+            timing->blocks [stage] = new_blocks;
+        else
+            timing->failed [stage] = 1;
+    }
+
+    if (timing->blocks [stage] && !timing->failed [stage])
+        timing->blocks [stage] [timing->num_blocks [stage]++] = *event;
+
+    if (timing->tracefile)
+        stretch_trace_hook (timing->tracefile, event);
+}
+
+static int compare_doubles (const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Display the per-call latency percentiles (nearest rank) of the stretch calls, and
+ * how fast the whole file was processed compared to real time, split between the
+ * stretching (DSP) and reading and writing the files (I/O).
+ */
+
+static void report_latency (CallTiming *calls, int num_calls, double dsp_seconds, double io_seconds, double audio_seconds)
+{
+    static const double percentiles [] = { 50.0, 90.0, 99.0, 100.0 };
+    static const char *labels [] = { "p50", "p90", "p99", "max" };
+    double *seconds = malloc (num_calls * sizeof (*seconds));
+    int i;
+
+    if (!num_calls || !seconds) {
+        free (seconds);
+        return;
+    }
+
+    for (i = 0; i < num_calls; ++i)
+        seconds [i] = calls [i].seconds;
+
+    qsort (seconds, num_calls, sizeof (*seconds), compare_doubles);
+    fprintf (stderr, "stretch call latency (%d calls):", num_calls);
+
+    for (i = 0; i < 4; ++i) {
+        int rank = (int) ceil (percentiles [i] / 100.0 * num_calls);
+
+        fprintf (stderr, "%s %s = %.1f us", i ? "," : "", labels [i], seconds [rank > 0 ? rank - 1 : 0] * 1e6);
+    }
+
+    fprintf (stderr, "\n");
+    free (seconds);
+
+    if (dsp_seconds + io_seconds > 0.0)
+        fprintf (stderr, "%.2f seconds of audio in %.3f seconds (%.1fX real time), %.3f DSP (%.1fX) + %.3f I/O\n",
+            audio_seconds, dsp_seconds + io_seconds, audio_seconds / (dsp_seconds + io_seconds),
+            dsp_seconds, dsp_seconds > 0.0 ? audio_seconds / dsp_seconds : 0.0, io_seconds);
+}
+
+// write the timing of every block to a CSV file (one row per block, both stages in time order)
+
+static int write_timing_csv (BlockTiming *timing, char *timing_filename)
+{
+    FILE *csvfile = fopen (timing_filename, "w");
+    int i = 0, j = 0;
+
+    if (!csvfile) {
+        fprintf (stderr, "can't open file \"%s\" for writing!\n", timing_filename);
+        return 0;
+    }
+
+    if (timing->failed [0] || timing->failed [1])
+        fprintf (stderr, "warning: not enough memory to record every block, the timing file is incomplete!\n");
+
+    fprintf (csvfile, "block,stage,position,period,level,input_samples,output_samples,ratio,search_us,merge_us,microseconds\n");
+
+    while (i < timing->num_blocks [0] || j < timing->num_blocks [1]) {
+        StretchBlockEvent *event;
+
+        if (j == timing->num_blocks [1] || (i < timing->num_blocks [0] && timing->blocks [0] [i].start_ns <= timing->blocks [1] [j].start_ns))
+            event = timing->blocks [0] + i++;
+        else
+            event = timing->blocks [1] + j++;
+
+        fprintf (csvfile, "%d,%d,%lld,%d,%d,%d,%d,%.4f,%.3f,%.3f,%.3f\n", i + j - 1, event->stage,
+            (long long) event->position, event->period, event->search_level, event->input_samples, event->output_samples,
+            event->ratio, event->search_ns / 1e3, event->merge_ns / 1e3, (event->search_ns + event->merge_ns) / 1e3);
+    }
+
+    if (fclose (csvfile)) {
+        fprintf (stderr, "can't write file \"%s\"!\n", timing_filename);
+        return 0;
+    }
 
-    return log10 (rms_sum / samples / (32768.0 * 32767.0 * 0.5)) * 10.0;
+    return 1;
 }
@@ -0,0 +1,966 @@
+////////////////////////////////////////////////////////////////////////////
+//                        **** AUDIO-STRETCH ****                         //
+//                      Time Domain Harmonic Scaler                       //
+//                    Copyright (c) 2022 David Bryant                     //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// quality.c
+
+// This module is a quality-regression harness for the TDHS library. It renders a
+// deterministic corpus (synthetic signals plus any WAV files given on the command
+// line) with every configuration in the table below and measures the results
+// against the reference configuration (normal mode, which searches every period
+// exhaustively). Each configuration has bounds for every metric, and the program
+// fails (exit code 1) if any is exceeded, so that the approximate and accelerated
+// modes ship with measured quality.
+//
+// The metrics are:
+//
+//   agreement   percentage of period map entries (see stretch_analyze()) that
+//               match the reference choice (within 2%, or 1 sample)
+//   roundtrip   error after stretching by r and then by 1/r, as 100% minus the
+//               (energy weighted) best-aligned correlation with the original
+//   length      deviation of the output length from the requested ratio (%)
+//   pitch       deviation of the median pitch of the output from the median
+//               pitch of the input (cents, using an independent estimator)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "stretch.h"
+
+#define UPPER_FREQUENCY     333     // same period limits as the demo program
+#define LOWER_FREQUENCY     55
+#define AUDIO_WINDOW_MS     25
+#define FRAME_MS            20      // frames for the roundtrip metric (pitch is estimated every other frame)
+#define MAX_CLIPS           16
+#define MAX_OUTPUTS         5       // of a fan-out: the ratio rendered and the configuration's ratios
+
+#define RENDER_HANDLE       0       // stretch_samples() on a handle, like the demo program
+#define RENDER_MAP          1       // the same, with the periods from a map made by stretch_analyze()
+#define RENDER_FANOUT       2       // one output of a fan-out that also renders the configuration's ratios
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static const char *sign_on = "\n"
+" AUDIO-QUALITY  TDHS Quality-Regression Harness  Version 0.4\n"
+" Copyright (c) 2022 David Bryant. All Rights Reserved.\n\n";
+
+static const char *usage =
+" Usage:     AUDIO-QUALITY [-options] [file.wav ...]\n\n"
+" Options:  -c<name> = only test the named configuration (and the reference)\n"
+"           -l      = list the configurations and their bounds\n"
+"           -s      = skip the synthetic corpus (test only the files)\n"
+"           -v      = verbose (display the metrics for every ratio)\n\n"
+" Files must be 16-bit PCM mono or stereo .WAV files. The exit code is 0 if all\n"
+" metrics are within bounds, 1 if any regressed, and 2 for other errors.\n\n";
+
+typedef struct {
+    char name [64];
+    int16_t *samples;               // interleaved
+    int num_samples, num_chans, sample_rate;
+    uint16_t *ref_periods;          // reference period map (per channel), once made
+    int num_periods;
+    double *ref_pitches;            // pitch track of the input (Hz, 0 if unvoiced), once made
+    int num_pitches;
+} Clip;
+
+typedef struct {
+    const char *name, *description;
+    int flags;
+    void (*setup) (StretchHandle stretcher);    // optional extra configuration
+    float ratios [4];
+    double min_agreement, max_roundtrip, max_length, max_pitch;
+    int render_mode;                // RENDER_xxx
+} Config;
+
+typedef struct {
+    double agreement, roundtrip, length, pitch;
+} Metrics;
+
+// search levels of the governor (see stretch_set_governor()), pinned with a zero budget
+
+static void decimated_search (StretchHandle stretcher) { stretch_set_governor (stretcher, 0, 0.0, 1); }
+static void coarse_search (StretchHandle stretcher) { stretch_set_governor (stretcher, 0, 0.0, 2); }
+static void coarser_search (StretchHandle stretcher) { stretch_set_governor (stretcher, 0, 0.0, 3); }
+static void tracked_search (StretchHandle stretcher) { stretch_set_governor (stretcher, 0, 0.0, 4); }
+
+// skip the search on aperiodic blocks (see stretch_set_unvoiced())
+
+static void unvoiced_bypass (StretchHandle stretcher) { stretch_set_unvoiced (stretcher, 16.0); }
+
+// narrow the period range after learning for 22050 samples (see stretch_set_adaptive())
+
+static void adaptive_range (StretchHandle stretcher) { stretch_set_adaptive (stretcher, 44100, 0.5); }
+
+// split the period search between threads (see stretch_set_search_threads()), which must not change it
+
+static void parallel_search (StretchHandle stretcher) { stretch_set_search_threads (stretcher, 4); }
+
+// The first configuration is the reference, and others are checked against it.
+
+static const Config configs [] = {
+    { "normal", "exhaustive period search (reference)", 0, NULL,
+        { 0.5, 0.8, 1.25, 2.0 }, 100.0, 22.0, 1.0, 40.0, RENDER_HANDLE },
+    { "fast", "2:1 decimated period search", STRETCH_FAST_FLAG, NULL,
+        { 0.5, 0.8, 1.25, 2.0 }, 60.0, 32.0, 2.0, 40.0, RENDER_HANDLE },
+    { "dual", "cascaded instances", STRETCH_DUAL_FLAG, NULL,
+        { 0.3, 0.6, 1.6, 3.0 }, 100.0, 30.0, 4.5, 60.0, RENDER_HANDLE },
+    { "dual-fast", "cascaded instances, decimated search", STRETCH_DUAL_FLAG | STRETCH_FAST_FLAG, NULL,
+        { 0.3, 0.6, 1.6, 3.0 }, 60.0, 30.0, 7.5, 55.0, RENDER_HANDLE },
+    { "level1", "governor level 1, every other sample", 0, decimated_search,
+        { 0.5, 0.8, 1.25, 2.0 }, 70.0, 22.0, 1.0, 40.0, RENDER_HANDLE },
+    { "level2", "governor level 2, coarse search", 0, coarse_search,
+        { 0.5, 0.8, 1.25, 2.0 }, 60.0, 22.0, 1.0, 40.0, RENDER_HANDLE },
+    { "level3", "governor level 3, coarser search", 0, coarser_search,
+        { 0.5, 0.8, 1.25, 2.0 }, 50.0, 24.0, 1.5, 40.0, RENDER_HANDLE },
+    { "level4", "governor level 4, tracked period", 0, tracked_search,
+        { 0.5, 0.8, 1.25, 2.0 }, 40.0, 32.0, 1.5, 40.0, RENDER_HANDLE },
+    { "unvoiced", "no search on aperiodic blocks", 0, unvoiced_bypass,
+        { 0.5, 0.8, 1.25, 2.0 }, 70.0, 22.0, 1.0, 40.0, RENDER_HANDLE },
+    { "fast-unv", "fast mode, no search on aperiodic blocks", STRETCH_FAST_FLAG, unvoiced_bypass,
+        { 0.5, 0.8, 1.25, 2.0 }, 55.0, 32.0, 2.0, 40.0, RENDER_HANDLE },
+    { "fast-lvl3", "fast mode, governor level 3", STRETCH_FAST_FLAG, coarser_search,
+        { 0.5, 0.8, 1.25, 2.0 }, 40.0, 24.0, 2.0, 40.0, RENDER_HANDLE },
+    { "adaptive", "range narrowed to the learned pitch", 0, adaptive_range,
+        { 0.5, 0.8, 1.25, 2.0 }, 65.0, 22.0, 1.5, 40.0, RENDER_HANDLE },
+    { "fast-adapt", "fast mode, period range narrowed", STRETCH_FAST_FLAG, adaptive_range,
+        { 0.5, 0.8, 1.25, 2.0 }, 60.0, 32.0, 2.0, 40.0, RENDER_HANDLE },
+    { "threads", "period search split between 4 threads", 0, parallel_search,
+        { 0.5, 0.8, 1.25, 2.0 }, 100.0, 22.0, 1.0, 40.0, RENDER_HANDLE },
+    { "map", "periods from a map of the same audio", 0, NULL,
+        { 0.5, 0.8, 1.25, 2.0 }, 100.0, 22.0, 1.0, 40.0, RENDER_MAP },
+    { "fanout", "one output of a fan-out of 5 ratios", 0, NULL,
+        { 0.5, 0.8, 1.25, 2.0 }, 100.0, 22.0, 1.0, 40.0, RENDER_FANOUT },
+};
+
+#define NUM_CONFIGS (sizeof (configs) / sizeof (configs [0]))
+
+static Clip clips [MAX_CLIPS];
+static int num_clips, verbose_mode;
+
+static void period_range (Clip *clip, int *shortest, int *longest);
+static int make_synthetic_corpus (void);
+static int load_wav_clip (char *filename);
+static int test_config (const Config *config, Metrics *worst);
+static int read_period_map (Clip *clip, int flags, void (*setup) (StretchHandle), uint16_t **periods);
+static int16_t *render (Clip *clip, const Config *config, const int16_t *samples, int num_samples, float ratio, int *num_rendered);
+static int16_t *render_fanout (Clip *clip, const Config *config, const int16_t *samples, int num_samples, float ratio, int *num_rendered);
+static int load_map (Clip *clip, const Config *config, StretchHandle stretcher, const int16_t *samples, int num_samples);
+static double roundtrip_error (Clip *clip, const int16_t *samples, int num_samples);
+static int pitch_track (Clip *clip, const int16_t *samples, int num_samples, int hop, double **pitches);
+static double pitch_deviation (Clip *clip, const int16_t *samples, int num_samples, float ratio);
+
+int main (argc, argv) int argc; char **argv;
+{
+    int asked_help = 0, list_configs = 0, skip_synthetic = 0, regressions = 0, i;
+    char *filenames [MAX_CLIPS], *only_config = NULL;
+    int num_files = 0;
+
+    // loop through command-line arguments
+
+    while (--argc) {
+        if ((**++argv == '-') && (*argv)[1])
+            while (*++*argv)
+                switch (**argv) {
+
+                    case 'C': case 'c':
+                        only_config = ++*argv;
+
+                        if (!*only_config) {
+                            fprintf (stderr, "\nno configuration name specified!\n");
+                            return 2;
+                        }
+
+                        *argv += strlen (*argv) - 1;
+                        break;
+
+                    case 'L': case 'l':
+                        list_configs = 1;
+                        break;
+
+                    case 'S': case 's':
+                        skip_synthetic = 1;
+                        break;
+
+                    case 'V': case 'v':
+                        verbose_mode = 1;
+                        break;
+
+                    case 'H': case 'h':
+                        asked_help = 1;
+                        break;
+
+                    default:
+                        fprintf (stderr, "\nillegal option: %c !\n", **argv);
+                        return 2;
+                }
+        else if (num_files < MAX_CLIPS - 3)
+            filenames [num_files++] = *argv;
+        else {
+            fprintf (stderr, "\ntoo many files: %s !\n", *argv);
+            return 2;
+        }
+    }
+
+    fprintf (stderr, "%s", sign_on);
+
+    if (asked_help) {
+        printf ("%s", usage);
+        return 0;
+    }
+
+    if (list_configs) {
+        printf (" %-10s %-40s %8s %8s %8s %8s\n", "config", "description", "agree>=", "round<=", "length<=", "pitch<=");
+
+        for (i = 0; i < (int) NUM_CONFIGS; ++i)
+            printf (" %-10s %-40s %7.1f%% %7.1f%% %7.2f%% %5.0f ct\n", configs [i].name, configs [i].description,
+                configs [i].min_agreement, configs [i].max_roundtrip, configs [i].max_length, configs [i].max_pitch);
+
+        return 0;
+    }
+
+    if (!skip_synthetic && !make_synthetic_corpus ()) {
+        fprintf (stderr, "out of memory!\n");
+        return 2;
+    }
+
+    for (i = 0; i < num_files; ++i)
+        if (!load_wav_clip (filenames [i]))
+            return 2;
+
+    if (!num_clips) {
+        fprintf (stderr, "nothing to test!\n");
+        return 2;
+    }
+
+    if (only_config) {
+        for (i = 0; i < (int) NUM_CONFIGS; ++i)
+            if (!strcmp (configs [i].name, only_config))
+                break;
+
+        if (i == NUM_CONFIGS) {
+            fprintf (stderr, "unknown configuration \"%s\" (use -l to list them)\n", only_config);
+            return 2;
+        }
+    }
+
+    printf (" %-10s %8s %8s %8s %8s\n", "config", "agree", "round", "length", "pitch");
+
+    for (i = 0; i < (int) NUM_CONFIGS; ++i) {
+        const Config *config = configs + i;
+        Metrics worst;
+        int result;
+
+        if (i && only_config && strcmp (config->name, only_config))
+            continue;
+
+        if ((result = test_config (config, &worst)) < 0)
+            return 2;
+
+        printf (" %-10s %7.1f%% %7.2f%% %7.3f%% %5.1f ct  %s\n", config->name,
+            worst.agreement, worst.roundtrip, worst.length, worst.pitch, result ? "PASS" : "FAIL");
+
+        if (!result)
+            regressions++;
+    }
+
+    if (regressions)
+        printf ("\n %d configuration%s regressed!\n", regressions, regressions > 1 ? "s" : "");
+    else
+        printf ("\n all configurations within bounds\n");
+
+    for (i = 0; i < num_clips; ++i) {
+        free (clips [i].samples);
+        free (clips [i].ref_periods);
+        free (clips [i].ref_pitches);
+    }
+
+    return regressions ? 1 : 0;
+}
+
+/*
+ * Run one configuration over the whole corpus, and return the worst value of each
+ * metric. Returns 1 if they are all within the configuration's bounds, 0 if not, or
+ * -1 for an error.
+ */
+
+static int test_config (const Config *config, Metrics *worst)
+{
+    int clip_index, ratio_index, i;
+
+    worst->agreement = 100.0;
+    worst->roundtrip = worst->length = worst->pitch = 0.0;
+
+    for (clip_index = 0; clip_index < num_clips; ++clip_index) {
+        Clip *clip = clips + clip_index;
+        uint16_t *periods;
+        int num_periods, matches = 0;
+
+        // the reference map and pitch are the same for every configuration
+
+        if (!clip->ref_periods) {
+            clip->num_periods = read_period_map (clip, configs [0].flags, configs [0].setup, &clip->ref_periods);
+            clip->num_pitches = pitch_track (clip, clip->samples, clip->num_samples, clip->sample_rate * FRAME_MS / 2000, &clip->ref_pitches);
+
+            if (clip->num_periods < 0 || clip->num_pitches < 0)
+                return -1;
+        }
+
+        if ((num_periods = read_period_map (clip, config->flags, config->setup, &periods)) < 0)
+            return -1;
+
+        for (i = 0; i < num_periods && i < clip->num_periods; ++i) {
+            int tolerance = clip->ref_periods [i] / 50 > 1 ? clip->ref_periods [i] / 50 : 1;
+
+            if (abs (periods [i] - clip->ref_periods [i]) <= tolerance)
+                matches++;
+        }
+
+        // the fast mode needs more look-ahead, so its map can end a little earlier
+
+        if (num_periods > clip->num_periods)
+            num_periods = clip->num_periods;
+
+        if (num_periods && matches * 100.0 / num_periods < worst->agreement)
+            worst->agreement = matches * 100.0 / num_periods;
+
+        free (periods);
+
+        if (verbose_mode)
+            printf (" %-10s %s: %.1f%% of %d periods agree\n", config->name, clip->name,
+                num_periods ? matches * 100.0 / num_periods : 100.0, num_periods);
+
+        for (ratio_index = 0; ratio_index < 4 && config->ratios [ratio_index]; ++ratio_index) {
+            float ratio = config->ratios [ratio_index];
+            int num_stretched, num_restored;
+            double roundtrip, length, pitch;
+            int16_t *stretched, *restored;
+
+            if (!(stretched = render (clip, config, clip->samples, clip->num_samples, ratio, &num_stretched)))
+                return -1;
+
+            if (!(restored = render (clip, config, stretched, num_stretched, 1.0 / ratio, &num_restored))) {
+                free (stretched);
+                return -1;
+            }
+
+            length = fabs (num_stretched - clip->num_samples * (double) ratio) * 100.0 / (clip->num_samples * ratio);
+            roundtrip = roundtrip_error (clip, restored, num_restored);
+            pitch = pitch_deviation (clip, stretched, num_stretched, ratio);
+
+            if (verbose_mode)
+                printf (" %-10s %s: r = %.3f, length %d --> %d --> %d, roundtrip error %.2f%%, pitch deviation %.1f ct\n",
+                    config->name, clip->name, ratio, clip->num_samples, num_stretched, num_restored, roundtrip, pitch);
+
+            if (roundtrip > worst->roundtrip) worst->roundtrip = roundtrip;
+            if (length > worst->length) worst->length = length;
+            if (pitch > worst->pitch) worst->pitch = pitch;
+
+            free (stretched);
+            free (restored);
+        }
+    }
+
+    return worst->agreement >= config->min_agreement && worst->roundtrip <= config->max_roundtrip &&
+        worst->length <= config->max_length && worst->pitch <= config->max_pitch;
+}
+
+/*
+ * Run the clip through stretch_analyze() with the given flags and return the periods
+ * of the resulting map (per channel, in a malloc'd array). Only the period search
+ * options matter here, so the cascading and resampling flags are dropped.
+ */
+
+static int read_period_map (Clip *clip, int flags, void (*setup) (StretchHandle), uint16_t **periods)
+{
+    int buffer_samples = clip->sample_rate * AUDIO_WINDOW_MS / 1000, num_bytes, num_periods, shortest, longest, i;
+    StretchHandle stretcher;
+    unsigned char *map;
+
+    period_range (clip, &shortest, &longest);
+    stretcher = stretch_init (shortest, longest, clip->num_chans,
+        flags & ~(STRETCH_DUAL_FLAG | STRETCH_PITCH_FLAG | STRETCH_THREADED_FLAG));
+
+    if (!stretcher)
+        return -1;
+
+    if (setup)
+        setup (stretcher);
+
+    for (i = 0; i < clip->num_samples; i += buffer_samples) {
+        int samples_to_analyze = clip->num_samples - i < buffer_samples ? clip->num_samples - i : buffer_samples;
+
+        if (!stretch_analyze (stretcher, clip->samples + i * clip->num_chans, samples_to_analyze)) {
+            fprintf (stderr, "stretch_analyze() failed!\n");
+            stretch_deinit (stretcher);
+            return -1;
+        }
+    }
+
+    num_bytes = stretch_map_bytes (stretcher);
+    num_periods = (num_bytes - 36) / 2;
+    map = malloc (num_bytes);
+    *periods = malloc ((num_periods + 1) * sizeof (**periods));
+
+    if (!map || !*periods || stretch_map_save (stretcher, map) != num_bytes) {
+        fprintf (stderr, "can't save period map!\n");
+        stretch_deinit (stretcher);
+        free (*periods);
+        free (map);
+        return -1;
+    }
+
+    for (i = 0; i < num_periods; ++i)
+        (*periods) [i] = map [36 + i * 2] | (map [37 + i * 2] << 8);
+
+    stretch_deinit (stretcher);
+    free (map);
+    return num_periods;
+}
+
+/*
+ * The period limits for a clip are those of the demo program, except rounded to even
+ * values. That way the fast mode (which needs even limits) searches the same range and
+ * records its period map at the same positions as the reference.
+ */
+
+static void period_range (Clip *clip, int *shortest, int *longest)
+{
+    *shortest = (clip->sample_rate / UPPER_FREQUENCY) & ~1;
+    *longest = ((clip->sample_rate / LOWER_FREQUENCY) + 1) & ~1;
+}
+
+// stretch the given samples (in the clip's format) with the configuration, just like the demo program
+
+static int16_t *render (Clip *clip, const Config *config, const int16_t *samples, int num_samples, float ratio, int *num_rendered)
+{
+    int buffer_samples = clip->sample_rate * AUDIO_WINDOW_MS / 1000, capacity, shortest, longest, i;
+    StretchHandle stretcher;
+    int16_t *output;
+
+    if (config->render_mode == RENDER_FANOUT)
+        return render_fanout (clip, config, samples, num_samples, ratio, num_rendered);
+
+    period_range (clip, &shortest, &longest);
+    stretcher = stretch_init (shortest, longest, clip->num_chans, config->flags);
+
+    if (!stretcher)
+        return NULL;
+
+    if (config->setup)
+        config->setup (stretcher);
+
+    if (config->render_mode == RENDER_MAP && !load_map (clip, config, stretcher, samples, num_samples)) {
+        stretch_deinit (stretcher);
+        return NULL;
+    }
+
+    capacity = stretch_output_capacity (stretcher, buffer_samples, ratio);
+    output = malloc (((size_t) (num_samples * ratio * 1.1) + capacity * 4) * clip->num_chans * sizeof (*output));
+    *num_rendered = 0;
+
+    if (!output) {
+        fprintf (stderr, "out of memory!\n");
+        stretch_deinit (stretcher);
+        return NULL;
+    }
+
+    for (i = 0; i < num_samples; i += buffer_samples) {
+        int samples_to_stretch = num_samples - i < buffer_samples ? num_samples - i : buffer_samples;
+
+        *num_rendered += stretch_samples (stretcher, samples + i * clip->num_chans, samples_to_stretch,
+            output + *num_rendered * clip->num_chans, ratio);
+    }
+
+    while ((i = stretch_flush (stretcher, output + *num_rendered * clip->num_chans)))
+        *num_rendered += i;
+
+    stretch_deinit (stretcher);
+    return output;
+}
+
+/*
+ * Make a period map of the given samples with another handle of the configuration and
+ * load it into "stretcher", so that the render takes its periods from the map.
+ */
+
+static int load_map (Clip *clip, const Config *config, StretchHandle stretcher, const int16_t *samples, int num_samples)
+{
+    int buffer_samples = clip->sample_rate * AUDIO_WINDOW_MS / 1000, num_bytes = 0, shortest, longest, result = 0, i;
+    StretchHandle analyzer;
+    unsigned char *map = NULL;
+
+    period_range (clip, &shortest, &longest);
+
+    if (!(analyzer = stretch_init (shortest, longest, clip->num_chans, config->flags & ~(STRETCH_DUAL_FLAG | STRETCH_PITCH_FLAG | STRETCH_THREADED_FLAG))))
+        return 0;
+
+    if (config->setup)
+        config->setup (analyzer);
+
+    for (i = 0; i < num_samples; i += buffer_samples)
+        if (!stretch_analyze (analyzer, samples + i * clip->num_chans, num_samples - i < buffer_samples ? num_samples - i : buffer_samples))
+            break;
+
+    if (i >= num_samples && (num_bytes = stretch_map_bytes (analyzer)) && (map = malloc (num_bytes)) &&
+        stretch_map_save (analyzer, map) == num_bytes)
+            result = stretch_map_load (stretcher, map, num_bytes, num_samples, stretch_map_checksum (stretcher, 0, samples, num_samples));
+
+    if (!result)
+        fprintf (stderr, "can't make and load a period map!\n");
+
+    stretch_deinit (analyzer);
+    free (map);
+    return result;
+}
+
+/*
+ * Render the given samples with a fan-out whose first output has the given ratio and
+ * the others the configuration's ratios (so that the outputs share some of their
+ * periods and not others), returning the first output.
+ */
+
+static int16_t *render_fanout (Clip *clip, const Config *config, const int16_t *samples, int num_samples, float ratio, int *num_rendered)
+{
+    int buffer_samples = clip->sample_rate * AUDIO_WINDOW_MS / 1000, capacity, shortest, longest, num_outputs, i, j;
+    int num_generated [MAX_OUTPUTS], totals [MAX_OUTPUTS] = { 0 };
+    int16_t *outputs [MAX_OUTPUTS] = { NULL }, *output_ptrs [MAX_OUTPUTS];
+    float ratios [MAX_OUTPUTS], max_ratio = ratio;
+    StretchFanout fanout;
+
+    ratios [0] = ratio;
+
+    for (num_outputs = 1; num_outputs < MAX_OUTPUTS && config->ratios [num_outputs - 1]; ++num_outputs)
+        if ((ratios [num_outputs] = config->ratios [num_outputs - 1]) > max_ratio)
+            max_ratio = ratios [num_outputs];
+
+    period_range (clip, &shortest, &longest);
+
+    if (!(fanout = stretch_fanout_init (shortest, longest, clip->num_chans, config->flags, num_outputs)))
+        return NULL;
+
+    capacity = stretch_fanout_output_capacity (fanout, buffer_samples, max_ratio);
+
+    for (i = 0; i < num_outputs; ++i)
+        if (!(outputs [i] = malloc (((size_t) (num_samples * max_ratio * 1.1) + capacity * 4) * clip->num_chans * sizeof (int16_t)))) {
+            fprintf (stderr, "out of memory!\n");
+
+            while (i--)
+                free (outputs [i]);
+
+            stretch_fanout_deinit (fanout);
+            return NULL;
+        }
+
+    for (i = 0; i < num_samples; i += buffer_samples) {
+        for (j = 0; j < num_outputs; ++j)
+            output_ptrs [j] = outputs [j] + totals [j] * clip->num_chans;
+
+        stretch_fanout_samples (fanout, samples + i * clip->num_chans, num_samples - i < buffer_samples ? num_samples - i : buffer_samples,
+            output_ptrs, ratios, num_generated);
+
+        for (j = 0; j < num_outputs; ++j)
+            totals [j] += num_generated [j];
+    }
+
+    do {
+        for (j = 0; j < num_outputs; ++j)
+            output_ptrs [j] = outputs [j] + totals [j] * clip->num_chans;
+
+        i = stretch_fanout_flush (fanout, output_ptrs, num_generated);
+
+        for (j = 0; j < num_outputs; ++j)
+            totals [j] += num_generated [j];
+    } while (i);
+
+    for (j = 1; j < num_outputs; ++j)
+        free (outputs [j]);
+
+    stretch_fanout_deinit (fanout);
+    *num_rendered = totals [0];
+    return outputs [0];
+}
+
+// mix the specified frame down to mono floats (zero outside of the samples)
+
+static void mono_frame (Clip *clip, const int16_t *samples, int num_samples, int start, int length, float *frame)
+{
+    int i, j;
+
+    for (i = 0; i < length; ++i) {
+        frame [i] = 0.0;
+
+        if (start + i >= 0 && start + i < num_samples)
+            for (j = 0; j < clip->num_chans; ++j)
+                frame [i] += samples [(start + i) * clip->num_chans + j] / (32768.0 * clip->num_chans);
+    }
+}
+
+/*
+ * Compare the restored samples to the clip's original samples. TDHS doesn't preserve
+ * the exact alignment (it drifts by up to a few periods), so the best correlation of
+ * the first audible frame of the original is found over lags of up to a longest period,
+ * and then each following frame is searched over a quarter of that around the lag of
+ * the previous one. The returned error is 100% minus the energy weighted mean of those
+ * correlations (silent frames don't count).
+ */
+
+static double roundtrip_error (Clip *clip, const int16_t *samples, int num_samples)
+{
+    int frame_length = clip->sample_rate * FRAME_MS / 1000, max_lag, shortest;
+    double weighted = 0.0, total_energy = 0.0;
+    int start, lag = 0, search = 0, i;
+    float *original, *restored;
+
+    period_range (clip, &shortest, &max_lag);
+    original = malloc (frame_length * sizeof (float));
+    restored = malloc ((frame_length + max_lag * 2) * sizeof (float));
+
+    for (start = 0; start + frame_length <= clip->num_samples; start += frame_length) {
+        double energy = 0.0, best_correlation = 0.0;
+        int best_lag = lag, test_lag;
+
+        mono_frame (clip, clip->samples, clip->num_samples, start, frame_length, original);
+
+        for (i = 0; i < frame_length; ++i)
+            energy += original [i] * original [i];
+
+        if (energy < frame_length * 1e-6)        // below -60 dB
+            continue;
+
+        mono_frame (clip, samples, num_samples, start + lag - max_lag, frame_length + max_lag * 2, restored);
+
+        search = search ? max_lag / 4 : max_lag;
+
+        for (test_lag = -search; test_lag <= search; ++test_lag) {
+            double cross = 0.0, restored_energy = 0.0, correlation;
+            float *compare = restored + max_lag + test_lag;
+
+            for (i = 0; i < frame_length; ++i) {
+                cross += original [i] * compare [i];
+                restored_energy += compare [i] * compare [i];
+            }
+
+            correlation = restored_energy ? cross / sqrt (energy * restored_energy) : 0.0;
+
+            if (correlation > best_correlation) {
+                best_correlation = correlation;
+                best_lag = lag + test_lag;
+            }
+        }
+
+        weighted += best_correlation * energy;
+        total_energy += energy;
+        lag = best_lag;
+    }
+
+    free (original);
+    free (restored);
+    return total_energy ? 100.0 - weighted * 100.0 / total_energy : 0.0;
+}
+
+/*
+ * Estimate the pitch (Hz) of the samples every "hop" samples, with a plain normalized
+ * autocorrelation over the clip's period range. This is deliberately independent of the
+ * library's period search. To avoid octave errors, the shortest lag that comes within
+ * 5% of the best correlation is used. Unvoiced or silent frames get 0. Returns the number
+ * of estimates (in a malloc'd array), or -1 for out of memory.
+ */
+
+static int pitch_track (Clip *clip, const int16_t *samples, int num_samples, int hop, double **pitches)
+{
+    int num_pitches = 0, shortest, longest, start, lag, i;
+    double *correlations;
+    float *frame;
+
+    period_range (clip, &shortest, &longest);
+    *pitches = malloc ((num_samples / hop + 1) * sizeof (double));
+    correlations = malloc ((longest + 2) * sizeof (double));
+    frame = malloc ((longest * 2 + 2) * sizeof (float));
+
+    if (!*pitches || !correlations || !frame) {
+        fprintf (stderr, "out of memory!\n");
+        free (correlations);
+        free (*pitches);
+        free (frame);
+        return -1;
+    }
+
+    for (start = 0; start + longest * 2 + 2 <= num_samples; start += hop) {
+        double best_correlation = 0.0, energy1 = 0.0, energy2 = 0.0;
+        int best_lag = 0;
+
+        mono_frame (clip, samples, num_samples, start, longest * 2 + 2, frame);
+
+        for (i = 0; i < longest; ++i) {
+            energy1 += frame [i] * frame [i];
+            energy2 += frame [i + shortest - 1] * frame [i + shortest - 1];
+        }
+
+        for (lag = shortest - 1; lag <= longest + 1; ++lag) {
+            double cross = 0.0;
+
+            for (i = 0; i < longest; ++i)
+                cross += frame [i] * frame [i + lag];
+
+            if (lag > shortest - 1)     // slide the energy of the lagged window
+                energy2 += frame [lag + longest - 1] * frame [lag + longest - 1] - frame [lag - 1] * frame [lag - 1];
+
+            correlations [lag] = (energy1 > longest * 1e-6 && energy2 > longest * 1e-6) ? cross / sqrt (energy1 * energy2) : 0.0;
+
+            if (lag >= shortest && lag <= longest && correlations [lag] > best_correlation)
+                best_correlation = correlations [lag];
+        }
+
+        if (best_correlation >= 0.8)        // else unvoiced or silent
+            for (lag = shortest; lag <= longest; ++lag)
+                if (correlations [lag] >= best_correlation * 0.95 && correlations [lag] >= correlations [lag - 1] &&
+                    correlations [lag] >= correlations [lag + 1]) {
+                        best_lag = lag;
+                        break;
+                }
+
+        if (best_lag) {
+            double left = correlations [best_lag - 1], center = correlations [best_lag], right = correlations [best_lag + 1];
+            double denominator = left - center * 2.0 + right, offset = denominator ? (left - right) / (denominator * 2.0) : 0.0;
+
+            (*pitches) [num_pitches++] = clip->sample_rate / (best_lag + offset);
+        }
+        else
+            (*pitches) [num_pitches++] = 0.0;
+    }
+
+    free (correlations);
+    free (frame);
+    return num_pitches;
+}
+
+static int compare_doubles (const void *a, const void *b)
+{
+    return *(const double *) a < *(const double *) b ? -1 : *(const double *) a > *(const double *) b;
+}
+
+/*
+ * Return the median deviation (in cents) of the pitch of the stretched samples from the
+ * pitch of the clip at the corresponding time (the clip's track is 4 times as dense as
+ * the one made here, so the nearest estimate is close enough). Only frames that are
+ * voiced in both count.
+ */
+
+static double pitch_deviation (Clip *clip, const int16_t *samples, int num_samples, float ratio)
+{
+    int ref_hop = clip->sample_rate * FRAME_MS / 2000, hop = ref_hop * 4, num_pitches, num_deviations = 0, i;
+    double *pitches, median = 0.0;
+
+    if ((num_pitches = pitch_track (clip, samples, num_samples, hop, &pitches)) < 0)
+        return 0.0;
+
+    for (i = 0; i < num_pitches; ++i) {
+        int ref_index = (int) floor (i * hop / ratio / ref_hop + 0.5);
+
+        if (pitches [i] && ref_index < clip->num_pitches && clip->ref_pitches [ref_index])
+            pitches [num_deviations++] = fabs (1200.0 * log2 (pitches [i] / clip->ref_pitches [ref_index]));
+    }
+
+    if (num_deviations) {
+        qsort (pitches, num_deviations, sizeof (double), compare_doubles);
+        median = pitches [num_deviations / 2];
+    }
+
+    free (pitches);
+    return median;
+}
+
+// simple deterministic noise (so the corpus is identical on every platform)
+
+static double noise (uint32_t *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+    return (int32_t) *seed / 2147483648.0;
+}
+
+static Clip *new_clip (const char *name, int num_samples, int num_chans, int sample_rate)
+{
+    Clip *clip = clips + num_clips;
+
+    if (num_clips == MAX_CLIPS || !(clip->samples = calloc (num_samples * num_chans, sizeof (int16_t))))
+        return NULL;
+
+    strncpy (clip->name, name, sizeof (clip->name) - 1);
+    clip->num_samples = num_samples;
+    clip->num_chans = num_chans;
+    clip->sample_rate = sample_rate;
+    num_clips++;
+    return clip;
+}
+
+/*
+ * The synthetic corpus covers what the period search has to deal with: a harmonic tone
+ * gliding over the whole period range, a speech-like signal (a glottal pulse train with
+ * vibrato through formant resonators, alternating with noise and silence), and a stereo
+ * version of that with slightly different channels, at both a "fast" and a "normal"
+ * default sample rate.
+ */
+
+static int make_synthetic_corpus (void)
+{
+    static const double formants [3] [2] = { { 700.0, 80.0 }, { 1220.0, 90.0 }, { 2600.0, 120.0 } };
+    int sample_rate, num_samples, i, j, k;
+    uint32_t seed = 1;
+    Clip *clip;
+
+    // harmonic glide from 60 Hz to 320 Hz (exponentially, over 3 seconds)
+
+    sample_rate = 44100;
+    num_samples = sample_rate * 3;
+
+    if (!(clip = new_clip ("glide", num_samples, 1, sample_rate)))
+        return 0;
+
+    for (i = 0; i < num_samples; ++i) {
+        double phase = 60.0 * (pow (320.0 / 60.0, (double) i / num_samples) - 1.0) / log (320.0 / 60.0) * num_samples / sample_rate;
+        double value = 0.0;
+
+        for (k = 1; k <= 6; ++k)
+            value += sin (2.0 * M_PI * phase * k) / k;
+
+        clip->samples [i] = (int16_t) floor (value * 6000.0 + 0.5);
+    }
+
+    // speech-like signal at 16 kHz (normal mode default) and 44.1 kHz stereo
+
+    for (j = 0; j < 2; ++j) {
+        double resonator [3] [2] = { { 0.0 } }, phase = 0.0, peak = 0.0, *buffer;
+
+        sample_rate = j ? 44100 : 16000;
+        num_samples = sample_rate * 4;
+
+        if (!(clip = new_clip (j ? "speech-stereo" : "speech", num_samples, j + 1, sample_rate)) ||
+            !(buffer = malloc (num_samples * sizeof (double))))
+                return 0;
+
+        for (i = 0; i < num_samples; ++i) {
+            double time = (double) i / sample_rate, segment = fmod (time, 1.0), value = 0.0;
+
+            // 0.65 s voiced, 0.15 s unvoiced, 0.2 s silence each second
+
+            if (segment < 0.65) {
+                double pitch = 110.0 + 40.0 * sin (time * 1.3) + 4.0 * sin (time * 2.0 * M_PI * 5.5);
+
+                phase += pitch / sample_rate;
+
+                if (phase >= 1.0) {
+                    phase -= 1.0;
+                    value = 1.0;
+                }
+            }
+            else if (segment < 0.8)
+                value = noise (&seed) * 0.15;
+
+            for (k = 0; k < 3; ++k) {
+                double r = exp (-M_PI * formants [k] [1] / sample_rate);
+                double c = 2.0 * r * cos (2.0 * M_PI * formants [k] [0] / sample_rate);
+                double y = value + c * resonator [k] [0] - r * r * resonator [k] [1];
+
+                resonator [k] [1] = resonator [k] [0];
+                resonator [k] [0] = y;
+                value = y;
+            }
+
+            if (fabs (buffer [i] = value) > peak)
+                peak = fabs (value);
+        }
+
+        // normalize to -6 dB, and make the right channel the left delayed by 3 samples, attenuated, plus a little noise
+
+        for (i = 0; i < num_samples; ++i) {
+            clip->samples [i * clip->num_chans] = (int16_t) floor (buffer [i] * 16384.0 / peak + 0.5);
+
+            if (clip->num_chans == 2)
+                clip->samples [i * 2 + 1] = (int16_t) floor ((i >= 3 ? buffer [i - 3] * 13107.0 / peak : 0.0) + noise (&seed) * 50.0 + 0.5);
+        }
+
+        free (buffer);
+    }
+
+    return 1;
+}
+
+static uint32_t read_le32 (const unsigned char *src)
+{
+    return src [0] | (src [1] << 8) | (src [2] << 16) | ((uint32_t) src [3] << 24);
+}
+
+// load a 16-bit PCM .WAV file into a clip (only what the harness needs from the format)
+
+static int load_wav_clip (char *filename)
+{
+    unsigned char header [12], chunk [8], format [16];
+    int num_chans = 0, sample_rate = 0, i;
+    FILE *infile = fopen (filename, "rb");
+    Clip *clip;
+
+    if (!infile) {
+        fprintf (stderr, "can't open file \"%s\" for reading!\n", filename);
+        return 0;
+    }
+
+    if (fread (header, 1, 12, infile) != 12 || memcmp (header, "RIFF", 4) || memcmp (header + 8, "WAVE", 4)) {
+        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", filename);
+        fclose (infile);
+        return 0;
+    }
+
+    while (fread (chunk, 1, 8, infile) == 8) {
+        uint32_t chunk_size = read_le32 (chunk + 4);
+
+        if (!memcmp (chunk, "fmt ", 4) && chunk_size >= 16) {
+            if (fread (format, 1, 16, infile) != 16 || fseek (infile, ((chunk_size + 1) & ~1) - 16, SEEK_CUR))
+                break;
+
+            num_chans = format [2] | (format [3] << 8);
+            sample_rate = read_le32 (format + 4);
+
+            if ((format [0] | (format [1] << 8)) != 1 || (format [14] | (format [15] << 8)) != 16 ||
+                num_chans < 1 || num_chans > 2 || sample_rate < 8000 || sample_rate > 48000) {
+                    fprintf (stderr, "\"%s\" is not a 16-bit PCM mono or stereo .WAV file (8000 to 48000 Hz)!\n", filename);
+                    fclose (infile);
+                    return 0;
+            }
+        }
+        else if (!memcmp (chunk, "data", 4) && num_chans) {
+            const char *name = strrchr (filename, '/') ? strrchr (filename, '/') + 1 : filename;
+            int num_samples = chunk_size / (num_chans * 2);
+
+            if (!(clip = new_clip (name, num_samples, num_chans, sample_rate))) {
+                fprintf (stderr, "out of memory!\n");
+                fclose (infile);
+                return 0;
+            }
+
+            clip->num_samples = (int) fread (clip->samples, num_chans * 2, num_samples, infile);
+
+            for (i = 0; i < clip->num_samples * num_chans; ++i) {
+                unsigned char *bytes = (unsigned char *) (clip->samples + i);
+                clip->samples [i] = (int16_t) (bytes [0] | (bytes [1] << 8));
+            }
+
+            fclose (infile);
+            return 1;
+        }
+        else if (fseek (infile, (chunk_size + 1) & ~1, SEEK_CUR))
+            break;
+    }
+
+    fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", filename);
+    fclose (infile);
+    return 0;
+}
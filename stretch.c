@@ -26,6 +26,14 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+
+#ifndef __plan9__
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
+#endif
 
 #include "stretch.h"
 
@@ -42,19 +50,240 @@
 
 #define MAX_CORR    UINT32_MAX  /* maximum value for correlation ratios */
 
+#define CACHE_LINE  64          /* alignment and padding of contexts and their working buffers */
+
+#define RESAMPLE_TAPS       64      /* filter length of pitch-shift resampler (input samples) */
+#define RESAMPLE_PHASES     256     /* filter phases (interpolated between) */
+#define RESAMPLE_BANDWIDTH  0.90    /* passband of resampler filter (re lower Nyquist) */
+
+#ifndef PI
+#define PI 3.14159265358979323846
+#endif
+
+#define ERROR_RAMP_BLOCKS   8       /* blocks the ratio error is spread over (STRETCH_ERROR_RAMP) */
+
+#define GOVERNOR_LEVELS     5       /* search levels, from exhaustive (0) to the cheapest */
+#define GOVERNOR_SETTLE     16      /* minimum blocks between governor level changes */
+#define GOVERNOR_SMOOTHING  8.0     /* time constant (in blocks) of the measured load */
+#define GOVERNOR_RELAX      0.35    /* load below which the governor goes to a better level */
+
+#define ADAPTIVE_MIN_BLOCKS 32      /* voiced blocks required before narrowing the period range */
+#define ADAPTIVE_PERCENTILE 0.02    /* fraction of the learned periods left out at each end */
+#define ADAPTIVE_MARGIN     1.15    /* range beyond them still searched (about 2.5 semitones) */
+#define ADAPTIVE_VOICED     0.4     /* correlation mismatch of the periods that are learned */
+#define ADAPTIVE_PROBE      16      /* blocks between full-range searches once narrowed */
+#define ADAPTIVE_DROP       1.5     /* mismatch (re the full-range search) that's a miss */
+#define ADAPTIVE_MISSES     2       /* consecutive misses that widen the range again */
+#define ADAPTIVE_EDGE       4       /* consecutive periods at the narrowed limits that do too */
+
+#define SEARCH_MAX_THREADS  16      /* threads splitting one period search (see stretch_set_search_threads()) */
+#define SEARCH_MIN_WORK     250000  /* differences in a search worth splitting (~100 us, longest period ~700) */
+
+/* control parameters are written by other threads, so access them atomically */
+
+#ifndef __plan9__
+#define atomic_get(ptr)             __atomic_load_n ((ptr), __ATOMIC_ACQUIRE)
+#define atomic_put(ptr, value)      __atomic_store_n ((ptr), (value), __ATOMIC_RELEASE)
+#else
+#define atomic_get(ptr)             (*(ptr))
+#define atomic_put(ptr, value)      (*(ptr) = (value))
+#endif
+
+struct resampler {
+    float *coeffs, *history;            /* coefficients for each phase, planar input history */
+    int history_samples, history_size;  /* per channel */
+    int num_chans;
+    double position;                    /* of next output sample in the history */
+    float cutoff, step, fixed_step;
+    float filter_step;                  /* step the coefficients were calculated for */
+};
+
+struct gap_detect {
+    float ratio, last_ratio;            /* gap ratio and last (speech) ratio passed in */
+    double threshold;                   /* mean square of channel sum at the threshold */
+    int64_t origin, energy;             /* stream position of frame 0, energy of current frame */
+    int window, frame_samples;          /* samples per frame (per channel), and in current frame */
+    int frames_done, end_of_input;      /* frames classified (since origin) */
+    int silence_frames, used_frames, total_frames;
+    unsigned char *silent;              /* ring of frame classifications */
+    int ring_size;
+};
+
+struct adaptive_range {
+    uint32_t *histogram;                /* periods chosen while learning, indexed by period (per channel) */
+    int learn_frames, learned;          /* input to learn from, and voiced blocks learned so far */
+    int64_t learn_start;                /* stream position where learning (re)started */
+    int lo, hi;                         /* narrowed range (per channel), zero while learning */
+    int blocks, misses, edge_blocks;    /* blocks since narrowing, consecutive misses and edge periods */
+    int widenings;                      /* times widened again */
+};
+
+struct step_queue {
+    int16_t *input, *output;            /* queued input, and generated output (interleaved) */
+    int input_size, input_head, input_tail;
+    int output_size, output_head, output_tail;
+    int quantum;                        /* free output required for one block (or flush) */
+    int end_of_input;                   /* pushed by the caller, cleared once flushed */
+};
+
+#define STATE_MAGIC     "TDHS"      /* handle state blob identifier */
+#define STATE_VERSION   6
+#define STATE_HEADER    12          /* bytes in handle state blob header */
+
+#define MAP_MAGIC       "TDHM"      /* period map blob identifier */
+#define MAP_VERSION     1
+#define MAP_HEADER      36          /* bytes in period map blob header */
+
+struct period_map {
+    uint32_t num_samples, checksum;     /* input this map was made from (per channel) */
+    int hop, num_periods, max_periods;  /* hop is in samples per channel */
+    uint16_t *periods;                  /* per channel, one for each hop from start */
+    int live;                           /* ring of the most recent periods (fan-out) */
+    int64_t *positions;                 /* stream position searched for each period (live) */
+};
+
 struct stretch_cnxt {
     int num_chans, inbuff_samples, shortest, longest, tail, head, fast_mode;
-    int16_t *inbuff, *calcbuff;
+    int search_lo, search_hi;           /* periods actually searched (narrowed by an adaptive range) */
+    int16_t *inbuff;
     float outsamples_error;
     uint32_t *results;
 
+    uint64_t control;                   /* ratio and first stage ratio from stretch_set_ratio() (float bits) */
+    int error_policy;                   /* STRETCH_ERROR_xxx, also written by other threads */
+    float block_ratio, error_ramp;      /* requested ratio of the last block, and error still to ramp in */
+    int ramp_blocks;
+
+    int frame_budget, max_level;        /* governor settings (see stretch_set_governor()) */
+    int search_level, level_blocks;     /* current search level, and blocks since it changed */
+    int last_period;                    /* in analysis lane units, for tracking (0 if none) */
+    float load;                         /* smoothed cost of the blocks over their budget */
+
+    float unvoiced_threshold;           /* zero crossings per shortest period (see stretch_set_unvoiced()) */
+    int unvoiced_blocks;                /* searches skipped, also read by other threads */
+
+    struct adaptive_range *adaptive;    /* only when enabled (see stretch_set_adaptive()) */
+
+    struct search_team *team;           /* only when enabled (see stretch_set_search_threads()) */
+
+    StretchBlockHook block_hook;        /* optional, see stretch_set_block_hook() */
+    void *hook_context;
+    int stage;                          /* 0 for the first instance, 1 for the cascaded one */
+
+    int16_t *mono_lane, *pair_lanes [2];    /* analysis signals kept alongside inbuff (see update_lanes()) */
+    uint32_t *mono_sums, *pair_sums [2];    /* running sums of their absolute values */
+
+    int (*find_period) (struct stretch_cnxt *cnxt);     /* specialized kernel (see period_kernels) */
+
     struct stretch_cnxt *next;
     int16_t *intermediate;
+
+    int64_t inbuff_pos;                 /* stream position of inbuff [0] (per channel) */
+    struct period_map *map;
+    int map_mode;
+
+    int16_t *pending;                   /* output generated by stretch_pull() but not yet taken */
+    int pending_size, pending_head, pending_tail, block_capacity;
+
+    struct step_queue *steps;           /* only for stretch_push(), stretch_step() and stretch_read() */
+
+    struct resampler *resampler;        /* only for STRETCH_PITCH_FLAG */
+    int16_t *pitch_buff;
+
+    int16_t *planar_in, *planar_out;    /* interleaving buffers for the planar functions */
+
+    struct gap_detect *gap;             /* only when a gap ratio is set */
+
+    struct pipeline *pipeline;          /* only for STRETCH_THREADED_FLAG (runs "next" on a thread) */
+
+    struct stretch_cnxt *pool_link;
+    int pool_dirty;
+
+    StretchAllocator allocator;         /* for everything belonging to the handle (see stretch_init_ex()) */
 };
 
 static void merge_blocks (int16_t *output, int16_t *input1, int16_t *input2, int samples);
-static int find_period_fast (struct stretch_cnxt *cnxt, int16_t *samples);
-static int find_period (struct stretch_cnxt *cnxt, int16_t *samples);
+static int (*const period_kernels [2] [3]) (struct stretch_cnxt *cnxt);
+static int map_period (struct stretch_cnxt *cnxt);
+static int live_period (struct stretch_cnxt *cnxt, struct period_map *map, int64_t position);
+static int governed_period (struct stretch_cnxt *cnxt);
+static int block_unvoiced (struct stretch_cnxt *cnxt, const int16_t *calcbuff, int shortest, int longest);
+static void governor_update (struct stretch_cnxt *cnxt, int64_t start, int frames);
+static void adapt_range (struct stretch_cnxt *cnxt, int level, const int16_t *calcbuff, const uint32_t *sums, int period);
+static void restart_adaptive (struct stretch_cnxt *cnxt);
+static int init_adaptive (struct stretch_cnxt *cnxt);
+static void free_adaptive (struct stretch_cnxt *cnxt);
+static int64_t clock_ns (void);
+static void left_justify (struct stretch_cnxt *cnxt);
+static void *calloc_aligned (const StretchAllocator *allocator, size_t count, size_t size);
+static void *realloc_aligned (const StretchAllocator *allocator, void *ptr, size_t count, size_t size);
+static void free_aligned (void *ptr);
+static int alloc_lanes (struct stretch_cnxt *cnxt, int inbuff_samples);
+static void update_lanes (struct stretch_cnxt *cnxt, int first_frame);
+static int stretch_block (struct stretch_cnxt *cnxt, int16_t *output, float ratio, int64_t block_start);
+static int splice_period (int16_t *output, int16_t *input, int period, float ratio, float *error, int fast_mode, float *process_ratio, int *consumed);
+static void call_block_hook (struct stretch_cnxt *cnxt, StretchBlockEvent *event, int64_t block_start, int64_t search_end);
+static float control_ratio (struct stretch_cnxt *cnxt, float ratio, float *first_ratio);
+static void ratio_changed (struct stretch_cnxt *cnxt, float ratio);
+static float split_ratio (struct stretch_cnxt *cnxt, float ratio, float first_ratio, float *next_ratio);
+static int process_samples (struct stretch_cnxt *cnxt, int16_t *output, float ratio, int max_blocks);
+static int analyze_samples (struct stretch_cnxt *cnxt, struct period_map *map, const int16_t *samples, int num_samples);
+static void free_map (struct period_map *map);
+static int stretch_capacity (struct stretch_cnxt *cnxt, int max_num_samples, float max_ratio);
+static int time_stretch (struct stretch_cnxt *cnxt, const int16_t *samples, int num_samples, int16_t *output, float ratio);
+static int flush_samples (struct stretch_cnxt *cnxt, int16_t *output);
+static int init_resampler (struct stretch_cnxt *cnxt);
+static void reset_resampler (struct resampler *rs);
+static void free_resampler (struct resampler *rs);
+static void resampler_step (struct stretch_cnxt *cnxt, float ratio);
+static void resampler_filter (struct resampler *rs, float step);
+static int resample (struct stretch_cnxt *cnxt, const int16_t *input, int num_samples, int16_t *output, int flushing);
+static int block_ready (struct stretch_cnxt *cnxt);
+static int init_pending (struct stretch_cnxt *cnxt);
+static struct step_queue *init_steps (struct stretch_cnxt *cnxt);
+static int reserve_steps_input (struct stretch_cnxt *cnxt, int num_samples);
+static void free_steps (struct stretch_cnxt *cnxt);
+static void gap_scan (struct stretch_cnxt *cnxt, const int16_t *samples, int num_samples);
+static void gap_restart (struct stretch_cnxt *cnxt);
+static int restore_defaults (struct stretch_cnxt *cnxt);
+static void gap_end_of_input (struct gap_detect *gap);
+static int gap_classified (struct stretch_cnxt *cnxt, int frame);
+static int gap_silent (struct stretch_cnxt *cnxt, int frame);
+static float gap_ratio (struct stretch_cnxt *cnxt, float ratio);
+
+#ifndef __plan9__
+static int init_pipeline (struct stretch_cnxt *cnxt);
+static void free_pipeline (struct stretch_cnxt *cnxt);
+static int pipeline_capacity (struct stretch_cnxt *cnxt);
+static int pipeline_slot (struct stretch_cnxt *cnxt, int16_t *output, int16_t **buffer);
+static void pipeline_submit (struct stretch_cnxt *cnxt, int num_samples, float ratio);
+static int pipeline_collect (struct stretch_cnxt *cnxt, int16_t *output, int num_to_wait);
+static int pipeline_drain (struct stretch_cnxt *cnxt, int16_t *output);
+static int pipeline_busy (struct stretch_cnxt *cnxt);
+static int init_team (struct stretch_cnxt *cnxt, int num_threads);
+static void free_team (struct stretch_cnxt *cnxt);
+static int team_search (struct search_team *team, const int16_t *calcbuff, const uint32_t *sums, uint32_t scaler,
+    int first, int last, uint32_t *results);
+static int scan_periods (const int16_t *calcbuff, const uint32_t *sums, uint32_t scaler,
+    int first, int last, uint32_t *results, uint32_t *best_factor);
+#else
+#define init_pipeline(cnxt)                     1
+#define free_pipeline(cnxt)
+#define pipeline_capacity(cnxt)                 0
+#define pipeline_slot(cnxt, output, buffer)     0
+#define pipeline_submit(cnxt, num_samples, ratio)
+#define pipeline_collect(cnxt, output, num_to_wait) 0
+#define pipeline_drain(cnxt, output)            0
+#define pipeline_busy(cnxt)                     0
+#define init_team(cnxt, num_threads)            1
+#define free_team(cnxt)
+#define team_search(team, calcbuff, sums, scaler, first, last, results) 0
+#endif
+
+#define MAP_NONE        0
+#define MAP_RECORD      1
+#define MAP_PLAYBACK    2
+#define MAP_SHARED      3   /* like playback, but the map is owned elsewhere */
 
 /*
  * Initialize a context of the time stretching code. The shortest and longest periods
@@ -67,13 +296,40 @@ static int find_period (struct stretch_cnxt *cnxt, int16_t *samples);
  *
  * STRETCH_DUAL_FLAG    0x2     Cascade two instances of the stretcher to expand
  *                              available ratios to 0.25X to 4.00X
+ *
+ * STRETCH_PITCH_FLAG   0x4     Resample the stretched audio back to the original
+ *                              duration, so the ratio scales the pitch instead
+ *
+ * STRETCH_THREADED_FLAG 0x8    With STRETCH_DUAL_FLAG, run the second instance on
+ *                              its own thread (the output is identical, but is
+ *                              delayed by a few blocks)
  */
 
 StretchHandle stretch_init (int shortest_period, int longest_period, int num_channels, int flags)
+{
+    return stretch_init_ex (shortest_period, longest_period, num_channels, flags, NULL);
+}
+
+/*
+ * Same as stretch_init(), but with all of the handle's memory (including what is allocated
+ * later, such as for gap detection or a period map) coming from "allocator", if not NULL.
+ * The allocator is copied, but its context must stay valid until the handle is freed with
+ * stretch_deinit(). Its allocate function is called with the size and alignment required
+ * and returns NULL on failure, and its deallocate function gets the same size and alignment
+ * back (as for a C++ memory resource). Both may be called from any thread that uses the
+ * handle (and from the pipeline thread of STRETCH_THREADED_FLAG).
+ */
+
+StretchHandle stretch_init_ex (int shortest_period, int longest_period, int num_channels, int flags, const StretchAllocator *allocator)
 {
     struct stretch_cnxt *cnxt;
     int max_periods = 3;
 
+    if (allocator && (!allocator->allocate || !allocator->deallocate)) {
+        fprintf (stderr, "stretch_init(): invalid allocator!\n");
+        return NULL;
+    }
+
     if (flags & STRETCH_FAST_FLAG) {
         longest_period = (longest_period + 1) & ~1;
         shortest_period &= ~1;
@@ -85,40 +341,68 @@ StretchHandle stretch_init (int shortest_period, int longest_period, int num_cha
         return NULL;
     }
 
-    cnxt = (struct stretch_cnxt *) calloc (1, sizeof (struct stretch_cnxt));
+    cnxt = (struct stretch_cnxt *) calloc_aligned (allocator, 1, sizeof (struct stretch_cnxt));
 
     if (cnxt) {
-        cnxt->inbuff_samples = longest_period * num_channels * max_periods;
-        cnxt->inbuff = calloc (cnxt->inbuff_samples, sizeof (*cnxt->inbuff));
+        if (allocator)
+            cnxt->allocator = *allocator;
 
-        if (num_channels == 2 || (flags & STRETCH_FAST_FLAG))
-            cnxt->calcbuff = calloc (longest_period * num_channels, sizeof (*cnxt->calcbuff));
+        cnxt->inbuff_samples = longest_period * num_channels * max_periods;
+        cnxt->inbuff = calloc_aligned (&cnxt->allocator, cnxt->inbuff_samples, sizeof (*cnxt->inbuff));
 
         if ((flags & STRETCH_FAST_FLAG))
-            cnxt->results = calloc (longest_period, sizeof (*cnxt->results));
+            cnxt->results = calloc_aligned (&cnxt->allocator, longest_period, sizeof (*cnxt->results));
     }
 
-    if (!cnxt || !cnxt->inbuff || (num_channels == 2 && (flags & STRETCH_FAST_FLAG) && !cnxt->calcbuff) || ((flags & STRETCH_FAST_FLAG) && !cnxt->results)) {
+    if (!cnxt || !cnxt->inbuff || ((flags & STRETCH_FAST_FLAG) && !cnxt->results)) {
         fprintf (stderr, "stretch_init(): out of memory!\n");
         return NULL;
     }
 
     cnxt->head = cnxt->tail = cnxt->longest = longest_period * num_channels;
     cnxt->fast_mode = (flags & STRETCH_FAST_FLAG) ? 1 : 0;
-    cnxt->shortest = shortest_period * num_channels;
+    cnxt->search_lo = cnxt->shortest = shortest_period * num_channels;
+    cnxt->search_hi = cnxt->longest;
     cnxt->num_chans = num_channels;
+    cnxt->inbuff_pos = -longest_period;
+    cnxt->find_period = period_kernels [cnxt->fast_mode] [num_channels <= 2 ? num_channels : 0];
+
+    if (!alloc_lanes (cnxt, cnxt->inbuff_samples)) {
+        fprintf (stderr, "stretch_init(): out of memory!\n");
+        stretch_deinit (cnxt);
+        return NULL;
+    }
+
+    update_lanes (cnxt, 0);
 
     if (flags & STRETCH_DUAL_FLAG) {
-        cnxt->next = stretch_init (shortest_period, longest_period, num_channels, flags & ~STRETCH_DUAL_FLAG);
-        cnxt->intermediate = calloc (longest_period * num_channels * max_periods, sizeof (*cnxt->intermediate));
+        cnxt->next = stretch_init_ex (shortest_period, longest_period, num_channels,
+            flags & ~(STRETCH_DUAL_FLAG | STRETCH_PITCH_FLAG | STRETCH_THREADED_FLAG), allocator);
+        cnxt->intermediate = calloc_aligned (&cnxt->allocator, longest_period * num_channels * max_periods, sizeof (*cnxt->intermediate));
+
+        if (cnxt->next && (flags & STRETCH_THREADED_FLAG) && !init_pipeline (cnxt)) {
+            fprintf (stderr, "stretch_init(): can't start pipeline thread!\n");
+            stretch_deinit (cnxt);
+            return NULL;
+        }
+    }
+
+    if ((flags & STRETCH_PITCH_FLAG) && !init_resampler (cnxt)) {
+        fprintf (stderr, "stretch_init(): out of memory!\n");
+        stretch_deinit (cnxt);
+        return NULL;
     }
 
     return (StretchHandle) cnxt;
 }
 
 /*
- * Re-Initialize a context of the time stretching code - as if freshly created
- * with stretch_init(). This drops all internal state.
+ * Re-Initialize a context of the time stretching code for a new stream. This drops
+ * all the state of the stream (buffered audio, ratio error and statistics), but keeps
+ * the settings made since stretch_init() (ratio, error policy, governor, block hook,
+ * gap detection, pitch ratio, unvoiced threshold, adaptive range and search threads)
+ * and a loaded period map, because the caller is still the same. Handles acquired from
+ * a pool go through restore_defaults() instead, which drops those as well.
  */
 
 void stretch_reset (StretchHandle handle)
@@ -127,6 +411,46 @@ void stretch_reset (StretchHandle handle)
 
     cnxt->head = cnxt->tail = cnxt->longest;
     memset (cnxt->inbuff, 0, cnxt->tail * sizeof (*cnxt->inbuff));
+    update_lanes (cnxt, 0);
+    cnxt->inbuff_pos = -cnxt->longest / cnxt->num_chans;
+    cnxt->pending_head = cnxt->pending_tail = 0;
+    cnxt->outsamples_error = 0.0;
+
+    if (cnxt->steps) {
+        cnxt->steps->input_head = cnxt->steps->input_tail = 0;
+        cnxt->steps->output_head = cnxt->steps->output_tail = 0;
+        cnxt->steps->end_of_input = 0;
+    }
+    cnxt->block_ratio = cnxt->error_ramp = 0.0;
+    cnxt->ramp_blocks = 0;
+    atomic_put (&cnxt->search_level, 0);
+    cnxt->level_blocks = cnxt->last_period = 0;
+    cnxt->load = 0.0;
+    atomic_put (&cnxt->unvoiced_blocks, 0);
+
+    if (cnxt->adaptive) {
+        cnxt->adaptive->widenings = 0;
+        restart_adaptive (cnxt);
+    }
+
+    if (cnxt->resampler)
+        reset_resampler (cnxt->resampler);
+
+    if (cnxt->gap) {
+        cnxt->gap->silence_frames = cnxt->gap->used_frames = cnxt->gap->total_frames = 0;
+        gap_restart (cnxt);
+    }
+
+    /* a map being recorded is dropped, but a loaded map stays for the next render */
+
+    if (cnxt->map_mode == MAP_RECORD) {
+        free_map (cnxt->map);
+        cnxt->map = NULL;
+        cnxt->map_mode = MAP_NONE;
+    }
+
+    if (cnxt->pipeline)
+        pipeline_collect (cnxt, NULL, -1);      /* wait for and discard blocks in flight */
 
     if (cnxt->next)
         stretch_reset (cnxt->next);
@@ -141,10 +465,31 @@ void stretch_reset (StretchHandle handle)
 int stretch_output_capacity (StretchHandle handle, int max_num_samples, float max_ratio)
 {
     struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int max_expected_samples = stretch_capacity (cnxt, max_num_samples, max_ratio);
+
+    /* with pitch shifting, the stretched samples (plus the filter history) are resampled by up to 4X */
+
+    if (cnxt->resampler) {
+        float min_step = cnxt->resampler->fixed_step ? cnxt->resampler->fixed_step : (cnxt->next ? 0.25 : 0.5);
+        max_expected_samples = (int) ceil ((max_expected_samples + RESAMPLE_TAPS) / min_step) + 1;
+    }
+
+    return max_expected_samples;
+}
+
+// Worst-case output of the time-stretching stage(s) alone.
+
+static int stretch_capacity (struct stretch_cnxt *cnxt, int max_num_samples, float max_ratio)
+{
     int max_period = cnxt->longest / cnxt->num_chans;
     int max_expected_samples;
     float next_ratio;
 
+    /* in gap mode, blocks waiting for the next frame to be classified may all be released at once */
+
+    if (cnxt->gap)
+        max_num_samples += cnxt->inbuff_samples / cnxt->num_chans;
+
     if (cnxt->next) {
         if (max_ratio < 0.5) {
             next_ratio = max_ratio / 0.5;
@@ -162,7 +507,12 @@ int stretch_output_capacity (StretchHandle handle, int max_num_samples, float ma
         max_period * (cnxt->fast_mode ? 4 : 3);
 
     if (cnxt->next)
-        max_expected_samples = stretch_output_capacity (cnxt->next, max_expected_samples, next_ratio);
+        max_expected_samples = stretch_capacity (cnxt->next, max_expected_samples, next_ratio);
+
+    /* with a pipeline, the output of the blocks still in flight from previous calls may also be returned */
+
+    if (cnxt->pipeline)
+        max_expected_samples += pipeline_capacity (cnxt);
 
     return max_expected_samples;
 }
@@ -174,6 +524,7 @@ int stretch_output_capacity (StretchHandle handle, int max_num_samples, float ma
  * number of values passed) and can be as large as desired (samples are buffered here).
  * The ratio may change between calls, but there is some latency to consider because
  * audio is buffered here and a new ratio may be applied to previously sent samples.
+ * A ratio set with stretch_set_ratio() overrides the one passed here.
  *
  * The exact number of samples output is not easy to determine in advance, so a function
  * is provided (stretch_output_capacity()) that calculates the maximum number of samples
@@ -186,35 +537,46 @@ int stretch_output_capacity (StretchHandle handle, int max_num_samples, float ma
 int stretch_samples (StretchHandle handle, const int16_t *samples, int num_samples, int16_t *output, float ratio)
 {
     struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
-    int out_samples = 0, next_samples = 0;
-    int16_t *outbuf = output;
-    float next_ratio;
+    int samples_generated = 0;
+    float first_ratio;
 
-    /* if there's a cascaded instance after this one, try to do as much of the ratio here and the rest in "next" */
+    if (!cnxt->resampler)
+        return time_stretch (cnxt, samples, num_samples, output, ratio);
 
-    if (cnxt->next) {
-        outbuf = cnxt->intermediate;
+    /*
+     * For pitch shifting, stretch no more than one longest period at a time (so the intermediate
+     * buffer stays small) and immediately resample back to the original duration. The resample
+     * step is the stretch ratio unless a fixed one was set with stretch_set_pitch_ratio().
+     */
 
-        if (ratio < 0.5) {
-            next_ratio = ratio / 0.5;
-            ratio = 0.5;
-        }
-        else if (ratio > 2.0) {
-            next_ratio = ratio / 2.0;
-            ratio = 2.0;
-        }
-        else
-            next_ratio = 1.0;
+    resampler_step (cnxt, control_ratio (cnxt, ratio, &first_ratio));
+
+    while (num_samples) {
+        int samples_to_stretch = num_samples, samples_stretched;
+
+        if (samples_to_stretch > cnxt->longest / cnxt->num_chans)
+            samples_to_stretch = cnxt->longest / cnxt->num_chans;
+
+        samples_stretched = time_stretch (cnxt, samples, samples_to_stretch, cnxt->pitch_buff, ratio);
+        samples_generated += resample (cnxt, cnxt->pitch_buff, samples_stretched,
+            output + samples_generated * cnxt->num_chans, 0);
+
+        samples += samples_to_stretch * cnxt->num_chans;
+        num_samples -= samples_to_stretch;
     }
 
-    num_samples *= cnxt->num_chans;
+    return samples_generated;
+}
 
-    /* this really should not happen, but a good idea to clamp in case */
+static int time_stretch (struct stretch_cnxt *cnxt, const int16_t *samples, int num_samples, int16_t *output, float ratio)
+{
+    float first_ratio, next_ratio, this_ratio;
+    int samples_generated = 0;
 
-    if (ratio < 0.5)
-        ratio = 0.5;
-    else if (ratio > 2.0)
-        ratio = 2.0;
+    this_ratio = control_ratio (cnxt, ratio, &first_ratio);
+    this_ratio = split_ratio (cnxt, this_ratio, first_ratio, &next_ratio);
+
+    num_samples *= cnxt->num_chans;
 
     /* while we have pending samples to read into our buffer */
 
@@ -228,102 +590,16 @@ int stretch_samples (StretchHandle handle, const int16_t *samples, int num_sampl
             samples_to_copy = cnxt->inbuff_samples - cnxt->head;
 
         memcpy (cnxt->inbuff + cnxt->head, samples, samples_to_copy * sizeof (cnxt->inbuff [0]));
+
+        if (cnxt->gap)
+            gap_scan (cnxt, cnxt->inbuff + cnxt->head, samples_to_copy / cnxt->num_chans);
+
         num_samples -= samples_to_copy;
         samples += samples_to_copy;
         cnxt->head += samples_to_copy;
+        update_lanes (cnxt, (cnxt->head - samples_to_copy) / cnxt->num_chans);
 
-        /* while there are enough samples to process (3 or 4 times the longest period), do so */
-
-        while (cnxt->tail >= cnxt->longest && cnxt->head - cnxt->tail >= cnxt->longest * (cnxt->fast_mode ? 3 : 2)) {
-            float process_ratio;
-            int period;
-
-            if (ratio != 1.0 || cnxt->outsamples_error)
-                period = cnxt->fast_mode ? find_period_fast (cnxt, cnxt->inbuff + cnxt->tail) :
-                    find_period (cnxt, cnxt->inbuff + cnxt->tail);
-            else
-                period = cnxt->longest;
-
-            /*
-             * Once we have calculated the best-match period, there are 4 possible transformations
-             * available to convert the input samples to output samples. Obviously we can simply
-             * copy the samples verbatim (1:1). Standard TDHS provides algorithms for 2:1 and
-             * 1:2 scaling, and I have created an obvious extension for 2:3 scaling. To achieve
-             * intermediate ratios we maintain a "error" term (in samples) and use that here to
-             * calculate the actual transformation to apply.
-             */
-
-            if (cnxt->outsamples_error == 0.0)
-                process_ratio = floor (ratio * 2.0 + 0.5) / 2.0;
-            else if (cnxt->outsamples_error > 0.0)
-                process_ratio = floor (ratio * 2.0) / 2.0;
-            else
-                process_ratio = ceil (ratio * 2.0) / 2.0;
-
-            if (process_ratio == 0.5) {
-                merge_blocks (outbuf + out_samples, cnxt->inbuff + cnxt->tail,
-                    cnxt->inbuff + cnxt->tail + period, period);
-                cnxt->outsamples_error += period - (period * 2.0 * ratio);
-                out_samples += period;
-                cnxt->tail += period * 2;
-            }
-            else if (process_ratio == 1.0) {
-                memcpy (outbuf + out_samples, cnxt->inbuff + cnxt->tail, period * 2 * sizeof (cnxt->inbuff [0]));
-
-                if (ratio != 1.0)
-                    cnxt->outsamples_error += (period * 2.0) - (period * 2.0 * ratio);
-                else
-                    cnxt->outsamples_error = 0; /* if the ratio is 1.0, we can never cancel the error, so just do it now */
-
-                out_samples += period * 2;
-                cnxt->tail += period * 2;
-            }
-            else if (process_ratio == 1.5) {
-                memcpy (outbuf + out_samples, cnxt->inbuff + cnxt->tail, period * sizeof (cnxt->inbuff [0]));
-                merge_blocks (outbuf + out_samples + period, cnxt->inbuff + cnxt->tail + period,
-                    cnxt->inbuff + cnxt->tail, period);
-                memcpy (outbuf + out_samples + period * 2, cnxt->inbuff + cnxt->tail + period, period * sizeof (cnxt->inbuff [0]));
-                cnxt->outsamples_error += (period * 3.0) - (period * 2.0 * ratio);
-                out_samples += period * 3;
-                cnxt->tail += period * 2;
-            }
-            else if (process_ratio == 2.0) {
-                merge_blocks (outbuf + out_samples, cnxt->inbuff + cnxt->tail,
-                    cnxt->inbuff + cnxt->tail - period, period * 2);
-
-                cnxt->outsamples_error += (period * 2.0) - (period * ratio);
-                out_samples += period * 2;
-                cnxt->tail += period;
-
-                if (cnxt->fast_mode) {
-                    merge_blocks (outbuf + out_samples, cnxt->inbuff + cnxt->tail,
-                        cnxt->inbuff + cnxt->tail - period, period * 2);
-
-                    cnxt->outsamples_error += (period * 2.0) - (period * ratio);
-                    out_samples += period * 2;
-                    cnxt->tail += period;
-                }
-            }
-            else
-                fprintf (stderr, "stretch_samples: fatal programming error: process_ratio == %g\n", process_ratio);
-
-            /* if there's another cascaded instance after this, pass the just stretched samples into that */
-
-            if (cnxt->next) {
-                next_samples += stretch_samples (cnxt->next, outbuf, out_samples / cnxt->num_chans, output + next_samples * cnxt->num_chans, next_ratio);
-                out_samples = 0;
-            }
-
-            /* finally, left-justify the samples in the buffer leaving one longest period of history */
-
-            int samples_to_move = cnxt->inbuff_samples - cnxt->tail + cnxt->longest;
-
-            memmove (cnxt->inbuff, cnxt->inbuff + cnxt->tail - cnxt->longest,
-                samples_to_move * sizeof (cnxt->inbuff [0]));
-
-            cnxt->head -= cnxt->tail - cnxt->longest;
-            cnxt->tail = cnxt->longest;
-        }
+        samples_generated += process_samples (cnxt, output + samples_generated * cnxt->num_chans, ratio, 0);
     }
 
     /*
@@ -333,242 +609,3982 @@ int stretch_samples (StretchHandle handle, const int16_t *samples, int num_sampl
      * and cascaded instances.
      */
 
-    if (ratio == 1.0 && !cnxt->outsamples_error && cnxt->head != cnxt->tail) {
+    if (this_ratio == 1.0 && !cnxt->outsamples_error && !cnxt->gap && cnxt->head != cnxt->tail) {
         int samples_leftover = cnxt->head - cnxt->tail;
 
+        if (cnxt->pipeline)
+            samples_generated += pipeline_drain (cnxt, output + samples_generated * cnxt->num_chans);
+
         if (cnxt->next)
-            next_samples += stretch_samples (cnxt->next, cnxt->inbuff + cnxt->tail, samples_leftover / cnxt->num_chans,
-                output + next_samples * cnxt->num_chans, next_ratio);
+            samples_generated += stretch_samples (cnxt->next, cnxt->inbuff + cnxt->tail, samples_leftover / cnxt->num_chans,
+                output + samples_generated * cnxt->num_chans, next_ratio);
         else {
-            memcpy (outbuf + out_samples, cnxt->inbuff + cnxt->tail, samples_leftover * sizeof (*output));
-            out_samples += samples_leftover;
+            memcpy (output + samples_generated * cnxt->num_chans, cnxt->inbuff + cnxt->tail, samples_leftover * sizeof (*output));
+            samples_generated += samples_leftover / cnxt->num_chans;
         }
 
-        memmove (cnxt->inbuff, cnxt->inbuff + cnxt->head - cnxt->longest, cnxt->longest * sizeof (cnxt->inbuff [0]));
-        cnxt->head = cnxt->tail = cnxt->longest;
+        cnxt->tail = cnxt->head;
+        left_justify (cnxt);
     }
 
-    return cnxt->next ? next_samples : out_samples / cnxt->num_chans;
-}  
+    return samples_generated;
+}
 
 /*
- * Flush any leftover samples out at normal speed. For cascaded dual instances this must be called
- * twice to completely flush, or simply call it until it returns zero samples. The maximum number
- * of samples that can be returned from each call of this function can be determined in advance with
- * stretch_output_capacity().
+ * Set the stretch ratio from any thread (e.g., a user interface) without any locking. While
+ * it's set (non-zero) it's used instead of the ratio passed to stretch_samples() and
+ * stretch_pull(), and it's read again for every block, so a change takes effect at the next
+ * block boundary rather than after the buffered samples have been processed. For dual
+ * instances, "first_ratio" (if non-zero) sets the split, i.e. the ratio of the first stage
+ * (0.5 to 2.0), and the second stage does the rest; otherwise as much as possible is done
+ * in the first stage. The ratio must be covered by the "max_ratio" passed to
+ * stretch_output_capacity(), which must be 4.0 when a split is set (stretch_pull() takes
+ * care of this itself). A zero ratio reverts to the passed ratios.
  */
 
-int stretch_flush (StretchHandle handle, int16_t *output)
+void stretch_set_ratio (StretchHandle handle, float ratio, float first_ratio)
 {
     struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
-    int samples_leftover = cnxt->head - cnxt->tail;
-    int samples_flushed = 0;
+    union { float f; uint32_t u; } ratio_bits, first_bits;
 
-    if (cnxt->next) {
-        if (samples_leftover)
-            samples_flushed = stretch_samples (cnxt->next, cnxt->inbuff + cnxt->tail, samples_leftover / cnxt->num_chans, output, 1.0);
+    ratio_bits.f = ratio;
+    first_bits.f = ratio ? first_ratio : 0.0;
+    atomic_put (&cnxt->control, ratio_bits.u | (uint64_t) first_bits.u << 32);
+}
 
-        if (!samples_flushed)
-            samples_flushed = stretch_flush (cnxt->next, output);
-    }
-    else {
-        memcpy (output, cnxt->inbuff + cnxt->tail, samples_leftover * sizeof (*output));
-        samples_flushed = samples_leftover / cnxt->num_chans;
+/*
+ * Set what happens to the accumulated ratio error (less than a couple of periods of output
+ * that are owed or overdue) when the requested ratio changes, which may also be done from
+ * any thread. STRETCH_ERROR_CARRY (the default) keeps it, so the total output length stays
+ * exact but the first blocks at the new ratio are biased. STRETCH_ERROR_RESET drops it, so
+ * the new ratio applies cleanly, and STRETCH_ERROR_RAMP keeps it but spreads it over the
+ * next few blocks. For dual instances each stage applies it to changes of its own ratio.
+ * Returns FALSE for an unknown policy.
+ */
+
+int stretch_set_error_policy (StretchHandle handle, int policy)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+
+    if (policy < STRETCH_ERROR_CARRY || policy > STRETCH_ERROR_RAMP) {
+        fprintf (stderr, "stretch_set_error_policy(): invalid policy!\n");
+        return 0;
     }
 
-    cnxt->tail = cnxt->head;
-    memset (cnxt->inbuff, 0, cnxt->tail * sizeof (*cnxt->inbuff));
+    for (; cnxt; cnxt = cnxt->next)
+        atomic_put (&cnxt->error_policy, policy);
 
-    return samples_flushed;
+    return 1;
 }
 
-/* free handle */
+/*
+ * Register a function to be called after every block is processed (or NULL to remove
+ * it), for tracing and profiling. It's given "context" and a StretchBlockEvent with the
+ * chosen period, the transformation applied, the ratio error before and after, and the
+ * time spent in the period search and the merging. The hook is also called for the
+ * blocks of the cascaded instance (with "stage" 1), and with STRETCH_THREADED_FLAG
+ * those calls come from the second instance's thread, so set it before processing.
+ * The timing is only done while a hook is set.
+ */
 
-void stretch_deinit (StretchHandle handle)
+void stretch_set_block_hook (StretchHandle handle, StretchBlockHook hook, void *context)
 {
     struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int stage = 0;
 
-    free (cnxt->calcbuff);
-    free (cnxt->results);
-    free (cnxt->inbuff);
-
-    if (cnxt->next) {
-        stretch_deinit (cnxt->next);
-        free (cnxt->intermediate);
+    for (; cnxt; cnxt = cnxt->next) {
+        cnxt->hook_context = context;
+        cnxt->block_hook = hook;
+        cnxt->stage = stage++;
     }
-
-    free (cnxt);
 }
 
 /*
- * The pitch detection is done by finding the period that produces the
- * maximum value for the following correlation formula applied to two
- * consecutive blocks of the given period length:
- *
- *         sum of the absolute values of each sample in both blocks
- *   ---------------------------------------------------------------------
- *   sum of the absolute differences of each corresponding pair of samples
- *
- * This formula was chosen for two reasons.  First, it produces output values
- * that can directly compared regardless of the pitch period.  Second, the
- * numerator can be accumulated for successive periods, and only the
- * denominator need be completely recalculated.
+ * A block hook that writes Chrome trace events (JSON array format, as read by the
+ * about://tracing and Perfetto viewers) to "file", which is a FILE pointer. Each block
+ * is a "block" event with its details as arguments, containing "search" and "merge"
+ * events, on a track for each stage. The caller writes the opening "[" of the array
+ * before processing; the closing "]" is optional in this format.
  */
 
-static int find_period (struct stretch_cnxt *cnxt, int16_t *samples)
+void stretch_trace_hook (void *file, const StretchBlockEvent *event)
 {
-    uint32_t sum, diff, factor, scaler, best_factor = 0;
-    int16_t *calcbuff = samples;
-    int period, best_period;
-    int i, j;
+    double start_us = event->start_ns / 1e3, search_us = event->search_ns / 1e3, merge_us = event->merge_ns / 1e3;
+
+    fprintf ((FILE *) file,
+        "{\"name\":\"block\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"position\":%lld,"
+        "\"period\":%d,\"level\":%d,\"ratio\":%.4f,\"process_ratio\":%.1f,\"error_before\":%.2f,\"error_after\":%.2f,"
+        "\"input\":%d,\"output\":%d}},\n"
+        "{\"name\":\"search\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n"
+        "{\"name\":\"merge\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+        event->stage, start_us, search_us + merge_us, (long long) event->position,
+        event->period, event->search_level, event->ratio, event->process_ratio, event->error_before, event->error_after,
+        event->input_samples, event->output_samples,
+        event->stage, start_us, search_us, event->stage, start_us + search_us, merge_us);
+}
 
-    period = best_period = cnxt->shortest / cnxt->num_chans;
+/*
+ * Return the ratio set with stretch_set_ratio() (and its split), or else the ratio that
+ * was passed in (with the default split).
+ */
 
-    // convert stereo to mono, and accumulate sum for longest period
+static float control_ratio (struct stretch_cnxt *cnxt, float ratio, float *first_ratio)
+{
+    uint64_t control = atomic_get (&cnxt->control);
+    union { float f; uint32_t u; } bits;
 
-    if (cnxt->num_chans == 2) {
-        calcbuff = cnxt->calcbuff;
+    *first_ratio = 0.0;
 
-        for (sum = i = j = 0; i < cnxt->longest * 2; i += 2)
-            sum += abs32 (calcbuff [j++] = ((int32_t) samples [i] + samples [i+1]) >> 1);
+    if (control) {
+        bits.u = (uint32_t) (control >> 32);
+        *first_ratio = bits.f;
+        bits.u = (uint32_t) control;
+        ratio = bits.f;
     }
-    else
-        for (sum = i = 0; i < cnxt->longest; ++i)
-            sum += abs32 (calcbuff [i]) + abs32 (calcbuff [i+cnxt->longest]);
-
-    // if silence return longest period, else calculate scaler based on largest sum
 
-    if (sum)
-        scaler = (MAX_CORR - 1) / sum;
-    else
-        return cnxt->longest;
+    return ratio;
+}
 
-    /* accumulate sum for shortest period size */
+// apply the error policy when the requested ratio changes (but not for the first block)
 
-    for (sum = i = 0; i < period; ++i)
-        sum += abs32 (calcbuff [i]) + abs32 (calcbuff [i+period]);
+static void ratio_changed (struct stretch_cnxt *cnxt, float ratio)
+{
+    int policy = atomic_get (&cnxt->error_policy);
 
-    /* this loop actually cycles through all period lengths */
+    if (cnxt->block_ratio && policy == STRETCH_ERROR_RESET) {
+        cnxt->outsamples_error = cnxt->error_ramp = 0.0;
+        cnxt->ramp_blocks = 0;
+    }
+    else if (cnxt->block_ratio && policy == STRETCH_ERROR_RAMP) {
+        cnxt->error_ramp += cnxt->outsamples_error;
+        cnxt->outsamples_error = 0.0;
+        cnxt->ramp_blocks = ERROR_RAMP_BLOCKS;
+    }
 
-    while (1) {
-        int16_t *comp = calcbuff + period * 2;
-        int16_t *ref = calcbuff + period;
+    cnxt->block_ratio = ratio;
+}
 
-        /* compute sum of absolute differences */
+/*
+ * Split the ratio between this instance and the cascaded instance (if any), trying to do
+ * as much of the ratio here as possible, unless "first_ratio" (if non-zero) requests a
+ * ratio for this instance. Returns the (clamped) ratio for this instance and stores the
+ * ratio for the "next" instance.
+ */
 
-        diff = 0;
+static float split_ratio (struct stretch_cnxt *cnxt, float ratio, float first_ratio, float *next_ratio)
+{
+    *next_ratio = 1.0;
 
-        while (ref != calcbuff)
-            diff += abs32 ((int32_t) *--ref - *--comp);
+    if (cnxt->next && first_ratio) {
+        if (first_ratio < 0.5)
+            first_ratio = 0.5;
+        else if (first_ratio > 2.0)
+            first_ratio = 2.0;
 
-        /*
-         * Here we calculate and store the resulting correlation
-         * factor.  Note that we must watch for a difference of
-         * zero, meaning a perfect match.  Also, for increased
-         * precision using integer math, we scale the sum.
-         */
+        *next_ratio = ratio / first_ratio;
 
-        factor = diff ? (sum * scaler) / diff : MAX_CORR;
+        if (*next_ratio < 0.5)
+            *next_ratio = 0.5;
+        else if (*next_ratio > 2.0)
+            *next_ratio = 2.0;
 
-        if (factor >= best_factor) {
-            best_factor = factor;
-            best_period = period;
+        ratio /= *next_ratio;
+    }
+    else if (cnxt->next) {
+        if (ratio < 0.5) {
+            *next_ratio = ratio / 0.5;
+            ratio = 0.5;
         }
+        else if (ratio > 2.0) {
+            *next_ratio = ratio / 2.0;
+            ratio = 2.0;
+        }
+    }
 
-        /* see if we're done */
-
-        if (period * cnxt->num_chans == cnxt->longest)
-            break;
-
-        /* update accumulating sum and current period */
+    /* this really should not happen, but a good idea to clamp in case */
 
-        sum += abs32 (calcbuff [period * 2]) + abs32 (calcbuff [period * 2 + 1]);
-        period++;
-    }
+    if (ratio < 0.5)
+        ratio = 0.5;
+    else if (ratio > 2.0)
+        ratio = 2.0;
 
-    return best_period * cnxt->num_chans;
+    return ratio;
 }
 
 /*
- * This pitch detection function is similar to find_period() above, except that it
- * is optimized for speed. The audio data corresponding to two maximum periods is
- * averaged 2:1 into the calculation buffer, and then the calulations are done
- * for every other period length. Because the time is essentially proportional to
- * both the number of samples and the number of period lengths to try, this scheme
- * can reduce the time by a factor approaching 4x. The correlation results on either
- * side of the peak are compared to calculate a more accurate center of the period.
+ * Return TRUE if there are enough buffered samples to process a block (3 or 4 times the
+ * longest period) and, in gap mode, the frames around the block have been classified.
  */
 
-static int find_period_fast (struct stretch_cnxt *cnxt, int16_t *samples)
+static int block_ready (struct stretch_cnxt *cnxt)
 {
-    uint32_t sum, diff, scaler, best_factor = 0;
-    int period, best_period;
-    int i, j;
+    if (cnxt->tail < cnxt->longest || cnxt->head - cnxt->tail < cnxt->longest * (cnxt->fast_mode ? 3 : 2))
+        return 0;
 
-    best_period = period = cnxt->shortest / (cnxt->num_chans * 2);
+    return !cnxt->gap || gap_classified (cnxt, cnxt->tail / cnxt->num_chans);
+}
 
-    /* first step is compressing data 2:1 into calcbuff, and calculating maximum sum */
+/*
+ * Process the buffered samples in blocks while they're ready, but no more than "max_blocks"
+ * blocks (if non-zero). Returns the number of samples (per channel) generated in "output".
+ * In gap mode, the ratio is chosen for each block (and then split for dual instances).
+ */
 
-    if (cnxt->num_chans == 2)
-        for (sum = i = j = 0; i < cnxt->longest * 2; i += 4)
-            sum += abs32 (cnxt->calcbuff [j++] = ((int32_t) samples [i] + samples [i+1] + samples [i+2] + samples [i+3]) >> 2);
-    else
-        for (sum = i = j = 0; i < cnxt->longest * 2; i += 2)
-            sum += abs32 (cnxt->calcbuff [j++] = ((int32_t) samples [i] + samples [i+1]) >> 1);
+static int process_samples (struct stretch_cnxt *cnxt, int16_t *output, float stretch_ratio, int max_blocks)
+{
+    int out_samples = 0, next_samples = 0;
+    int16_t *outbuf = cnxt->next ? cnxt->intermediate : output;
+    float ratio, first_ratio, next_ratio;
 
-    // if silence return longest period, else calculate scaler based on largest sum
+    if (cnxt->gap)
+        cnxt->gap->last_ratio = stretch_ratio;
 
-    if (sum)
-        scaler = (MAX_CORR - 1) / sum;
-    else
-        return cnxt->longest;
+    while (block_ready (cnxt)) {
+        float requested_ratio = control_ratio (cnxt, stretch_ratio, &first_ratio);
+        int64_t block_start = 0;
 
-    /* accumulate sum for shortest period */
+        if (requested_ratio != cnxt->block_ratio)
+            ratio_changed (cnxt, requested_ratio);
 
-    for (sum = i = 0; i < period; ++i)
-        sum += abs32 (cnxt->calcbuff [i]) + abs32 (cnxt->calcbuff [i+period]);
+        if (cnxt->ramp_blocks) {
+            float portion = cnxt->error_ramp / cnxt->ramp_blocks--;
 
-    /* this loop actually cycles through all period lengths */
+            cnxt->outsamples_error += portion;
+            cnxt->error_ramp -= portion;
+        }
 
-    while (1) {
-        int16_t *comp = cnxt->calcbuff + period * 2;
-        int16_t *ref = cnxt->calcbuff + period;
+        if (cnxt->gap)
+            requested_ratio = gap_ratio (cnxt, requested_ratio);
 
-        /* compute sum of absolute differences */
+        ratio = split_ratio (cnxt, requested_ratio, first_ratio, &next_ratio);
 
-        diff = 0;
+        if (cnxt->pipeline)
+            next_samples += pipeline_slot (cnxt, output + next_samples * cnxt->num_chans, &outbuf);
 
-        while (ref != cnxt->calcbuff)
-            diff += abs32 ((int32_t) *--ref - *--comp);
+        if (cnxt->block_hook || atomic_get (&cnxt->frame_budget))
+            block_start = clock_ns ();
 
-        /*
-         * Here we calculate and store the resulting correlation
-         * factor.  Note that we must watch for a difference of
-         * zero, meaning a perfect match.  Also, for increased
-         * precision using integer math, we scale the sum.
-         */
+        out_samples += stretch_block (cnxt, outbuf + out_samples, ratio, block_start);
 
-        cnxt->results [period] = diff ? (sum * scaler) / diff : MAX_CORR;
+        /* if there's another cascaded instance after this, pass the just stretched samples into that */
 
-        if (cnxt->results [period] >= best_factor) {    /* check if best yet */
-            best_factor = cnxt->results [period];
-            best_period = period;
+        if (cnxt->pipeline) {
+            pipeline_submit (cnxt, out_samples / cnxt->num_chans, next_ratio);
+            out_samples = 0;
+        }
+        else if (cnxt->next) {
+            next_samples += stretch_samples (cnxt->next, outbuf, out_samples / cnxt->num_chans, output + next_samples * cnxt->num_chans, next_ratio);
+            out_samples = 0;
         }
 
-        /* see if we're done */
+        /* finally, left-justify the samples in the buffer leaving one longest period of history */
 
-        if (period * cnxt->num_chans * 2 == cnxt->longest)
-            break;
+        left_justify (cnxt);
 
-        /* update accumulating sum and current period */
+        if (max_blocks && !--max_blocks)
+            break;
+    }
+
+    /* pick up any pipelined blocks that are already finished, without waiting */
+
+    if (cnxt->pipeline)
+        next_samples += pipeline_collect (cnxt, output + next_samples * cnxt->num_chans, 0);
+
+    return cnxt->next ? next_samples : out_samples / cnxt->num_chans;
+}
+
+/*
+ * Process the block at the tail with the period found for it (one for all the channels).
+ * Returns the number of samples (all channels) generated in "output".
+ */
+
+static int stretch_block (struct stretch_cnxt *cnxt, int16_t *output, float ratio, int64_t block_start)
+{
+    int period, tail = cnxt->tail, out_samples, consumed;
+    float process_ratio, error_before;
+    int64_t search_end = 0;
+
+    if (ratio != 1.0 || cnxt->outsamples_error)
+        period = map_period (cnxt);
+    else
+        period = cnxt->longest;
+
+    if (cnxt->block_hook)
+        search_end = clock_ns ();
+
+    error_before = cnxt->outsamples_error;
+    out_samples = splice_period (output, cnxt->inbuff + cnxt->tail, period, ratio, &cnxt->outsamples_error,
+        cnxt->fast_mode, &process_ratio, &consumed);
+    cnxt->tail += consumed;
+
+    if (ratio == 1.0) {         /* the error was dropped, so also any still to be ramped in */
+        cnxt->error_ramp = 0;
+        cnxt->ramp_blocks = 0;
+    }
+
+    governor_update (cnxt, block_start, consumed / cnxt->num_chans);
+
+    if (cnxt->block_hook) {
+        StretchBlockEvent event;
+
+        event.position = cnxt->inbuff_pos + tail / cnxt->num_chans;
+        event.period = period / cnxt->num_chans;
+        event.ratio = ratio;
+        event.process_ratio = process_ratio;
+        event.error_before = error_before;
+        event.error_after = cnxt->outsamples_error;
+        event.input_samples = consumed / cnxt->num_chans;
+        event.output_samples = out_samples / cnxt->num_chans;
+        call_block_hook (cnxt, &event, block_start, search_end);
+    }
+
+    return out_samples;
+}
+
+/*
+ * Once we have calculated the best-match period, there are 4 possible transformations
+ * available to convert the input samples to output samples. Obviously we can simply
+ * copy the samples verbatim (1:1). Standard TDHS provides algorithms for 2:1 and
+ * 1:2 scaling, and I have created an obvious extension for 2:3 scaling. To achieve
+ * intermediate ratios we maintain a "error" term (in samples) and use that here to
+ * calculate the actual transformation to apply.
+ *
+ * This is applied to the samples at "input" (which has a longest period of history
+ * before it) with the period and error term in interleaved samples. Returns the number
+ * of samples generated in "output", and stores the transformation and samples consumed.
+ */
+
+static int splice_period (int16_t *output, int16_t *input, int period, float ratio, float *error, int fast_mode, float *process_ratio, int *consumed)
+{
+    if (*error == 0.0)
+        *process_ratio = floor (ratio * 2.0 + 0.5) / 2.0;
+    else if (*error > 0.0)
+        *process_ratio = floor (ratio * 2.0) / 2.0;
+    else
+        *process_ratio = ceil (ratio * 2.0) / 2.0;
+
+    if (*process_ratio == 0.5) {
+        merge_blocks (output, input, input + period, period);
+        *error += period - (period * 2.0 * ratio);
+        *consumed = period * 2;
+        return period;
+    }
+    else if (*process_ratio == 1.0) {
+        memcpy (output, input, period * 2 * sizeof (*input));
+
+        if (ratio != 1.0)
+            *error += (period * 2.0) - (period * 2.0 * ratio);
+        else
+            *error = 0; /* if the ratio is 1.0, we can never cancel the error, so just do it now */
+
+        *consumed = period * 2;
+        return period * 2;
+    }
+    else if (*process_ratio == 1.5) {
+        memcpy (output, input, period * sizeof (*input));
+        merge_blocks (output + period, input + period, input, period);
+        memcpy (output + period * 2, input + period, period * sizeof (*input));
+        *error += (period * 3.0) - (period * 2.0 * ratio);
+        *consumed = period * 2;
+        return period * 3;
+    }
+    else if (*process_ratio == 2.0) {
+        merge_blocks (output, input, input - period, period * 2);
+        *error += (period * 2.0) - (period * ratio);
+        *consumed = period;
+
+        if (fast_mode) {
+            merge_blocks (output + period * 2, input + period, input, period * 2);
+            *error += (period * 2.0) - (period * ratio);
+            *consumed += period;
+            return period * 4;
+        }
+
+        return period * 2;
+    }
+
+    fprintf (stderr, "stretch_samples: fatal programming error: process_ratio == %g\n", *process_ratio);
+    *consumed = 0;
+    return 0;
+}
+
+// fill in the stage, level and timing of a block event and call the block hook with it
+
+static void call_block_hook (struct stretch_cnxt *cnxt, StretchBlockEvent *event, int64_t block_start, int64_t search_end)
+{
+    event->stage = cnxt->stage;
+    event->search_level = atomic_get (&cnxt->frame_budget) ? cnxt->search_level : atomic_get (&cnxt->max_level);
+    event->start_ns = block_start;
+    event->search_ns = (int) (search_end - block_start);
+    event->merge_ns = (int) (clock_ns () - search_end);
+    cnxt->block_hook (cnxt->hook_context, event);
+}
+
+/*
+ * Flush any leftover samples out at normal speed. For cascaded dual instances this must be called
+ * twice to completely flush, or simply call it until it returns zero samples. The maximum number
+ * of samples that can be returned from each call of this function can be determined in advance with
+ * stretch_output_capacity().
+ */
+
+int stretch_flush (StretchHandle handle, int16_t *output)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int samples_flushed;
+
+    if (!cnxt->resampler)
+        return flush_samples (cnxt, output);
+
+    /* once the stretcher is empty, pad out the resampler's filter to get its last samples */
+
+    samples_flushed = flush_samples (cnxt, cnxt->pitch_buff);
+
+    if (samples_flushed || cnxt->resampler->history_samples > RESAMPLE_TAPS / 2 - 1)
+        return resample (cnxt, cnxt->pitch_buff, samples_flushed, output, !samples_flushed);
+
+    return 0;
+}
+
+static int flush_samples (struct stretch_cnxt *cnxt, int16_t *output)
+{
+    int samples_leftover, samples_flushed = 0;
+
+    /* in gap mode, first stretch the blocks that were waiting for following frames to be classified */
+
+    if (cnxt->gap) {
+        gap_end_of_input (cnxt->gap);
+        samples_flushed = process_samples (cnxt, output, cnxt->gap->last_ratio, 0);
+        output += samples_flushed * cnxt->num_chans;
+    }
+
+    if (cnxt->pipeline) {
+        int samples_drained = pipeline_drain (cnxt, output);
+
+        output += samples_drained * cnxt->num_chans;
+        samples_flushed += samples_drained;
+    }
+
+    samples_leftover = cnxt->head - cnxt->tail;
+
+    if (cnxt->next && samples_leftover)
+        samples_flushed += stretch_samples (cnxt->next, cnxt->inbuff + cnxt->tail, samples_leftover / cnxt->num_chans, output, 1.0);
+    else if (!cnxt->next) {
+        memcpy (output, cnxt->inbuff + cnxt->tail, samples_leftover * sizeof (*output));
+        samples_flushed += samples_leftover / cnxt->num_chans;
+    }
+
+    if (cnxt->next && !samples_flushed)
+        samples_flushed = stretch_flush (cnxt->next, output);
+
+    /* leave the buffer ready for more audio, with a silent history */
+
+    cnxt->tail = cnxt->head;
+    left_justify (cnxt);
+    memset (cnxt->inbuff, 0, cnxt->tail * sizeof (*cnxt->inbuff));
+    update_lanes (cnxt, 0);
+
+    if (cnxt->gap)
+        gap_restart (cnxt);
+
+    return samples_flushed;
+}
+
+/*
+ * Generate exactly the specified number of samples (per channel) into "output", which is
+ * intended for serving fixed-size audio callbacks. Rather than being passed in, input is
+ * requested as required from the "input" callback, which is given a pointer directly into
+ * the stretcher's own buffer and the maximum number of samples (per channel) that it may
+ * store there, and returns the number it actually stored. When the callback returns zero
+ * (end of input) the stretcher is flushed and this function may then return fewer samples
+ * than requested, and zero once completely drained.
+ *
+ * Blocks are processed one at a time, directly into "output" when there's certainly room,
+ * so no output buffer larger than the request is ever required. Any excess from the last
+ * block is held here and returned first from the next call. Don't mix this with calls to
+ * stretch_samples() without stretch_reset() in between.
+ */
+
+int stretch_pull (StretchHandle handle, int16_t *output, int num_samples, float ratio, StretchInputCallback input, void *context)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int samples_pulled = 0, end_of_input = 0;
+
+    if (!cnxt->pending && !init_pending (cnxt))
+        return 0;
+
+    if (cnxt->resampler) {
+        float first_ratio;
+
+        resampler_step (cnxt, control_ratio (cnxt, ratio, &first_ratio));
+    }
+
+    while (samples_pulled < num_samples) {
+
+        /* first take anything left over from previously processed blocks */
+
+        if (cnxt->pending_head != cnxt->pending_tail) {
+            int samples_to_copy = (cnxt->pending_head - cnxt->pending_tail) / cnxt->num_chans;
+
+            if (samples_to_copy > num_samples - samples_pulled)
+                samples_to_copy = num_samples - samples_pulled;
+
+            memcpy (output + samples_pulled * cnxt->num_chans, cnxt->pending + cnxt->pending_tail,
+                samples_to_copy * cnxt->num_chans * sizeof (*output));
+
+            cnxt->pending_tail += samples_to_copy * cnxt->num_chans;
+            samples_pulled += samples_to_copy;
+            continue;
+        }
+
+        cnxt->pending_head = cnxt->pending_tail = 0;
+
+        /* if there's not enough buffered to process a block, ask for more (or flush at the end) */
+
+        if (!block_ready (cnxt)) {
+            int samples_read = end_of_input ? 0 :
+                input (context, cnxt->inbuff + cnxt->head, (cnxt->inbuff_samples - cnxt->head) / cnxt->num_chans);
+
+            if (samples_read > 0) {
+                if (cnxt->gap)
+                    gap_scan (cnxt, cnxt->inbuff + cnxt->head, samples_read);
+
+                cnxt->head += samples_read * cnxt->num_chans;
+                update_lanes (cnxt, cnxt->head / cnxt->num_chans - samples_read);
+            }
+            else if ((cnxt->pending_head = stretch_flush (cnxt, cnxt->pending) * cnxt->num_chans))
+                end_of_input = 1;
+            else
+                break;
+        }
+        else if (cnxt->resampler) {
+            int samples_stretched = process_samples (cnxt, cnxt->pitch_buff, ratio, 1);
+            cnxt->pending_head = resample (cnxt, cnxt->pitch_buff, samples_stretched, cnxt->pending, 0) * cnxt->num_chans;
+        }
+        else if (num_samples - samples_pulled >= cnxt->block_capacity)
+            samples_pulled += process_samples (cnxt, output + samples_pulled * cnxt->num_chans, ratio, 1);
+        else
+            cnxt->pending_head = process_samples (cnxt, cnxt->pending, ratio, 1) * cnxt->num_chans;
+    }
+
+    return samples_pulled;
+}
+
+/* allocate the buffer for output that stretch_pull() has generated but not returned yet */
+
+static int init_pending (struct stretch_cnxt *cnxt)
+{
+    int block_samples = cnxt->longest * 4 / cnxt->num_chans;
+
+    cnxt->pending_size = stretch_output_capacity (cnxt, cnxt->inbuff_samples / cnxt->num_chans, cnxt->next ? 4.0 : 2.0) * cnxt->num_chans;
+    cnxt->block_capacity = cnxt->next ? stretch_output_capacity (cnxt->next, block_samples, 2.0) : block_samples;
+
+    if (cnxt->pipeline)
+        cnxt->block_capacity += pipeline_capacity (cnxt);
+
+    return (cnxt->pending = calloc_aligned (&cnxt->allocator, cnxt->pending_size, sizeof (*cnxt->pending))) != NULL;
+}
+
+/*
+ * The work of stretch_samples() can also be split up so that a cooperative scheduler
+ * (coroutines, job systems) can interleave many streams on one thread in predictable time
+ * slices. stretch_push() just queues input, stretch_step() does a bounded amount of work on
+ * it, and stretch_read() takes the output it generated. Both queues are internal, so there
+ * is no output buffer to size. Don't mix these with the other processing functions without
+ * stretch_reset() in between.
+ */
+
+/*
+ * Queue the specified samples (per channel) for stretch_step() without processing them;
+ * the queue grows as required. Pushing zero samples marks the end of the stream, so that
+ * stretch_step() then flushes the stretcher, after which the next stream may be pushed.
+ * Returns FALSE if out of memory, or if the end of the stream has not been flushed yet.
+ */
+
+int stretch_push (StretchHandle handle, const int16_t *samples, int num_samples)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct step_queue *sq = cnxt->steps ? cnxt->steps : init_steps (cnxt);
+
+    if (!sq || sq->end_of_input)
+        return 0;
+
+    if (!num_samples) {
+        sq->end_of_input = 1;
+        return 1;
+    }
+
+    if (!reserve_steps_input (cnxt, num_samples * cnxt->num_chans))
+        return 0;
+
+    memcpy (sq->input + sq->input_head, samples, num_samples * cnxt->num_chans * sizeof (*samples));
+    sq->input_head += num_samples * cnxt->num_chans;
+    return 1;
+}
+
+/*
+ * Process the queued input with the given ratio (as for stretch_samples()), but no more
+ * than "max_blocks" blocks (if non-zero). Each block consumes two to four longest periods
+ * of input, so the time taken is bounded no matter how much is queued. The last steps of
+ * a stream flush it (one block each). Returns TRUE if there's more work to do without more
+ * input, which may require stretch_read() first if the output queue is full, and FALSE
+ * once everything pushed has been processed (or flushed).
+ */
+
+int stretch_step (StretchHandle handle, int max_blocks, float ratio)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct step_queue *sq = cnxt->steps ? cnxt->steps : init_steps (cnxt);
+    int blocks_done = 0, queued, room;
+
+    if (!sq)
+        return 0;
+
+    if (cnxt->resampler) {
+        float first_ratio;
+
+        resampler_step (cnxt, control_ratio (cnxt, ratio, &first_ratio));
+    }
+
+    while (1) {
+        int16_t *output = sq->output + sq->output_head;
+        int samples_generated;
+
+        queued = sq->input_head - sq->input_tail;
+        room = cnxt->inbuff_samples - cnxt->head;
+
+        /* move queued input into the stretcher's buffer only when it can't do a block yet */
+
+        if (!block_ready (cnxt) && queued && room) {
+            int samples_to_copy = queued < room ? queued : room;
+
+            memcpy (cnxt->inbuff + cnxt->head, sq->input + sq->input_tail, samples_to_copy * sizeof (*sq->input));
+
+            if (cnxt->gap)
+                gap_scan (cnxt, cnxt->inbuff + cnxt->head, samples_to_copy / cnxt->num_chans);
+
+            cnxt->head += samples_to_copy;
+            sq->input_tail += samples_to_copy;
+            update_lanes (cnxt, (cnxt->head - samples_to_copy) / cnxt->num_chans);
+
+            if (sq->input_tail == sq->input_head)
+                sq->input_tail = sq->input_head = 0;
+
+            continue;
+        }
+
+        if ((!block_ready (cnxt) && (!sq->end_of_input || queued)) || (max_blocks && blocks_done == max_blocks))
+            break;
+
+        /* the output queue doesn't grow, the caller has to read it */
+
+        if (sq->output_size - sq->output_head < sq->quantum && sq->output_tail) {
+            memmove (sq->output, sq->output + sq->output_tail, (sq->output_head - sq->output_tail) * sizeof (*sq->output));
+            sq->output_head -= sq->output_tail;
+            sq->output_tail = 0;
+            output = sq->output + sq->output_head;
+        }
+
+        if (sq->output_size - sq->output_head < sq->quantum)
+            break;
+
+        if (!block_ready (cnxt)) {
+            if (!(samples_generated = stretch_flush (cnxt, output)))
+                sq->end_of_input = 0;
+        }
+        else if (cnxt->resampler) {
+            int samples_stretched = process_samples (cnxt, cnxt->pitch_buff, ratio, 1);
+            samples_generated = resample (cnxt, cnxt->pitch_buff, samples_stretched, output, 0);
+        }
+        else
+            samples_generated = process_samples (cnxt, output, ratio, 1);
+
+        sq->output_head += samples_generated * cnxt->num_chans;
+        blocks_done++;
+    }
+
+    return block_ready (cnxt) || (queued && room) || sq->end_of_input;
+}
+
+/*
+ * Take up to "max_samples" samples (per channel) of the output generated by stretch_step(),
+ * returning the number copied to "output". If "output" is NULL, just return the number of
+ * samples available.
+ */
+
+int stretch_read (StretchHandle handle, int16_t *output, int max_samples)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct step_queue *sq = cnxt->steps;
+    int samples_to_copy;
+
+    if (!sq)
+        return 0;
+
+    samples_to_copy = (sq->output_head - sq->output_tail) / cnxt->num_chans;
+
+    if (!output)
+        return samples_to_copy;
+
+    if (samples_to_copy > max_samples)
+        samples_to_copy = max_samples;
+
+    memcpy (output, sq->output + sq->output_tail, samples_to_copy * cnxt->num_chans * sizeof (*output));
+    sq->output_tail += samples_to_copy * cnxt->num_chans;
+
+    if (sq->output_tail == sq->output_head)
+        sq->output_tail = sq->output_head = 0;
+
+    return samples_to_copy;
+}
+
+/*
+ * Allocate the queues for the step functions. The output queue holds two of the largest
+ * outputs of a block or flush (see init_pending()), so a step can always proceed while
+ * less than half of it is unread.
+ */
+
+static struct step_queue *init_steps (struct stretch_cnxt *cnxt)
+{
+    struct step_queue *sq = calloc_aligned (&cnxt->allocator, 1, sizeof (struct step_queue));
+
+    if (!sq)
+        return NULL;
+
+    sq->quantum = stretch_output_capacity (cnxt, cnxt->inbuff_samples / cnxt->num_chans, cnxt->next ? 4.0 : 2.0) * cnxt->num_chans;
+    sq->output_size = sq->quantum * 2;
+
+    if (!(sq->output = calloc_aligned (&cnxt->allocator, sq->output_size, sizeof (*sq->output)))) {
+        free_aligned (sq);
+        return NULL;
+    }
+
+    return cnxt->steps = sq;
+}
+
+/* make room at the input queue's head for "num_samples" more (interleaved) samples */
+
+static int reserve_steps_input (struct stretch_cnxt *cnxt, int num_samples)
+{
+    struct step_queue *sq = cnxt->steps;
+
+    if (sq->input_head + num_samples > sq->input_size && sq->input_tail) {
+        memmove (sq->input, sq->input + sq->input_tail, (sq->input_head - sq->input_tail) * sizeof (*sq->input));
+        sq->input_head -= sq->input_tail;
+        sq->input_tail = 0;
+    }
+
+    if (sq->input_head + num_samples > sq->input_size) {
+        int input_size = sq->input_size ? sq->input_size : 4096;
+        int16_t *input;
+
+        while (input_size < sq->input_head + num_samples)
+            input_size *= 2;
+
+        if (!(input = realloc_aligned (&cnxt->allocator, sq->input, input_size, sizeof (*input))))
+            return 0;
+
+        sq->input = input;
+        sq->input_size = input_size;
+    }
+
+    return 1;
+}
+
+static void free_steps (struct stretch_cnxt *cnxt)
+{
+    if (cnxt->steps) {
+        free_aligned (cnxt->steps->input);
+        free_aligned (cnxt->steps->output);
+        free_aligned (cnxt->steps);
+        cnxt->steps = NULL;
+    }
+}
+
+/*
+ * Convenience shims around stretch_samples() and stretch_flush() for audio stored as one
+ * array per channel. The stretcher itself only works on interleaved audio, so these just
+ * copy the input into an internal interleaved buffer (one longest period at a time), call
+ * the interleaved function and copy its output back out to the channel arrays. That is
+ * the same work a caller would do around the interleaved calls, so there is nothing to be
+ * gained by using them other than not writing the copies. Each output array must hold the
+ * same number of samples as the interleaved functions would return per channel (see
+ * stretch_output_capacity()). Mono audio is simply passed straight through.
+ */
+
+static int init_planar (struct stretch_cnxt *cnxt)
+{
+    int max_samples = stretch_output_capacity (cnxt, cnxt->inbuff_samples / cnxt->num_chans, cnxt->next ? 4.0 : 2.0);
+
+    cnxt->planar_in = calloc_aligned (&cnxt->allocator, cnxt->longest, sizeof (*cnxt->planar_in));
+    cnxt->planar_out = calloc_aligned (&cnxt->allocator, max_samples * cnxt->num_chans, sizeof (*cnxt->planar_out));
+
+    if (!cnxt->planar_in || !cnxt->planar_out) {
+        free_aligned (cnxt->planar_in);
+        free_aligned (cnxt->planar_out);
+        cnxt->planar_in = cnxt->planar_out = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void deinterleave (int16_t *const output[], int offset, const int16_t *samples, int num_samples, int num_chans)
+{
+    int i, ch;
+
+    for (ch = 0; ch < num_chans; ++ch) {
+        int16_t *dst = output [ch] + offset;
+
+        for (i = 0; i < num_samples; ++i)
+            dst [i] = samples [i * num_chans + ch];
+    }
+}
+
+int stretch_samples_copy_planar (StretchHandle handle, const int16_t *const samples[], int num_samples, int16_t *const output[], float ratio)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int samples_generated = 0, offset = 0, i, ch;
+
+    if (cnxt->num_chans == 1)
+        return stretch_samples (cnxt, samples [0], num_samples, output [0], ratio);
+
+    if (!cnxt->planar_in && !init_planar (cnxt))
+        return 0;
+
+    while (offset < num_samples) {
+        int samples_to_copy = num_samples - offset, samples_stretched;
+
+        if (samples_to_copy > cnxt->longest / cnxt->num_chans)
+            samples_to_copy = cnxt->longest / cnxt->num_chans;
+
+        for (ch = 0; ch < cnxt->num_chans; ++ch) {
+            const int16_t *src = samples [ch] + offset;
+
+            for (i = 0; i < samples_to_copy; ++i)
+                cnxt->planar_in [i * cnxt->num_chans + ch] = src [i];
+        }
+
+        samples_stretched = stretch_samples (cnxt, cnxt->planar_in, samples_to_copy, cnxt->planar_out, ratio);
+        deinterleave (output, samples_generated, cnxt->planar_out, samples_stretched, cnxt->num_chans);
+        samples_generated += samples_stretched;
+        offset += samples_to_copy;
+    }
+
+    return samples_generated;
+}
+
+int stretch_flush_copy_planar (StretchHandle handle, int16_t *const output[])
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int samples_flushed;
+
+    if (cnxt->num_chans == 1)
+        return stretch_flush (cnxt, output [0]);
+
+    if (!cnxt->planar_in && !init_planar (cnxt))
+        return 0;
+
+    samples_flushed = stretch_flush (cnxt, cnxt->planar_out);
+    deinterleave (output, 0, cnxt->planar_out, samples_flushed, cnxt->num_chans);
+
+    return samples_flushed;
+}
+
+/*
+ * Enable gap (silence) mode, in which stretches of audio quieter than "threshold_dB" (RMS
+ * re full scale) are stretched by "gap_ratio" instead of the ratio passed to the stretch
+ * functions. The audio is divided into frames of "window_samples" (per channel) and a block
+ * gets the gap ratio only if its own frame and the frames on either side are all below the
+ * threshold, which means that output is delayed by up to two frames (this is flushed out
+ * by stretch_flush() as usual). Call this before any audio is processed, and include the
+ * gap ratio in the "max_ratio" passed to stretch_output_capacity(). A zero ratio disables
+ * gap mode again. Returns FALSE for out of memory; if that happens while the pitch-shift
+ * resampler is being reallocated, the handle is left without one (no pitch shifting).
+ */
+
+int stretch_set_gap (StretchHandle handle, float gap_ratio, float threshold_dB, int window_samples)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int inbuff_samples = cnxt->longest * (cnxt->fast_mode ? 4 : 3);
+    struct gap_detect *gap = cnxt->gap;
+    int16_t *inbuff;
+
+    if (gap) {
+        free_aligned (gap->silent);
+        free_aligned (gap);
+        cnxt->gap = gap = NULL;
+    }
+
+    if (gap_ratio) {
+        if (window_samples < 1 || !(gap = calloc_aligned (&cnxt->allocator, 1, sizeof (struct gap_detect))))
+            return 0;
+
+        gap->ratio = gap_ratio;
+        gap->window = window_samples;
+        gap->threshold = 32768.0 * 32767.0 * 0.5 * pow (10.0, threshold_dB / 10.0) * cnxt->num_chans * cnxt->num_chans;
+
+        /* room for the classification of the two frames past the block being processed */
+
+        inbuff_samples += window_samples * 2 * cnxt->num_chans;
+        gap->ring_size = inbuff_samples / cnxt->num_chans / window_samples + 4;
+
+        if (!(gap->silent = calloc_aligned (&cnxt->allocator, gap->ring_size, sizeof (*gap->silent)))) {
+            free_aligned (gap);
+            return 0;
+        }
+    }
+
+    if (inbuff_samples != cnxt->inbuff_samples) {
+        if (!alloc_lanes (cnxt, inbuff_samples) || !(inbuff = realloc_aligned (&cnxt->allocator, cnxt->inbuff, inbuff_samples, sizeof (*inbuff)))) {
+            if (gap) {
+                free_aligned (gap->silent);
+                free_aligned (gap);
+            }
+
+            return 0;
+        }
+
+        cnxt->inbuff = inbuff;
+        cnxt->inbuff_samples = inbuff_samples;
+    }
+
+    cnxt->gap = gap;
+
+    /* buffers sized from the input buffer are reallocated (now, or on demand) */
+
+    free_aligned (cnxt->pending);
+    free_aligned (cnxt->planar_in);
+    free_aligned (cnxt->planar_out);
+    cnxt->pending = cnxt->planar_in = cnxt->planar_out = NULL;
+    free_steps (cnxt);
+
+    if (cnxt->resampler) {
+        float fixed_step = cnxt->resampler->fixed_step;
+
+        free_resampler (cnxt->resampler);
+        free_aligned (cnxt->pitch_buff);
+        cnxt->resampler = NULL;
+        cnxt->pitch_buff = NULL;
+
+        if (!init_resampler (cnxt))
+            return 0;
+
+        cnxt->resampler->fixed_step = fixed_step;
+    }
+
+    stretch_reset (cnxt);
+    return 1;
+}
+
+/*
+ * Return the gap mode statistics since the last stretch_reset(): the number of frames
+ * that were classified, how many of those were below the threshold, and how many were
+ * actually stretched with the gap ratio (because their neighbors were also silent).
+ */
+
+void stretch_gap_stats (StretchHandle handle, int *total_frames, int *silence_frames, int *used_frames)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct gap_detect *gap = cnxt->gap;
+
+    *total_frames = gap ? gap->total_frames : 0;
+    *silence_frames = gap ? gap->silence_frames : 0;
+    *used_frames = gap ? gap->used_frames : 0;
+}
+
+// Start classifying frames again from the current end of the buffer (after a reset or flush).
+
+static void gap_restart (struct stretch_cnxt *cnxt)
+{
+    struct gap_detect *gap = cnxt->gap;
+
+    gap->origin = cnxt->inbuff_pos + cnxt->head / cnxt->num_chans;
+    gap->frames_done = gap->frame_samples = gap->end_of_input = 0;
+    gap->energy = 0;
+}
+
+// Frames before the start and past the end of the audio count as silent.
+
+static int frame_silent (struct gap_detect *gap, int frame)
+{
+    if (frame < 0 || frame >= gap->frames_done)
+        return 1;
+
+    return gap->silent [frame % gap->ring_size];
+}
+
+static void classify_frame (struct gap_detect *gap)
+{
+    int frame = gap->frames_done++, silent = gap->energy <= gap->threshold * gap->frame_samples;
+
+    gap->silent [frame % gap->ring_size] = silent;
+    gap->silence_frames += silent;
+    gap->total_frames++;
+
+    // now we know whether the previous frame gets the gap ratio
+
+    if (frame && silent && frame_silent (gap, frame - 1) && frame_silent (gap, frame - 2))
+        gap->used_frames++;
+
+    gap->frame_samples = 0;
+    gap->energy = 0;
+}
+
+/*
+ * Accumulate the energy of the channel sum for newly buffered samples (in integers, which is
+ * exact), classifying each frame as it's completed.
+ */
+
+static void gap_scan (struct stretch_cnxt *cnxt, const int16_t *samples, int num_samples)
+{
+    struct gap_detect *gap = cnxt->gap;
+    int num_chans = cnxt->num_chans, i, ch;
+
+    while (num_samples) {
+        int samples_to_scan = gap->window - gap->frame_samples;
+        int64_t energy = 0;
+
+        if (samples_to_scan > num_samples)
+            samples_to_scan = num_samples;
+
+        if (num_chans == 1)
+            for (i = 0; i < samples_to_scan; ++i)
+                energy += (int32_t) samples [i] * samples [i];
+        else if (num_chans == 2)
+            for (i = 0; i < samples_to_scan; ++i) {
+                int32_t sum = samples [i * 2] + samples [i * 2 + 1];
+                energy += (int64_t) sum * sum;
+            }
+        else
+            for (i = 0; i < samples_to_scan; ++i) {
+                int32_t sum = 0;
+
+                for (ch = 0; ch < num_chans; ++ch)
+                    sum += samples [i * num_chans + ch];
+
+                energy += (int64_t) sum * sum;
+            }
+
+        gap->energy += energy;
+        gap->frame_samples += samples_to_scan;
+        samples += samples_to_scan * num_chans;
+        num_samples -= samples_to_scan;
+
+        if (gap->frame_samples == gap->window)
+            classify_frame (gap);
+    }
+}
+
+// Classify any partial last frame, and release the blocks waiting for frames past the end.
+
+static void gap_end_of_input (struct gap_detect *gap)
+{
+    if (gap->frame_samples)
+        classify_frame (gap);
+
+    if (gap->frames_done && frame_silent (gap, gap->frames_done - 1) && frame_silent (gap, gap->frames_done - 2))
+        gap->used_frames++;
+
+    gap->end_of_input = 1;
+}
+
+// Return TRUE if the frames up to the one after that of the given frame of inbuff are classified.
+
+static int gap_classified (struct stretch_cnxt *cnxt, int frame)
+{
+    struct gap_detect *gap = cnxt->gap;
+
+    return gap->end_of_input || gap->frames_done > (cnxt->inbuff_pos + frame - gap->origin) / gap->window + 1;
+}
+
+// Return TRUE if the frame holding the given frame of inbuff and the frames on either side are all silent.
+
+static int gap_silent (struct stretch_cnxt *cnxt, int frame)
+{
+    struct gap_detect *gap = cnxt->gap;
+    int index = (int) ((cnxt->inbuff_pos + frame - gap->origin) / gap->window);
+
+    return frame_silent (gap, index - 1) && frame_silent (gap, index) && frame_silent (gap, index + 1);
+}
+
+// Return the gap ratio if the block at the tail is in a gap (see gap_silent()).
+
+static float gap_ratio (struct stretch_cnxt *cnxt, float ratio)
+{
+    return gap_silent (cnxt, cnxt->tail / cnxt->num_chans) ? cnxt->gap->ratio : ratio;
+}
+
+/* free handle */
+
+void stretch_deinit (StretchHandle handle)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+
+    free_aligned (cnxt->results);
+    free_aligned (cnxt->mono_lane);
+    free_aligned (cnxt->mono_sums);
+    free_aligned (cnxt->pair_lanes [0]);
+    free_aligned (cnxt->pair_lanes [1]);
+    free_aligned (cnxt->pair_sums [0]);
+    free_aligned (cnxt->pair_sums [1]);
+    free_aligned (cnxt->inbuff);
+    free_aligned (cnxt->pending);
+    free_aligned (cnxt->pitch_buff);
+    free_aligned (cnxt->planar_in);
+    free_aligned (cnxt->planar_out);
+    free_steps (cnxt);
+    free_adaptive (cnxt);
+
+    if (cnxt->gap) {
+        free_aligned (cnxt->gap->silent);
+        free_aligned (cnxt->gap);
+    }
+    free_resampler (cnxt->resampler);
+
+    if (cnxt->map_mode != MAP_SHARED)
+        free_map (cnxt->map);
+
+    if (cnxt->pipeline)
+        free_pipeline (cnxt);
+
+    if (cnxt->team)
+        free_team (cnxt);
+
+    if (cnxt->next) {
+        stretch_deinit (cnxt->next);
+        free_aligned (cnxt->intermediate);
+    }
+
+    free_aligned (cnxt);
+}
+
+/*
+ * Set a fixed pitch-shift ratio for a handle created with STRETCH_PITCH_FLAG (0.25X to
+ * 4.00X, or 0.5X to 2.0X without STRETCH_DUAL_FLAG). Once set, stretched audio is always
+ * resampled by this ratio regardless of the ratio passed to stretch_samples(), which is
+ * useful for shifting the pitch and changing the tempo at the same time. Setting zero
+ * reverts to resampling by the stretch ratio, so that the duration is unchanged.
+ */
+
+void stretch_set_pitch_ratio (StretchHandle handle, float ratio)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+
+    if (cnxt->resampler) {
+        float max_ratio = cnxt->next ? 4.0 : 2.0;
+
+        if (ratio && ratio < 1.0 / max_ratio)
+            ratio = 1.0 / max_ratio;
+        else if (ratio > max_ratio)
+            ratio = max_ratio;
+
+        cnxt->resampler->fixed_step = ratio;
+    }
+}
+
+/*
+ * The pitch-shift resampler is a windowed-sinc (Blackman) polyphase filter of RESAMPLE_TAPS
+ * taps, with RESAMPLE_PHASES phases and linear interpolation between adjacent phases. The
+ * input history is kept as planar floats so that the inner loops are simple dot products
+ * that the compiler can vectorize. When downsampling, the cutoff is lowered to the output
+ * Nyquist frequency, and the coefficients are recalculated only when this changes by more
+ * than about 1% (i.e., not for every small ratio change).
+ */
+
+static int init_resampler (struct stretch_cnxt *cnxt)
+{
+    int max_samples = stretch_capacity (cnxt, cnxt->inbuff_samples / cnxt->num_chans, cnxt->next ? 4.0 : 2.0);
+    struct resampler *rs = calloc_aligned (&cnxt->allocator, 1, sizeof (struct resampler));
+    int16_t *pitch_buff;
+
+    if (!rs)
+        return 0;
+
+    rs->num_chans = cnxt->num_chans;
+    rs->step = 1.0;
+    rs->history_size = max_samples + RESAMPLE_TAPS * 2;
+    rs->history = calloc_aligned (&cnxt->allocator, rs->history_size * cnxt->num_chans, sizeof (*rs->history));
+    rs->coeffs = calloc_aligned (&cnxt->allocator, (RESAMPLE_PHASES + 1) * RESAMPLE_TAPS, sizeof (*rs->coeffs));
+    pitch_buff = calloc_aligned (&cnxt->allocator, max_samples * cnxt->num_chans, sizeof (*pitch_buff));
+
+    // only a complete resampler is stored in the context, so it is never left half built
+
+    if (!rs->history || !rs->coeffs || !pitch_buff) {
+        free_resampler (rs);
+        free_aligned (pitch_buff);
+        return 0;
+    }
+
+    reset_resampler (rs);
+    resampler_filter (rs, rs->step);
+    cnxt->resampler = rs;
+    cnxt->pitch_buff = pitch_buff;
+    return 1;
+}
+
+static void free_resampler (struct resampler *rs)
+{
+    if (rs) {
+        free_aligned (rs->history);
+        free_aligned (rs->coeffs);
+        free_aligned (rs);
+    }
+}
+
+// Start the history with enough silence that the first output sample aligns with the first input sample.
+
+static void reset_resampler (struct resampler *rs)
+{
+    int ch;
+
+    rs->history_samples = RESAMPLE_TAPS / 2 - 1;
+    rs->position = RESAMPLE_TAPS / 2 - 1;
+
+    for (ch = 0; ch < rs->num_chans; ++ch)
+        memset (rs->history + ch * rs->history_size, 0, rs->history_samples * sizeof (*rs->history));
+}
+
+/*
+ * Set the resampling step (input samples per output sample) for the next call of resample(),
+ * which is normally the stretch ratio (i.e., the original duration is restored).
+ */
+
+static void resampler_step (struct stretch_cnxt *cnxt, float ratio)
+{
+    struct resampler *rs = cnxt->resampler;
+    float max_step = cnxt->next ? 4.0 : 2.0;
+
+    if (rs->fixed_step)
+        ratio = rs->fixed_step;
+    else if (ratio < 1.0 / max_step)
+        ratio = 1.0 / max_step;
+    else if (ratio > max_step)
+        ratio = max_step;
+
+    rs->step = ratio;
+    resampler_filter (rs, ratio);
+}
+
+static void resampler_filter (struct resampler *rs, float step)
+{
+    double cutoff = (step > 1.0 ? 1.0 / step : 1.0) * RESAMPLE_BANDWIDTH;
+    int phase, tap;
+
+    if (fabs (cutoff - rs->cutoff) < cutoff * 0.01)
+        return;
+
+    rs->cutoff = cutoff;
+    rs->filter_step = step;
+
+    for (phase = 0; phase <= RESAMPLE_PHASES; ++phase) {
+        float *coeffs = rs->coeffs + phase * RESAMPLE_TAPS;
+        double sum = 0.0;
+
+        for (tap = 0; tap < RESAMPLE_TAPS; ++tap) {
+            double x = tap - RESAMPLE_TAPS / 2 + 1 - (double) phase / RESAMPLE_PHASES;      // distance from output
+            double u = x / (RESAMPLE_TAPS / 2), window = 0.0, sinc = cutoff;
+
+            if (u > -1.0 && u < 1.0)
+                window = 0.42 + 0.5 * cos (PI * u) + 0.08 * cos (2.0 * PI * u);
+
+            if (x)
+                sinc = sin (PI * cutoff * x) / (PI * x);
+
+            sum += coeffs [tap] = sinc * window;
+        }
+
+        for (tap = 0; tap < RESAMPLE_TAPS; ++tap)   // unity gain at DC for every phase
+            coeffs [tap] /= sum;
+    }
+}
+
+/*
+ * Append the specified samples to the resampler history and generate all the output samples that
+ * are now possible, stepping through the input by the current step for each output. If "flushing"
+ * is set the history is padded with silence to get the last samples, and the resampler is then
+ * left ready for new audio.
+ */
+
+static int resample (struct stretch_cnxt *cnxt, const int16_t *input, int num_samples, int16_t *output, int flushing)
+{
+    struct resampler *rs = cnxt->resampler;
+    int num_chans = cnxt->num_chans, samples_generated = 0, discard, i, ch;
+
+    /* discard history that no longer contributes, then append (and possibly pad) the new samples */
+
+    discard = (int) floor (rs->position) - RESAMPLE_TAPS / 2 + 1;
+
+    if (discard > rs->history_samples)
+        discard = rs->history_samples;
+
+    if (discard > 0) {
+        for (ch = 0; ch < num_chans; ++ch) {
+            float *history = rs->history + ch * rs->history_size;
+            memmove (history, history + discard, (rs->history_samples - discard) * sizeof (*history));
+        }
+
+        rs->history_samples -= discard;
+        rs->position -= discard;
+    }
+
+    for (ch = 0; ch < num_chans; ++ch) {
+        float *history = rs->history + ch * rs->history_size + rs->history_samples;
+
+        for (i = 0; i < num_samples; ++i)
+            history [i] = input [i * num_chans + ch];
+
+        if (flushing)
+            memset (history + num_samples, 0, RESAMPLE_TAPS / 2 * sizeof (*history));
+    }
+
+    rs->history_samples += num_samples + (flushing ? RESAMPLE_TAPS / 2 : 0);
+
+    /* generate output samples while the whole filter is covered by the history */
+
+    while ((int) floor (rs->position) + RESAMPLE_TAPS / 2 < rs->history_samples) {
+        int index = (int) floor (rs->position);
+        float phase = (rs->position - index) * RESAMPLE_PHASES;
+        int phase_index = (int) phase;
+        float *coeffs0 = rs->coeffs + phase_index * RESAMPLE_TAPS, *coeffs1 = coeffs0 + RESAMPLE_TAPS;
+
+        phase -= phase_index;
+
+        for (ch = 0; ch < num_chans; ++ch) {
+            float *history = rs->history + ch * rs->history_size + index - RESAMPLE_TAPS / 2 + 1;
+            float sum0 = 0.0, sum1 = 0.0, value;
+
+            for (i = 0; i < RESAMPLE_TAPS; ++i) {
+                sum0 += history [i] * coeffs0 [i];
+                sum1 += history [i] * coeffs1 [i];
+            }
+
+            value = floor (sum0 + (sum1 - sum0) * phase + 0.5);
+
+            if (value > 32767.0)
+                value = 32767.0;
+            else if (value < -32768.0)
+                value = -32768.0;
+
+            *output++ = (int16_t) value;
+        }
+
+        rs->position += rs->step;
+        samples_generated++;
+    }
+
+    if (flushing)
+        reset_resampler (rs);
+
+    return samples_generated;
+}
+
+/*
+ * Period maps allow the same input to be rendered at many ratios without repeating
+ * the pitch detection each time. First the input is passed through stretch_analyze(),
+ * which runs the period search at fixed intervals (one shortest period apart) and
+ * records the results. The map is then exported with stretch_map_save() (usually to
+ * a sidecar file) and later imported into a fresh handle with stretch_map_load().
+ * While a map is loaded, stretch_samples() takes its periods from the map instead of
+ * searching for them, leaving only the copying and merging of the blocks.
+ *
+ * Because the map is only valid for the exact audio it was made from, it records
+ * the length and a checksum (see stretch_map_checksum()) of the analyzed input, and
+ * these must match when it is loaded. Note that with STRETCH_DUAL_FLAG the map only
+ * applies to the first instance; the cascaded instance still searches its input.
+ */
+
+/*
+ * Calculate a Fletcher-32 checksum of the specified samples (interleaved, num_samples
+ * per channel). The checksum of a whole stream is calculated by passing 0 with the
+ * first samples and then the previous return value for each successive call.
+ */
+
+uint32_t stretch_map_checksum (StretchHandle handle, uint32_t checksum, const int16_t *samples, int num_samples)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    uint32_t sum1 = checksum & 0xffff, sum2 = checksum >> 16;
+    int i;
+
+    for (i = 0; i < num_samples * cnxt->num_chans; ++i) {
+        sum1 = (sum1 + (uint16_t) samples [i]) % 65535;
+        sum2 = (sum2 + sum1) % 65535;
+    }
+
+    return (sum2 << 16) | sum1;
+}
+
+/*
+ * Pass the specified samples through the period search and add the results to the
+ * period map being recorded in this handle (a new map is started on the first call
+ * after stretch_init() or stretch_reset()). No audio is generated. Returns FALSE if
+ * memory for the map could not be allocated.
+ */
+
+int stretch_analyze (StretchHandle handle, const int16_t *samples, int num_samples)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct period_map *map = cnxt->map;
+
+    if (cnxt->map_mode != MAP_RECORD) {
+        if (cnxt->map_mode != MAP_SHARED)
+            free_map (map);
+
+        if (!(cnxt->map = map = calloc_aligned (&cnxt->allocator, 1, sizeof (struct period_map)))) {
+            cnxt->map_mode = MAP_NONE;
+            return 0;
+        }
+
+        map->hop = cnxt->shortest / cnxt->num_chans;
+        cnxt->map_mode = MAP_RECORD;
+    }
+
+    map->checksum = stretch_map_checksum (handle, map->checksum, samples, num_samples);
+    map->num_samples += num_samples;
+
+    return analyze_samples (cnxt, map, samples, num_samples);
+}
+
+/*
+ * Buffer the specified samples and run the period search at every hop position that
+ * has the same look-ahead that stretch_samples() requires, appending the results to
+ * the map.
+ */
+
+static int analyze_samples (struct stretch_cnxt *cnxt, struct period_map *map, const int16_t *samples, int num_samples)
+{
+    num_samples *= cnxt->num_chans;
+
+    while (num_samples) {
+        int samples_to_copy = num_samples;
+
+        if (samples_to_copy > cnxt->inbuff_samples - cnxt->head)
+            samples_to_copy = cnxt->inbuff_samples - cnxt->head;
+
+        memcpy (cnxt->inbuff + cnxt->head, samples, samples_to_copy * sizeof (cnxt->inbuff [0]));
+        num_samples -= samples_to_copy;
+        samples += samples_to_copy;
+        cnxt->head += samples_to_copy;
+        update_lanes (cnxt, (cnxt->head - samples_to_copy) / cnxt->num_chans);
+
+        while (cnxt->head - cnxt->tail >= cnxt->longest * (cnxt->fast_mode ? 3 : 2)) {
+            int64_t hop_start = atomic_get (&cnxt->frame_budget) ? clock_ns () : 0;
+            int period = governed_period (cnxt);
+
+            if (map->num_periods == map->max_periods) {
+                int max_periods = map->max_periods ? map->max_periods * 2 : 1024;
+                uint16_t *periods = realloc_aligned (&cnxt->allocator, map->periods, max_periods, sizeof (*periods));
+
+                if (!periods)
+                    return 0;
+
+                map->periods = periods;
+                map->max_periods = max_periods;
+            }
+
+            map->periods [map->num_periods++] = period / cnxt->num_chans;
+            cnxt->tail += map->hop * cnxt->num_chans;
+            left_justify (cnxt);
+            governor_update (cnxt, hop_start, map->hop);
+        }
+    }
+
+    return 1;
+}
+
+static void free_map (struct period_map *map)
+{
+    if (map) {
+        free_aligned (map->periods);
+        free_aligned (map);
+    }
+}
+
+/*
+ * Return the number of bytes required to save the period map recorded with
+ * stretch_analyze(), or zero if there is no map.
+ */
+
+int stretch_map_bytes (StretchHandle handle)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+
+    return cnxt->map ? MAP_HEADER + cnxt->map->num_periods * 2 : 0;
+}
+
+static void store_le32 (unsigned char *dst, uint32_t value)
+{
+    dst [0] = value; dst [1] = value >> 8; dst [2] = value >> 16; dst [3] = value >> 24;
+}
+
+static uint32_t load_le32 (const unsigned char *src)
+{
+    return src [0] | (src [1] << 8) | ((uint32_t) src [2] << 16) | ((uint32_t) src [3] << 24);
+}
+
+/*
+ * Save the period map into the specified buffer, which must have room for the number
+ * of bytes returned from stretch_map_bytes(). The format is portable (little-endian)
+ * and also records the handle parameters, which must match to load it.
+ */
+
+int stretch_map_save (StretchHandle handle, void *buffer)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    unsigned char *dst = (unsigned char *) buffer;
+    struct period_map *map = cnxt->map;
+    int i;
+
+    if (!map)
+        return 0;
+
+    memcpy (dst, MAP_MAGIC, 4);
+    store_le32 (dst + 4, MAP_VERSION);
+    store_le32 (dst + 8, cnxt->num_chans | (cnxt->fast_mode << 8));
+    store_le32 (dst + 12, cnxt->shortest / cnxt->num_chans);
+    store_le32 (dst + 16, cnxt->longest / cnxt->num_chans);
+    store_le32 (dst + 20, map->hop);
+    store_le32 (dst + 24, map->num_samples);
+    store_le32 (dst + 28, map->checksum);
+    store_le32 (dst + 32, map->num_periods);
+    dst += MAP_HEADER;
+
+    for (i = 0; i < map->num_periods; ++i) {
+        *dst++ = map->periods [i];
+        *dst++ = map->periods [i] >> 8;
+    }
+
+    return MAP_HEADER + map->num_periods * 2;
+}
+
+/*
+ * Load a period map previously saved with stretch_map_save() for use by subsequent
+ * calls to stretch_samples(). The length (in samples per channel) and checksum of the
+ * audio about to be processed must be supplied, and if they (or the handle parameters)
+ * do not match what was recorded, the map is rejected and FALSE returned. The handle
+ * is reset so that the map lines up with the start of the audio.
+ */
+
+int stretch_map_load (StretchHandle handle, const void *buffer, int num_bytes, uint32_t num_samples, uint32_t checksum)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    const unsigned char *src = (const unsigned char *) buffer;
+    struct period_map *map;
+    int num_periods, i;
+
+    if (num_bytes < MAP_HEADER || memcmp (src, MAP_MAGIC, 4) || load_le32 (src + 4) != MAP_VERSION ||
+        load_le32 (src + 8) != (uint32_t) (cnxt->num_chans | (cnxt->fast_mode << 8)) ||
+        load_le32 (src + 12) != (uint32_t) (cnxt->shortest / cnxt->num_chans) ||
+        load_le32 (src + 16) != (uint32_t) (cnxt->longest / cnxt->num_chans) ||
+        load_le32 (src + 24) != num_samples || load_le32 (src + 28) != checksum)
+            return 0;
+
+    num_periods = load_le32 (src + 32);
+
+    if (num_periods < 0 || num_periods > (num_bytes - MAP_HEADER) / 2 || !load_le32 (src + 20))
+        return 0;
+
+    if (!(map = calloc_aligned (&cnxt->allocator, 1, sizeof (struct period_map))) ||
+        (num_periods && !(map->periods = calloc_aligned (&cnxt->allocator, num_periods, sizeof (*map->periods))))) {
+            free_aligned (map);
+            return 0;
+    }
+
+    map->hop = load_le32 (src + 20);
+    map->num_samples = num_samples;
+    map->checksum = checksum;
+    map->num_periods = map->max_periods = num_periods;
+    src += MAP_HEADER;
+
+    for (i = 0; i < num_periods; ++i, src += 2) {
+        map->periods [i] = src [0] | (src [1] << 8);
+
+        if (map->periods [i] * cnxt->num_chans < cnxt->shortest || map->periods [i] * cnxt->num_chans > cnxt->longest) {
+            free_map (map);
+            return 0;
+        }
+    }
+
+    if (cnxt->map_mode != MAP_SHARED)
+        free_map (cnxt->map);
+
+    cnxt->map = map;
+    cnxt->map_mode = MAP_PLAYBACK;
+    stretch_reset (cnxt);
+
+    return 1;
+}
+
+/*
+ * The state of a handle can be saved into a blob and loaded into another handle (in
+ * another thread or process) so that a stream can be moved without a reset; the stream
+ * continues bit-exactly. The blob holds only the live part of the input buffer (from
+ * one longest period before the tail up to the head), the ratio error, the controls set
+ * with stretch_set_ratio(), stretch_set_error_policy(), stretch_set_governor() (and the
+ * governor's state), stretch_set_unvoiced() and stretch_set_adaptive() (and the learned
+ * range), any output that stretch_pull() hasn't
+ * returned yet, the queues of stretch_push() and stretch_read(), and the resampler and
+ * gap detection state, and then the same for the cascaded instance. Like period maps
+ * it's portable (little-endian), and it records the handle parameters, which must match
+ * to load it.
+ *
+ * The handle that loads the state must have been configured the same way (flags, periods,
+ * channels, and stretch_set_gap() window). Period maps are not included, so a handle that
+ * plays one back must have the same map loaded first.
+ */
+
+struct state_cursor {
+    unsigned char *dst;             /* NULL to just count bytes */
+    const unsigned char *src;
+    int bytes, num_bytes, failed;   /* offset, and size of the blob being read */
+};
+
+static void put32 (struct state_cursor *sc, uint32_t value)
+{
+    if (sc->dst)
+        store_le32 (sc->dst + sc->bytes, value);
+
+    sc->bytes += 4;
+}
+
+static void put16 (struct state_cursor *sc, int16_t value)
+{
+    if (sc->dst) {
+        sc->dst [sc->bytes] = (uint16_t) value;
+        sc->dst [sc->bytes + 1] = (uint16_t) value >> 8;
+    }
+
+    sc->bytes += 2;
+}
+
+static void put64 (struct state_cursor *sc, int64_t value)
+{
+    put32 (sc, (uint32_t) value);
+    put32 (sc, (uint32_t) ((uint64_t) value >> 32));
+}
+
+static void put_float (struct state_cursor *sc, float value)
+{
+    union { float f; uint32_t u; } bits;
+
+    bits.f = value;
+    put32 (sc, bits.u);
+}
+
+static void put_double (struct state_cursor *sc, double value)
+{
+    union { double d; uint64_t u; } bits;
+
+    bits.d = value;
+    put64 (sc, bits.u);
+}
+
+static uint32_t get32 (struct state_cursor *sc)
+{
+    if (sc->failed || sc->bytes + 4 > sc->num_bytes) {
+        sc->failed = 1;
+        return 0;
+    }
+
+    sc->bytes += 4;
+    return load_le32 (sc->src + sc->bytes - 4);
+}
+
+static int16_t get16 (struct state_cursor *sc)
+{
+    if (sc->failed || sc->bytes + 2 > sc->num_bytes) {
+        sc->failed = 1;
+        return 0;
+    }
+
+    sc->bytes += 2;
+    return (int16_t) (sc->src [sc->bytes - 2] | (sc->src [sc->bytes - 1] << 8));
+}
+
+static int64_t get64 (struct state_cursor *sc)
+{
+    uint64_t value = get32 (sc);
+
+    return (int64_t) (value | (uint64_t) get32 (sc) << 32);
+}
+
+static float get_float (struct state_cursor *sc)
+{
+    union { float f; uint32_t u; } bits;
+
+    bits.u = get32 (sc);
+    return bits.f;
+}
+
+static double get_double (struct state_cursor *sc)
+{
+    union { double d; uint64_t u; } bits;
+
+    bits.u = get64 (sc);
+    return bits.d;
+}
+
+// the parameters that must match between the saved and loading instances
+
+static uint32_t state_config (struct stretch_cnxt *cnxt)
+{
+    return cnxt->num_chans | (cnxt->fast_mode << 8) | (cnxt->next ? 0x200 : 0) | (cnxt->resampler ? 0x400 : 0);
+}
+
+static void save_instance (struct stretch_cnxt *cnxt, struct state_cursor *sc)
+{
+    int start = cnxt->tail - cnxt->longest, i, ch;
+
+    put32 (sc, state_config (cnxt));
+    put32 (sc, cnxt->shortest / cnxt->num_chans);
+    put32 (sc, cnxt->longest / cnxt->num_chans);
+    put32 (sc, cnxt->gap ? cnxt->gap->window : 0);
+
+    put32 (sc, cnxt->head - start);
+    put64 (sc, cnxt->inbuff_pos + start / cnxt->num_chans);
+    put_float (sc, cnxt->outsamples_error);
+    put64 (sc, atomic_get (&cnxt->control));
+    put32 (sc, atomic_get (&cnxt->error_policy));
+    put_float (sc, cnxt->block_ratio);
+    put_float (sc, cnxt->error_ramp);
+    put32 (sc, cnxt->ramp_blocks);
+    put32 (sc, atomic_get (&cnxt->frame_budget));
+    put32 (sc, atomic_get (&cnxt->max_level));
+    put32 (sc, cnxt->search_level);
+    put32 (sc, cnxt->level_blocks);
+    put32 (sc, cnxt->last_period);
+    put_float (sc, cnxt->load);
+    put_float (sc, cnxt->unvoiced_threshold);
+    put32 (sc, atomic_get (&cnxt->unvoiced_blocks));
+    put32 (sc, cnxt->adaptive ? cnxt->adaptive->learn_frames : 0);
+
+    if (cnxt->adaptive) {
+        struct adaptive_range *ar = cnxt->adaptive;
+
+        put32 (sc, ar->learned);
+        put64 (sc, ar->learn_start);
+        put32 (sc, ar->lo);
+        put32 (sc, ar->hi);
+        put32 (sc, ar->blocks);
+        put32 (sc, ar->misses);
+        put32 (sc, ar->edge_blocks);
+        put32 (sc, ar->widenings);
+
+        for (i = 0; i <= cnxt->longest / cnxt->num_chans; ++i)
+            put32 (sc, ar->histogram [i]);
+    }
+
+    for (i = start; i < cnxt->head; ++i)
+        put16 (sc, cnxt->inbuff [i]);
+
+    put32 (sc, cnxt->pending_head - cnxt->pending_tail);
+
+    for (i = cnxt->pending_tail; i < cnxt->pending_head; ++i)
+        put16 (sc, cnxt->pending [i]);
+
+    put32 (sc, cnxt->steps ? cnxt->steps->end_of_input : 0);
+    put32 (sc, cnxt->steps ? cnxt->steps->input_head - cnxt->steps->input_tail : 0);
+    put32 (sc, cnxt->steps ? cnxt->steps->output_head - cnxt->steps->output_tail : 0);
+
+    if (cnxt->steps) {
+        for (i = cnxt->steps->input_tail; i < cnxt->steps->input_head; ++i)
+            put16 (sc, cnxt->steps->input [i]);
+
+        for (i = cnxt->steps->output_tail; i < cnxt->steps->output_head; ++i)
+            put16 (sc, cnxt->steps->output [i]);
+    }
+
+    if (cnxt->resampler) {
+        struct resampler *rs = cnxt->resampler;
+
+        put_double (sc, rs->position);
+        put_float (sc, rs->step);
+        put_float (sc, rs->fixed_step);
+        put_float (sc, rs->filter_step);
+        put32 (sc, rs->history_samples);
+
+        for (ch = 0; ch < rs->num_chans; ++ch)
+            for (i = 0; i < rs->history_samples; ++i)
+                put_float (sc, rs->history [ch * rs->history_size + i]);
+    }
+
+    if (cnxt->gap) {
+        struct gap_detect *gap = cnxt->gap;
+
+        put_float (sc, gap->ratio);
+        put_float (sc, gap->last_ratio);
+        put_double (sc, gap->threshold);
+        put64 (sc, gap->origin);
+        put64 (sc, gap->energy);
+        put32 (sc, gap->frame_samples);
+        put32 (sc, gap->frames_done);
+        put32 (sc, gap->end_of_input);
+        put32 (sc, gap->silence_frames);
+        put32 (sc, gap->used_frames);
+        put32 (sc, gap->total_frames);
+
+        for (i = 0; i < gap->ring_size; i += 2)
+            put16 (sc, gap->silent [i] | (i + 1 < gap->ring_size ? gap->silent [i + 1] << 8 : 0));
+    }
+
+    if (cnxt->next)
+        save_instance (cnxt->next, sc);
+}
+
+/*
+ * Read the state of one instance (and its cascaded instance) from the blob. This is done
+ * twice, first without "apply" to validate everything, so that a bad blob leaves the
+ * handle untouched.
+ */
+
+static int load_instance (struct stretch_cnxt *cnxt, struct state_cursor *sc, int apply)
+{
+    int window, pending, error_policy, ramp_blocks, i, ch;
+    int end_of_input, step_input, step_output;
+    int frame_budget, max_level, search_level, level_blocks, last_period;
+    float outsamples_error, block_ratio, error_ramp, load, unvoiced_threshold;
+    int unvoiced_blocks, learn_frames;
+    int64_t inbuff_pos;
+    uint64_t control;
+
+    if (get32 (sc) != state_config (cnxt) || get32 (sc) != (uint32_t) (cnxt->shortest / cnxt->num_chans) ||
+        get32 (sc) != (uint32_t) (cnxt->longest / cnxt->num_chans) || get32 (sc) != (uint32_t) (cnxt->gap ? cnxt->gap->window : 0))
+            return 0;
+
+    window = get32 (sc);
+    inbuff_pos = get64 (sc);
+    outsamples_error = get_float (sc);
+    control = get64 (sc);
+    error_policy = get32 (sc);
+    block_ratio = get_float (sc);
+    error_ramp = get_float (sc);
+    ramp_blocks = get32 (sc);
+    frame_budget = get32 (sc);
+    max_level = get32 (sc);
+    search_level = get32 (sc);
+    level_blocks = get32 (sc);
+    last_period = get32 (sc);
+    load = get_float (sc);
+    unvoiced_threshold = get_float (sc);
+    unvoiced_blocks = get32 (sc);
+
+    if (window < cnxt->longest || window > cnxt->inbuff_samples || window % cnxt->num_chans ||
+        error_policy < STRETCH_ERROR_CARRY || error_policy > STRETCH_ERROR_RAMP ||
+        ramp_blocks < 0 || ramp_blocks > ERROR_RAMP_BLOCKS || frame_budget < 0 ||
+        max_level < 0 || max_level >= GOVERNOR_LEVELS || search_level < 0 || search_level >= GOVERNOR_LEVELS ||
+        last_period < 0 || last_period > cnxt->longest / cnxt->num_chans || !(unvoiced_threshold >= 0.0) || unvoiced_blocks < 0)
+            return 0;
+
+    if (apply) {
+        cnxt->tail = cnxt->longest;
+        cnxt->head = window;
+        cnxt->inbuff_pos = inbuff_pos;
+        cnxt->outsamples_error = outsamples_error;
+        atomic_put (&cnxt->control, control);
+        atomic_put (&cnxt->error_policy, error_policy);
+        cnxt->block_ratio = block_ratio;
+        cnxt->error_ramp = error_ramp;
+        cnxt->ramp_blocks = ramp_blocks;
+        atomic_put (&cnxt->frame_budget, frame_budget);
+        atomic_put (&cnxt->max_level, max_level);
+        atomic_put (&cnxt->search_level, search_level);
+        cnxt->level_blocks = level_blocks;
+        cnxt->last_period = last_period;
+        cnxt->load = load;
+        cnxt->unvoiced_threshold = unvoiced_threshold;
+        atomic_put (&cnxt->unvoiced_blocks, unvoiced_blocks);
+    }
+
+    /* like the step queues, an adaptive range is allocated while validating */
+
+    learn_frames = get32 (sc);
+
+    if (learn_frames < 0 || (learn_frames && !cnxt->adaptive && !init_adaptive (cnxt)))
+        return 0;
+
+    if (learn_frames) {
+        struct adaptive_range *ar = cnxt->adaptive;
+        int learned = get32 (sc), lo, hi, blocks, misses, edge_blocks, widenings;
+        int64_t learn_start = get64 (sc);
+
+        lo = get32 (sc);
+        hi = get32 (sc);
+        blocks = get32 (sc);
+        misses = get32 (sc);
+        edge_blocks = get32 (sc);
+        widenings = get32 (sc);
+
+        if (learned < 0 || blocks < 0 || misses < 0 || edge_blocks < 0 || widenings < 0 || (lo || hi) != (lo && hi) || (lo &&
+            (lo < cnxt->shortest / cnxt->num_chans || hi > cnxt->longest / cnxt->num_chans || lo >= hi)))
+                return 0;
+
+        if (apply) {
+            ar->learn_frames = learn_frames;
+            ar->learned = learned;
+            ar->learn_start = learn_start;
+            ar->lo = lo;
+            ar->hi = hi;
+            ar->blocks = blocks;
+            ar->misses = misses;
+            ar->edge_blocks = edge_blocks;
+            ar->widenings = widenings;
+            cnxt->search_lo = lo ? lo * cnxt->num_chans : cnxt->shortest;
+            cnxt->search_hi = hi ? hi * cnxt->num_chans : cnxt->longest;
+        }
+
+        for (i = 0; i <= cnxt->longest / cnxt->num_chans; ++i)
+            if (apply)
+                ar->histogram [i] = get32 (sc);
+            else
+                get32 (sc);
+    }
+    else if (apply)
+        free_adaptive (cnxt);
+
+    for (i = 0; i < window; ++i)
+        if (apply)
+            cnxt->inbuff [i] = get16 (sc);
+        else
+            get16 (sc);
+
+    if (apply)
+        update_lanes (cnxt, 0);
+
+    pending = get32 (sc);
+
+    if (pending < 0 || pending % cnxt->num_chans || (pending && !cnxt->pending && !init_pending (cnxt)) || pending > cnxt->pending_size)
+        return 0;
+
+    if (apply) {
+        cnxt->pending_tail = 0;
+        cnxt->pending_head = pending;
+    }
+
+    for (i = 0; i < pending; ++i)
+        if (apply)
+            cnxt->pending [i] = get16 (sc);
+        else
+            get16 (sc);
+
+    /* the step queues are allocated (or grown) while validating, which doesn't change the stream */
+
+    end_of_input = get32 (sc);
+    step_input = get32 (sc);
+    step_output = get32 (sc);
+
+    if (step_input < 0 || step_input % cnxt->num_chans || step_output < 0 || step_output % cnxt->num_chans ||
+        step_input + step_output > (sc->num_bytes - sc->bytes) / 2)
+            return 0;
+
+    if ((end_of_input || step_input || step_output) && !cnxt->steps && !init_steps (cnxt))
+        return 0;
+
+    if (cnxt->steps) {
+        struct step_queue *sq = cnxt->steps;
+
+        if (step_output > sq->output_size)
+            return 0;
+
+        if (apply) {
+            sq->input_tail = sq->input_head = 0;
+            sq->output_tail = sq->output_head = 0;
+        }
+
+        if (!reserve_steps_input (cnxt, step_input))
+            return 0;
+
+        if (apply) {
+            sq->end_of_input = end_of_input;
+            sq->input_head = step_input;
+            sq->output_head = step_output;
+        }
+
+        for (i = 0; i < step_input + step_output; ++i)
+            if (!apply)
+                get16 (sc);
+            else if (i < step_input)
+                sq->input [i] = get16 (sc);
+            else
+                sq->output [i - step_input] = get16 (sc);
+    }
+
+    if (cnxt->resampler) {
+        struct resampler *rs = cnxt->resampler;
+        double position = get_double (sc);
+        float step = get_float (sc), fixed_step = get_float (sc), filter_step = get_float (sc);
+        int history_samples = get32 (sc);
+
+        if (history_samples < 0 || history_samples > rs->history_size || !(filter_step > 0.0))
+            return 0;
+
+        if (apply) {
+            rs->position = position;
+            rs->step = step;
+            rs->fixed_step = fixed_step;
+            rs->history_samples = history_samples;
+            rs->cutoff = 0.0;
+            resampler_filter (rs, filter_step);
+        }
+
+        for (ch = 0; ch < rs->num_chans; ++ch)
+            for (i = 0; i < history_samples; ++i)
+                if (apply)
+                    rs->history [ch * rs->history_size + i] = get_float (sc);
+                else
+                    get_float (sc);
+    }
+
+    if (cnxt->gap) {
+        struct gap_detect *gap = cnxt->gap, loaded;
+
+        loaded.ratio = get_float (sc);
+        loaded.last_ratio = get_float (sc);
+        loaded.threshold = get_double (sc);
+        loaded.origin = get64 (sc);
+        loaded.energy = get64 (sc);
+        loaded.frame_samples = get32 (sc);
+        loaded.frames_done = get32 (sc);
+        loaded.end_of_input = get32 (sc);
+        loaded.silence_frames = get32 (sc);
+        loaded.used_frames = get32 (sc);
+        loaded.total_frames = get32 (sc);
+
+        if (apply) {
+            loaded.window = gap->window;
+            loaded.silent = gap->silent;
+            loaded.ring_size = gap->ring_size;
+            *gap = loaded;
+        }
+
+        for (i = 0; i < gap->ring_size; i += 2) {
+            int pair = (uint16_t) get16 (sc);
+
+            if (apply) {
+                gap->silent [i] = pair & 0xff;
+
+                if (i + 1 < gap->ring_size)
+                    gap->silent [i + 1] = pair >> 8;
+            }
+        }
+    }
+
+    if (sc->failed)
+        return 0;
+
+    return cnxt->next ? load_instance (cnxt->next, sc, apply) : 1;
+}
+
+/* return the number of bytes that stretch_save_state() will currently need */
+
+int stretch_state_size (StretchHandle handle)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct state_cursor sc = { NULL, NULL, STATE_HEADER, 0, 0 };
+
+    save_instance (cnxt, &sc);
+    return sc.bytes;
+}
+
+/*
+ * Save the state of the handle into the specified buffer, which must have room for the
+ * number of bytes returned from stretch_state_size() (with no processing in between).
+ * Returns the number of bytes used, or 0 if the state can't be saved right now; this
+ * happens with STRETCH_THREADED_FLAG while blocks are still on the second stage's ring,
+ * and in that case the caller should try again after the next call (or flush).
+ */
+
+int stretch_save_state (StretchHandle handle, void *buffer)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct state_cursor sc = { (unsigned char *) buffer, NULL, STATE_HEADER, 0, 0 };
+
+    if (pipeline_busy (cnxt))
+        return 0;
+
+    save_instance (cnxt, &sc);
+    memcpy (sc.dst, STATE_MAGIC, 4);
+    store_le32 (sc.dst + 4, STATE_VERSION);
+    store_le32 (sc.dst + 8, sc.bytes);
+
+    return sc.bytes;
+}
+
+/*
+ * Load the state previously saved with stretch_save_state() (possibly from another
+ * handle) into this handle, replacing its stream. Returns FALSE (leaving the handle
+ * unchanged) if the blob is invalid or was saved from a handle configured differently,
+ * or if this handle has blocks on the threaded second stage (see above).
+ */
+
+int stretch_load_state (StretchHandle handle, const void *buffer, int num_bytes)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct state_cursor sc = { NULL, (const unsigned char *) buffer, STATE_HEADER, num_bytes, 0 };
+
+    if (num_bytes < STATE_HEADER || memcmp (sc.src, STATE_MAGIC, 4) || load_le32 (sc.src + 4) != STATE_VERSION ||
+        load_le32 (sc.src + 8) != (uint32_t) num_bytes || pipeline_busy (cnxt) || !load_instance (cnxt, &sc, 0))
+            return 0;
+
+    sc.bytes = STATE_HEADER;
+    return load_instance (cnxt, &sc, 1);
+}
+
+/*
+ * Get the period for the block at the current tail, either from the period map
+ * entry closest to that position, or by searching if there's no (applicable) map.
+ * For a live map we use the entry at or before the position because the entry
+ * after it may not have been analyzed yet.
+ */
+
+static int map_period (struct stretch_cnxt *cnxt)
+{
+    if (cnxt->map_mode >= MAP_PLAYBACK) {
+        struct period_map *map = cnxt->map;
+        int64_t position = cnxt->inbuff_pos + cnxt->tail / cnxt->num_chans, index;
+
+        if (map->live)
+            return live_period (cnxt, map, position);
+
+        index = (position + map->hop / 2) / map->hop;
+
+        if (index < map->num_periods && index >= map->num_periods - map->max_periods)
+            return map->periods [index % map->max_periods] * cnxt->num_chans;
+    }
+
+    return governed_period (cnxt);
+}
+
+/*
+ * Return the period of a live map (see struct stretch_fanout) searched at exactly the
+ * given position, or search for it now and add it to the ring, replacing the oldest.
+ */
+
+static int live_period (struct stretch_cnxt *cnxt, struct period_map *map, int64_t position)
+{
+    int count = map->num_periods < map->max_periods ? map->num_periods : map->max_periods, period, i;
+
+    for (i = 0; i < count; ++i)
+        if (map->positions [i] == position)
+            return map->periods [i] * cnxt->num_chans;
+
+    period = governed_period (cnxt);
+    map->positions [map->num_periods % map->max_periods] = position;
+    map->periods [map->num_periods++ % map->max_periods] = period / cnxt->num_chans;
+    return period;
+}
+
+/*
+ * The governor trades search quality for time when a handle has a processing budget
+ * (see stretch_set_governor()). It measures what each block actually costs and moves
+ * between these search levels to stay within the budget:
+ *
+ *   0  exhaustive   the handle's own search (normal or fast)
+ *   1  decimated    every period, but only every other sample of the analysis lane
+ *   2  coarse       every other period and sample, then every period around the best
+ *   3  coarser      every 4th period and sample, then every period around the best
+ *   4  tracked      every period within 1/8 of the range around the last one found,
+ *                   using every 4th sample
+ *
+ * Levels 1 to 4 search the same analysis lane as level 0 (so in fast mode they are
+ * relative to the fast search). The tracked level falls back to the level 3 search
+ * when there's no previous period (at the start, or after silence) or when the best
+ * period is at the edge of its narrowed range (so it may be outside). The governor also
+ * applies to the searches of stretch_analyze(), but not to periods from a loaded map.
+ */
+
+/*
+ * Set a processing budget for the handle as the fraction of real time that it may take
+ * (e.g., 0.05 for 5%, with "sample_rate" giving the real time of the input), and the
+ * highest (cheapest) search level the governor may use. The time measured is the wall
+ * time of each block (search and merge, but not the cascaded instance, which governs
+ * itself), so a loaded host counts too. With a zero budget the governor is off and the
+ * searches are simply done at "max_level", so zero for both is the default behavior.
+ * The budget is kept in picoseconds per frame and capped at INT_MAX (about 2 ms), which
+ * is only reached with a budget of several times real time at a very low sample rate.
+ * Returns FALSE for invalid parameters.
+ */
+
+int stretch_set_governor (StretchHandle handle, int sample_rate, float budget, int max_level)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    double frame_budget = budget && sample_rate > 0 ? budget * 1e12 / sample_rate : 0.0;
+
+    if (budget < 0.0 || budget > 10.0 || (budget && sample_rate <= 0) || max_level < 0 || max_level >= GOVERNOR_LEVELS) {
+        fprintf (stderr, "stretch_set_governor(): invalid parameters!\n");
+        return 0;
+    }
+
+    for (; cnxt; cnxt = cnxt->next) {
+        atomic_put (&cnxt->max_level, max_level);
+        atomic_put (&cnxt->frame_budget, frame_budget < INT_MAX ? (int) ceil (frame_budget) : INT_MAX);
+    }
+
+    return 1;
+}
+
+/*
+ * Return the search level currently in use (the highest of the cascaded instances), so
+ * that degradation can be monitored. This may be called from any thread.
+ */
+
+int stretch_governor_level (StretchHandle handle)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int level = 0;
+
+    for (; cnxt; cnxt = cnxt->next)
+        if (atomic_get (&cnxt->search_level) > level)
+            level = atomic_get (&cnxt->search_level);
+
+    return level;
+}
+
+/*
+ * Search the analysis lane for the period (in lane units) from "lo" to "hi" with the
+ * best correlation (as in find_period_template()), trying every "period_step" period
+ * and using every "sample_step" sample, and then trying every period around the best.
+ * Ties go to the longer period, as in the exhaustive search. Returns 0 for silence.
+ */
+
+static int search_periods (const int16_t *calcbuff, const uint32_t *sums, int longest, int lo, int hi, int period_step, int sample_step)
+{
+    uint32_t sum, diff, factor, scaler, best_factor = 0;
+    int period, best_period = lo, pass, i;
+
+    if ((sum = sums [longest * 2] - sums [0]))
+        scaler = (MAX_CORR - 1) / sum;
+    else
+        return 0;
+
+    for (pass = 0; pass < 2; ++pass) {
+        for (period = lo; period <= hi; period += period_step) {
+            const int16_t *ref = calcbuff, *comp = calcbuff + period;
+
+            for (diff = i = 0; i < period; i += sample_step)
+                diff += abs32 ((int32_t) ref [i] - comp [i]);
+
+            sum = sums [period * 2] - sums [0];
+            factor = diff ? (sum * scaler) / (diff * sample_step) : MAX_CORR;
+
+            if (factor >= best_factor) {
+                best_factor = factor;
+                best_period = period;
+            }
+        }
+
+        if (period_step == 1)
+            break;
+
+        /* refine around the best (which is tried again, but can only be replaced by a longer one) */
+
+        if (lo < best_period - period_step + 1)
+            lo = best_period - period_step + 1;
+
+        if (hi > best_period + period_step - 1)
+            hi = best_period + period_step - 1;
+
+        period_step = 1;
+    }
+
+    return best_period;
+}
+
+/*
+ * Get the period at the tail with the current search level (see stretch_set_governor()),
+ * or skip the search if the block is aperiodic (see stretch_set_unvoiced()). Only the
+ * periods from search_lo to search_hi are searched (see stretch_set_adaptive()).
+ */
+
+static int governed_period (struct stretch_cnxt *cnxt)
+{
+    int level = atomic_get (&cnxt->frame_budget) ? cnxt->search_level : atomic_get (&cnxt->max_level);
+    int unit = cnxt->num_chans << cnxt->fast_mode, start = cnxt->tail / cnxt->num_chans;
+    int shortest = cnxt->shortest / unit, longest = cnxt->longest / unit, period = 0;
+    int lowest = cnxt->search_lo / unit, highest = cnxt->search_hi / unit;
+    const int16_t *calcbuff;
+    const uint32_t *sums;
+
+    if (cnxt->fast_mode) {
+        calcbuff = cnxt->pair_lanes [start & 1] + (start >> 1);
+        sums = cnxt->pair_sums [start & 1] + (start >> 1);
+    }
+    else {
+        calcbuff = (cnxt->mono_lane ? cnxt->mono_lane : cnxt->inbuff) + start;
+        sums = cnxt->mono_sums + start;
+    }
+
+    if (cnxt->unvoiced_threshold && block_unvoiced (cnxt, calcbuff, shortest, longest)) {
+        atomic_put (&cnxt->unvoiced_blocks, cnxt->unvoiced_blocks + 1);
+        cnxt->last_period = 0;
+        return cnxt->longest;
+    }
+
+    if (!level) {
+        period = cnxt->find_period (cnxt);
+        cnxt->last_period = period / unit;
+    }
+    else {
+        if (level == 4 && cnxt->last_period) {
+            int span = (longest - shortest) / 8 + 1;
+            int lo = cnxt->last_period - span < lowest ? lowest : cnxt->last_period - span;
+            int hi = cnxt->last_period + span > highest ? highest : cnxt->last_period + span;
+
+            period = search_periods (calcbuff, sums, longest, lo, hi, 1, 4);
+
+            if ((period == lo && lo != lowest) || (period == hi && hi != highest))
+                level = 3;
+        }
+
+        if (level == 1)
+            period = search_periods (calcbuff, sums, longest, lowest, highest, 1, 2);
+        else if (level == 2)
+            period = search_periods (calcbuff, sums, longest, lowest, highest, 2, 2);
+        else if (level == 3 || !cnxt->last_period)
+            period = search_periods (calcbuff, sums, longest, lowest, highest, 4, 4);
+
+        cnxt->last_period = period;
+        period = (period ? period : longest) * unit;
+    }
+
+    if (cnxt->adaptive && cnxt->adaptive->learn_frames && period != cnxt->longest)
+        adapt_range (cnxt, level, calcbuff, sums, period);
+
+    return period;
+}
+
+/*
+ * Unvoiced sounds (fricatives, breath) and other noise have no period to find, and the
+ * search just picks one at random at full cost. They can be recognized cheaply by their
+ * zero-crossing rate, which is much higher than that of anything periodic in the period
+ * range (even with its harmonics and formants). When enabled, blocks whose analysis
+ * signal crosses zero more than "threshold" times per shortest period (on average over
+ * the two longest periods searched) skip the search and simply use the longest period,
+ * as is done for silence. This is also done for the searches of stretch_analyze(), but
+ * not for periods from a loaded map. A zero threshold (the default) disables it, and
+ * about 16 keeps all voiced speech (even in fast mode, where the lane is lowpassed).
+ */
+
+int stretch_set_unvoiced (StretchHandle handle, float threshold)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+
+    if (threshold < 0.0) {
+        fprintf (stderr, "stretch_set_unvoiced(): invalid threshold!\n");
+        return 0;
+    }
+
+    for (; cnxt; cnxt = cnxt->next)
+        cnxt->unvoiced_threshold = threshold;
+
+    return 1;
+}
+
+/*
+ * Return the number of blocks (of all the cascaded instances) that skipped the period
+ * search because they were aperiodic, since the handle was created or reset. This may be
+ * called from any thread.
+ */
+
+int stretch_unvoiced_blocks (StretchHandle handle)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    int unvoiced_blocks = 0;
+
+    for (; cnxt; cnxt = cnxt->next)
+        unvoiced_blocks += atomic_get (&cnxt->unvoiced_blocks);
+
+    return unvoiced_blocks;
+}
+
+// return TRUE if the analysis signal of the block crosses zero too often to be periodic
+
+static int block_unvoiced (struct stretch_cnxt *cnxt, const int16_t *calcbuff, int shortest, int longest)
+{
+    int crossings = 0, i;
+
+    for (i = 1; i < longest * 2; ++i)
+        crossings += (calcbuff [i - 1] < 0) != (calcbuff [i] < 0);
+
+    return crossings * shortest > cnxt->unvoiced_threshold * longest * 2;
+}
+
+/*
+ * Most talkers use a small part of the period range (which has to allow for any voice),
+ * but the search costs the same for all of them, growing with the square of the longest
+ * period. When enabled, the periods chosen for the first "learn_seconds" of voiced input
+ * are collected in a histogram, and then the search is narrowed to the range they cover
+ * (leaving out a few outliers, like octave errors) plus a margin, which typically makes it
+ * several times faster for a single speaker. The range is widened again (and relearned)
+ * if the correlation at the chosen periods gets noticeably worse than it was while
+ * learning, or if the chosen periods keep landing at the narrowed limits, as happens when
+ * the talker changes. This applies to the first instance and to the cascaded instance
+ * separately, and is reset (and starts learning again) by stretch_reset(). A zero time
+ * (the default) disables it and restores the full range.
+ */
+
+int stretch_set_adaptive (StretchHandle handle, int sample_rate, float learn_seconds)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct stretch_cnxt *instance;
+
+    if (sample_rate < 1 || !(learn_seconds >= 0.0) || learn_seconds * sample_rate > INT32_MAX) {
+        fprintf (stderr, "stretch_set_adaptive(): invalid learning time!\n");
+        return 0;
+    }
+
+    for (instance = cnxt; instance; instance = instance->next)
+        if (!learn_seconds)
+            free_adaptive (instance);
+        else if (!instance->adaptive && !init_adaptive (instance)) {
+            fprintf (stderr, "stretch_set_adaptive(): out of memory!\n");
+            return 0;
+        }
+
+    for (instance = cnxt; learn_seconds && instance; instance = instance->next) {
+        instance->adaptive->learn_frames = (int) (learn_seconds * sample_rate);
+        instance->adaptive->widenings = 0;
+        restart_adaptive (instance);
+    }
+
+    return 1;
+}
+
+/*
+ * Get the range of periods (per channel) currently searched by the first instance, which
+ * is the full range unless adaptive narrowing is enabled and has narrowed it. Returns the
+ * number of times the range was widened again since adaptive narrowing was enabled (or
+ * the handle was reset).
+ */
+
+int stretch_adaptive_range (StretchHandle handle, int *shortest_period, int *longest_period)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+
+    if (shortest_period)
+        *shortest_period = cnxt->search_lo / cnxt->num_chans;
+
+    if (longest_period)
+        *longest_period = cnxt->search_hi / cnxt->num_chans;
+
+    return cnxt->adaptive ? cnxt->adaptive->widenings : 0;
+}
+
+/*
+ * For offline processing of a single stream with a very long period range (a low lower
+ * frequency limit or a high sample rate), where the period search takes nearly all of
+ * the time, split the search of each block over "num_threads" threads (including the
+ * calling one). The other threads are started here and then wait between blocks, and
+ * each search gives every thread a part of the periods to try (of about equal cost),
+ * after which the parts' results are combined with the same rule as the single search,
+ * so that the periods chosen (and the output) are exactly the same. This only pays off
+ * for long searches, so searches of fewer than SEARCH_MIN_WORK differences (such as
+ * those narrowed by stretch_set_adaptive()) are still done by the calling thread alone,
+ * as are the cheaper searches of the governor. Both instances of a dual stretcher get
+ * their own threads. One (the default) stops the threads. This must not be called while
+ * the handle is processing, and with STRETCH_THREADED_FLAG fails if blocks are still in
+ * flight.
+ */
+
+int stretch_set_search_threads (StretchHandle handle, int num_threads)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) handle;
+    struct stretch_cnxt *instance;
+
+    if (num_threads < 1 || num_threads > SEARCH_MAX_THREADS) {
+        fprintf (stderr, "stretch_set_search_threads(): invalid number of threads!\n");
+        return 0;
+    }
+
+    if (pipeline_busy (cnxt)) {
+        fprintf (stderr, "stretch_set_search_threads(): blocks still in flight!\n");
+        return 0;
+    }
+
+    for (instance = cnxt; instance; instance = instance->next) {
+        if (instance->team)
+            free_team (instance);
+
+        if (num_threads > 1 && !init_team (instance, num_threads)) {
+            fprintf (stderr, "stretch_set_search_threads(): can't start search threads!\n");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int init_adaptive (struct stretch_cnxt *cnxt)
+{
+    struct adaptive_range *ar = calloc_aligned (&cnxt->allocator, 1, sizeof (struct adaptive_range));
+
+    if (!ar || !(ar->histogram = calloc_aligned (&cnxt->allocator, cnxt->longest / cnxt->num_chans + 1, sizeof (*ar->histogram)))) {
+        free_aligned (ar);
+        return 0;
+    }
+
+    cnxt->adaptive = ar;
+    return 1;
+}
+
+static void free_adaptive (struct stretch_cnxt *cnxt)
+{
+    if (cnxt->adaptive) {
+        free_aligned (cnxt->adaptive->histogram);
+        free_aligned (cnxt->adaptive);
+        cnxt->adaptive = NULL;
+    }
+
+    cnxt->search_lo = cnxt->shortest;
+    cnxt->search_hi = cnxt->longest;
+}
+
+// go back to searching the full range and (re)start learning at the tail
+
+static void restart_adaptive (struct stretch_cnxt *cnxt)
+{
+    struct adaptive_range *ar = cnxt->adaptive;
+
+    memset (ar->histogram, 0, (cnxt->longest / cnxt->num_chans + 1) * sizeof (*ar->histogram));
+    ar->learn_start = cnxt->inbuff_pos + cnxt->tail / cnxt->num_chans;
+    ar->learned = ar->lo = ar->hi = ar->blocks = ar->misses = ar->edge_blocks = 0;
+    cnxt->search_lo = cnxt->shortest;
+    cnxt->search_hi = cnxt->longest;
+}
+
+/*
+ * The mismatch of a period (in lane units) is the sum of the absolute differences over the
+ * sum of the absolute values of the two periods compared, which is 0 for a perfect match
+ * and about 0.7 for noise.
+ */
+
+static float period_mismatch (const int16_t *calcbuff, const uint32_t *sums, int period)
+{
+    uint32_t sum = sums [period * 2] - sums [0], diff = 0;
+    int i;
+
+    for (i = 0; i < period; ++i)
+        diff += abs32 ((int32_t) calcbuff [i] - calcbuff [i + period]);
+
+    return sum ? (float) diff / sum : 0.0;
+}
+
+/*
+ * Account for the "period" chosen for the block at the tail (on the analysis lane used by
+ * the search, at search "level"): learn it if it's well matched, or, once the range is
+ * narrowed, check that the narrowed search is still finding periods about as good as the
+ * full search would. This is done by running the full search (or a coarse one if the
+ * governor is degrading the search) on every ADAPTIVE_PROBE blocks, which costs much less
+ * than narrowing saves, and counting it as a miss when it finds a much better period.
+ */
+
+static void adapt_range (struct stretch_cnxt *cnxt, int level, const int16_t *calcbuff, const uint32_t *sums, int period)
+{
+    int unit = cnxt->num_chans << cnxt->fast_mode, shortest = cnxt->shortest / unit, longest = cnxt->longest / unit;
+    struct adaptive_range *ar = cnxt->adaptive;
+    float mismatch = period_mismatch (calcbuff, sums, period / unit);
+
+    if (!ar->lo) {
+        int64_t position = cnxt->inbuff_pos + cnxt->tail / cnxt->num_chans;
+        int fundamental = period / unit, count, lo, hi, k;
+
+        /* the search often picks a multiple of the fundamental (ties go to longer periods), so learn that */
+
+        if (mismatch > 0.0 && mismatch < ADAPTIVE_VOICED) {
+            for (k = 4; k > 1; --k)
+                if (period / unit / k >= shortest && period_mismatch (calcbuff, sums, period / unit / k) < mismatch * ADAPTIVE_DROP) {
+                    fundamental = period / unit / k;
+                    break;
+                }
+
+            ar->histogram [fundamental << cnxt->fast_mode]++;
+            ar->learned++;
+        }
+
+        if (ar->learned < ADAPTIVE_MIN_BLOCKS || position - ar->learn_start < ar->learn_frames)
+            return;
+
+        /* done learning, so find the periods that bound all but the outliers, and add the margin */
+
+        for (count = lo = 0; (count += ar->histogram [lo]) <= ar->learned * ADAPTIVE_PERCENTILE; ++lo);
+        for (count = 0, hi = cnxt->longest / cnxt->num_chans; (count += ar->histogram [hi]) <= ar->learned * ADAPTIVE_PERCENTILE; --hi);
+
+        lo = (int) floor (lo / ADAPTIVE_MARGIN);
+        hi = (int) ceil (hi * ADAPTIVE_MARGIN);
+        ar->lo = lo < cnxt->shortest / cnxt->num_chans ? cnxt->shortest / cnxt->num_chans : lo;
+        ar->hi = hi > cnxt->longest / cnxt->num_chans ? cnxt->longest / cnxt->num_chans : hi;
+        cnxt->search_lo = ar->lo * cnxt->num_chans;
+        cnxt->search_hi = ar->hi * cnxt->num_chans;
+        return;
+    }
+
+    if ((cnxt->search_lo != cnxt->shortest && period / unit <= cnxt->search_lo / unit) ||
+        (cnxt->search_hi != cnxt->longest && (period + unit - 1) / unit >= cnxt->search_hi / unit))
+            ar->edge_blocks++;
+    else
+        ar->edge_blocks = 0;
+
+    if (++ar->blocks % ADAPTIVE_PROBE == 0) {
+        int probe;
+
+        cnxt->search_lo = cnxt->shortest;
+        cnxt->search_hi = cnxt->longest;
+        probe = level ? search_periods (calcbuff, sums, longest, shortest, longest, 4, 4) * unit : cnxt->find_period (cnxt);
+        cnxt->search_lo = ar->lo * cnxt->num_chans;
+        cnxt->search_hi = ar->hi * cnxt->num_chans;
+
+        if (probe && period_mismatch (calcbuff, sums, probe / unit) * ADAPTIVE_DROP < mismatch)
+            ar->misses++;
+        else
+            ar->misses = 0;
+    }
+
+    if (ar->misses >= ADAPTIVE_MISSES || ar->edge_blocks >= ADAPTIVE_EDGE) {
+        ar->widenings++;
+        restart_adaptive (cnxt);
+    }
+}
+
+/*
+ * Account for the time taken by a block (started at "start") that consumed "frames" of
+ * input, and change the search level if the smoothed load warrants it. Without a budget,
+ * the level is simply the maximum level set.
+ */
+
+static void governor_update (struct stretch_cnxt *cnxt, int64_t start, int frames)
+{
+    int frame_budget = atomic_get (&cnxt->frame_budget), max_level = atomic_get (&cnxt->max_level);
+    int level = cnxt->search_level;
+
+    if (!frame_budget) {
+        if (level != max_level)
+            atomic_put (&cnxt->search_level, max_level);
+
+        return;
+    }
+
+    cnxt->load += ((clock_ns () - start) * 1000.0 / ((double) frames * frame_budget) - cnxt->load) / GOVERNOR_SMOOTHING;
+
+    if (level > max_level)
+        level = max_level;
+    else if (++cnxt->level_blocks < GOVERNOR_SETTLE)
+        return;
+    else if (cnxt->load > 1.0 && level < max_level)
+        level++;
+    else if (cnxt->load < GOVERNOR_RELAX && level)
+        level--;
+    else
+        return;
+
+    atomic_put (&cnxt->search_level, level);
+    cnxt->level_blocks = 0;
+}
+
+// monotonic time in nanoseconds
+
+#ifndef __plan9__
+static int64_t clock_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (int64_t) 1000000000 + ts.tv_nsec;
+}
+#else
+static int64_t clock_ns (void)
+{
+    extern long long nsec (void);
+
+    return nsec ();
+}
+#endif
+
+/*
+ * Left-justify the samples in the buffer, leaving one longest period of history before
+ * the tail, and keep track of the stream position of the buffer.
+ */
+
+static void left_justify (struct stretch_cnxt *cnxt)
+{
+    int samples_to_move = cnxt->head - cnxt->tail + cnxt->longest;
+    int shift = (cnxt->tail - cnxt->longest) / cnxt->num_chans, frames = samples_to_move / cnxt->num_chans;
+
+    memmove (cnxt->inbuff, cnxt->inbuff + cnxt->tail - cnxt->longest,
+        samples_to_move * sizeof (cnxt->inbuff [0]));
+
+    /* the analysis lanes move with the samples (the running sums stay valid as differences) */
+
+    if (!shift)
+        ;
+    else if (!cnxt->fast_mode) {
+        if (cnxt->mono_lane)
+            memmove (cnxt->mono_lane, cnxt->mono_lane + shift, frames * sizeof (*cnxt->mono_lane));
+
+        memmove (cnxt->mono_sums, cnxt->mono_sums + shift, (frames + 1) * sizeof (*cnxt->mono_sums));
+    }
+    else {
+        int pairs = frames / 2 + 1, lane;
+
+        /* an odd shift changes the parity of every frame, so the lanes trade places */
+
+        if (shift & 1) {
+            int16_t *pair_lane = cnxt->pair_lanes [0];
+            uint32_t *pair_sums = cnxt->pair_sums [0];
+
+            cnxt->pair_lanes [0] = cnxt->pair_lanes [1];
+            cnxt->pair_lanes [1] = pair_lane;
+            cnxt->pair_sums [0] = cnxt->pair_sums [1];
+            cnxt->pair_sums [1] = pair_sums;
+        }
+
+        for (lane = 0; lane < 2; ++lane) {
+            int offset = (shift + lane) >> 1;
+
+            memmove (cnxt->pair_lanes [lane], cnxt->pair_lanes [lane] + offset, pairs * sizeof (*cnxt->pair_lanes [lane]));
+            memmove (cnxt->pair_sums [lane], cnxt->pair_sums [lane] + offset, (pairs + 1) * sizeof (*cnxt->pair_sums [lane]));
+        }
+    }
+
+    cnxt->inbuff_pos += shift;
+    cnxt->head -= cnxt->tail - cnxt->longest;
+    cnxt->tail = cnxt->longest;
+}
+
+/*
+ * Everything belonging to a handle is allocated here, from the handle's allocator (see
+ * stretch_init_ex()) or else calloc(), and zeroed. Each block is preceded by a header
+ * holding a copy of the allocator and the size, so that it can be freed on its own.
+ * Contexts and the buffers they write for every block are allocated on cache-line
+ * boundaries and padded to whole lines, so that handles running on different threads
+ * never share a line (even when they were all created by one thread, as in a pool).
+ * Defining STRETCH_UNALIGNED packs them as tightly as calloc() for comparison (see
+ * bench.c).
+ */
+
+struct block_header {
+    StretchAllocator allocator;
+    void *block;                        /* as allocated */
+    size_t block_bytes, bytes;          /* allocated, and requested */
+};
+
+#define BLOCK_ALIGNMENT 16
+#define HEADER_SPACE    ((sizeof (struct block_header) + BLOCK_ALIGNMENT - 1) & ~(size_t) (BLOCK_ALIGNMENT - 1))
+
+static void *calloc_aligned (const StretchAllocator *allocator, size_t count, size_t size)
+{
+#ifndef STRETCH_UNALIGNED
+    size_t bytes = (count * size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1), slack = CACHE_LINE - 1;
+#else
+    size_t bytes = count * size, slack = 0;
+#endif
+    size_t block_bytes = HEADER_SPACE + slack + bytes;
+    struct block_header *header;
+    char *block, *ptr;
+
+    if (allocator && allocator->allocate) {
+        if ((block = allocator->allocate (allocator->context, block_bytes, BLOCK_ALIGNMENT)))
+            memset (block, 0, block_bytes);
+    }
+    else
+        block = calloc (block_bytes, 1);
+
+    if (!block)
+        return NULL;
+
+    ptr = (char *) (((uintptr_t) block + HEADER_SPACE + slack) & ~(uintptr_t) slack);
+    header = (struct block_header *) ptr - 1;
+
+    if (allocator)
+        header->allocator = *allocator;
+
+    header->block = block;
+    header->block_bytes = block_bytes;
+    header->bytes = count * size;
+    return ptr;
+}
+
+// resize a block allocated above (or allocate one, if "ptr" is NULL), keeping its contents
+
+static void *realloc_aligned (const StretchAllocator *allocator, void *ptr, size_t count, size_t size)
+{
+    void *new_ptr = calloc_aligned (allocator, count, size);
+
+    if (new_ptr && ptr) {
+        size_t bytes = ((struct block_header *) ptr - 1)->bytes;
+
+        memcpy (new_ptr, ptr, bytes < count * size ? bytes : count * size);
+        free_aligned (ptr);
+    }
+
+    return new_ptr;
+}
+
+static void free_aligned (void *ptr)
+{
+    if (ptr) {
+        struct block_header *header = (struct block_header *) ptr - 1;
+
+        if (header->allocator.deallocate)
+            header->allocator.deallocate (header->allocator.context, header->block, header->block_bytes, BLOCK_ALIGNMENT);
+        else
+            free (header->block);
+    }
+}
+
+/*
+ * The period searches don't look at inbuff directly, but at an analysis signal that
+ * is derived from it as the samples arrive, so that every input frame is downmixed
+ * (and decimated) only once no matter how many searches overlap it. In normal mode
+ * this is the mono downmix (inbuff itself for mono), one value per frame. In fast
+ * mode it's the 2:1 average starting at every frame, which is stored as two lanes
+ * (even and odd starting frames) so that a search at any tail finds its decimated
+ * signal contiguous. Each lane also has a running sum of its absolute values (with
+ * one leading entry), which the searches use for the correlation numerator. These
+ * are 32-bit and wrap, but only differences over two longest periods are ever used.
+ */
+
+static int alloc_lanes (struct stretch_cnxt *cnxt, int inbuff_samples)
+{
+    int frames = inbuff_samples / cnxt->num_chans + 2, lane;
+    int16_t *lanes [2] = { NULL, NULL };
+    uint32_t *sums [2] = { NULL, NULL };
+
+    if (!cnxt->fast_mode) {
+        if (cnxt->num_chans != 1)
+            lanes [0] = calloc_aligned (&cnxt->allocator, frames, sizeof (*lanes [0]));
+
+        sums [0] = calloc_aligned (&cnxt->allocator, frames + 1, sizeof (*sums [0]));
+
+        if ((cnxt->num_chans != 1 && !lanes [0]) || !sums [0]) {
+            free_aligned (lanes [0]);
+            free_aligned (sums [0]);
+            return 0;
+        }
+
+        free_aligned (cnxt->mono_lane);
+        free_aligned (cnxt->mono_sums);
+        cnxt->mono_lane = lanes [0];
+        cnxt->mono_sums = sums [0];
+        return 1;
+    }
+
+    for (lane = 0; lane < 2; ++lane) {
+        lanes [lane] = calloc_aligned (&cnxt->allocator, frames / 2 + 1, sizeof (*lanes [lane]));
+        sums [lane] = calloc_aligned (&cnxt->allocator, frames / 2 + 2, sizeof (*sums [lane]));
+    }
+
+    if (!lanes [0] || !lanes [1] || !sums [0] || !sums [1]) {
+        for (lane = 0; lane < 2; ++lane) {
+            free_aligned (lanes [lane]);
+            free_aligned (sums [lane]);
+        }
+
+        return 0;
+    }
+
+    for (lane = 0; lane < 2; ++lane) {
+        free_aligned (cnxt->pair_lanes [lane]);
+        free_aligned (cnxt->pair_sums [lane]);
+        cnxt->pair_lanes [lane] = lanes [lane];
+        cnxt->pair_sums [lane] = sums [lane];
+    }
+
+    return 1;
+}
+
+/*
+ * Bring the analysis lanes up to date with the head of inbuff, starting at the given
+ * frame (the first one that was just appended, or 0 if the history has been rewritten).
+ */
+
+static void update_lanes (struct stretch_cnxt *cnxt, int first_frame)
+{
+    const int num_chans = cnxt->num_chans, frames = cnxt->head / num_chans;
+    const int16_t *samples = cnxt->inbuff;
+    int frame, i;
+
+    if (!cnxt->fast_mode) {
+        int16_t *lane = cnxt->mono_lane ? cnxt->mono_lane : cnxt->inbuff;
+        uint32_t *sums = cnxt->mono_sums;
+
+        if (num_chans == 2)
+            for (frame = first_frame; frame < frames; ++frame)
+                lane [frame] = ((int32_t) samples [frame * 2] + samples [frame * 2 + 1]) >> 1;
+        else if (num_chans > 2)
+            for (frame = first_frame; frame < frames; ++frame) {
+                int32_t sum = 0;
+
+                for (i = 0; i < num_chans; ++i)
+                    sum += samples [frame * num_chans + i];
+
+                lane [frame] = sum / num_chans;
+            }
+
+        if (!first_frame)
+            sums [0] = 0;
+
+        for (frame = first_frame; frame < frames; ++frame)
+            sums [frame + 1] = sums [frame] + abs32 (lane [frame]);
+
+        return;
+    }
+
+    /* in fast mode the last frame's pair wasn't complete until now */
+
+    if (first_frame)
+        first_frame--;
+    else
+        cnxt->pair_sums [0] [0] = cnxt->pair_sums [1] [0] = 0;
+
+    for (frame = first_frame; frame < frames - 1; ++frame) {
+        int16_t *lane = cnxt->pair_lanes [frame & 1];
+        uint32_t *sums = cnxt->pair_sums [frame & 1];
+        int index = frame >> 1;
+
+        if (num_chans == 1)
+            lane [index] = ((int32_t) samples [frame] + samples [frame + 1]) >> 1;
+        else if (num_chans == 2)
+            lane [index] = ((int32_t) samples [frame * 2] + samples [frame * 2 + 1] + samples [frame * 2 + 2] + samples [frame * 2 + 3]) >> 2;
+        else {
+            int32_t sum = 0;
+
+            for (i = 0; i < num_chans * 2; ++i)
+                sum += samples [frame * num_chans + i];
+
+            lane [index] = sum / (num_chans * 2);
+        }
+
+        sums [index + 1] = sums [index] + abs32 (lane [index]);
+    }
+}
+
+/*
+ * The fan-out renders one input stream at several ratios in a single pass. The outputs
+ * splice at the same positions for as long as they consume the same input per block
+ * (which is two periods at every ratio up to 1.5), so they share their period searches
+ * through a live map: a ring of the most recent periods found, each with the stream
+ * position that was searched. An output whose tail is at a position in the ring takes
+ * that period, and otherwise it searches for itself (exactly as a separate handle would)
+ * and adds the result, so the output is the same as that of separate handles and only
+ * the searches are saved. Input is fed in slices no longer than one longest period so
+ * that the outputs stay close enough together to find each other's periods. As with
+ * loaded maps, the cascaded instances of outputs created with STRETCH_DUAL_FLAG still do
+ * their own searching.
+ */
+
+struct stretch_fanout {
+    struct stretch_cnxt **outputs;
+    struct period_map map;
+    int num_outputs, slice_samples;
+};
+
+/*
+ * Create a fan-out with "num_outputs" output streams, each like a handle created with
+ * stretch_init() using the given parameters.
+ */
+
+StretchFanout stretch_fanout_init (int shortest_period, int longest_period, int num_chans, int flags, int num_outputs)
+{
+    struct stretch_fanout *fanout;
+    int i;
+
+    if (num_outputs < 1 || !(fanout = calloc (1, sizeof (struct stretch_fanout))))
+        return NULL;
+
+    if (!(fanout->outputs = calloc (num_outputs, sizeof (*fanout->outputs)))) {
+        stretch_fanout_deinit (fanout);
+        return NULL;
+    }
+
+    for (i = 0; i < num_outputs; ++i) {
+        if (!(fanout->outputs [i] = stretch_init (shortest_period, longest_period, num_chans, flags))) {
+            stretch_fanout_deinit (fanout);
+            return NULL;
+        }
+
+        fanout->outputs [i]->map = &fanout->map;
+        fanout->outputs [i]->map_mode = MAP_SHARED;
+        fanout->num_outputs++;
+    }
+
+    /* room for the blocks (of at least one shortest period) that every output can have buffered */
+
+    fanout->slice_samples = longest_period;
+    fanout->map.max_periods = (fanout->outputs [0]->inbuff_samples / num_chans + fanout->slice_samples) / shortest_period * num_outputs + 4;
+    fanout->map.periods = calloc (fanout->map.max_periods, sizeof (*fanout->map.periods));
+    fanout->map.positions = calloc (fanout->map.max_periods, sizeof (*fanout->map.positions));
+    fanout->map.live = 1;
+
+    if (!fanout->map.periods || !fanout->map.positions) {
+        stretch_fanout_deinit (fanout);
+        return NULL;
+    }
+
+    return (StretchFanout) fanout;
+}
+
+/*
+ * Determine how many samples (per channel) should be reserved in each output array
+ * for stretch_fanout_samples() and stretch_fanout_flush() (see stretch_output_capacity()).
+ */
+
+int stretch_fanout_output_capacity (StretchFanout handle, int max_num_samples, float max_ratio)
+{
+    struct stretch_fanout *fanout = (struct stretch_fanout *) handle;
+
+    return stretch_output_capacity (fanout->outputs [0], max_num_samples, max_ratio);
+}
+
+/*
+ * Process the specified samples into all the outputs, each with its own ratio. The
+ * number of samples generated for each output is stored in "num_generated" and the
+ * total over all outputs is returned.
+ */
+
+int stretch_fanout_samples (StretchFanout handle, const int16_t *samples, int num_samples,
+    int16_t *const outputs [], const float ratios [], int num_generated [])
+{
+    struct stretch_fanout *fanout = (struct stretch_fanout *) handle;
+    int num_chans = fanout->outputs [0]->num_chans, total_generated = 0, i;
+
+    for (i = 0; i < fanout->num_outputs; ++i)
+        num_generated [i] = 0;
+
+    while (num_samples) {
+        int samples_to_slice = num_samples < fanout->slice_samples ? num_samples : fanout->slice_samples;
+
+        for (i = 0; i < fanout->num_outputs; ++i) {
+            int samples_generated = stretch_samples (fanout->outputs [i], samples, samples_to_slice,
+                outputs [i] + num_generated [i] * num_chans, ratios [i]);
+
+            num_generated [i] += samples_generated;
+            total_generated += samples_generated;
+        }
+
+        samples += samples_to_slice * num_chans;
+        num_samples -= samples_to_slice;
+    }
+
+    return total_generated;
+}
+
+/*
+ * Flush any leftover samples from all the outputs (see stretch_flush()). Call this
+ * until it returns zero to completely flush cascaded instances.
+ */
+
+int stretch_fanout_flush (StretchFanout handle, int16_t *const outputs [], int num_flushed [])
+{
+    struct stretch_fanout *fanout = (struct stretch_fanout *) handle;
+    int total_flushed = 0, i;
+
+    for (i = 0; i < fanout->num_outputs; ++i)
+        total_flushed += num_flushed [i] = stretch_flush (fanout->outputs [i], outputs [i]);
+
+    return total_flushed;
+}
+
+/*
+ * Re-initialize all the outputs of a fan-out for a new stream (see stretch_reset()),
+ * and forget the periods found in the last one.
+ */
+
+void stretch_fanout_reset (StretchFanout handle)
+{
+    struct stretch_fanout *fanout = (struct stretch_fanout *) handle;
+    int i;
+
+    for (i = 0; i < fanout->num_outputs; ++i)
+        stretch_reset (fanout->outputs [i]);
+
+    fanout->map.num_periods = 0;
+}
+
+/* free fan-out and all its instances */
+
+void stretch_fanout_deinit (StretchFanout handle)
+{
+    struct stretch_fanout *fanout = (struct stretch_fanout *) handle;
+    int i;
+
+    for (i = 0; i < fanout->num_outputs; ++i)
+        stretch_deinit (fanout->outputs [i]);
+
+    free (fanout->map.periods);
+    free (fanout->map.positions);
+    free (fanout->outputs);
+    free (fanout);
+}
+
+#ifndef __plan9__
+
+/*
+ * With STRETCH_THREADED_FLAG, the cascaded ("next") instance of a dual stretcher runs
+ * on its own thread so that the period searches of the two stages can run on different
+ * cores. The first stage stretches each block directly into a slot of a small ring and
+ * hands it over, and the worker thread passes the slots to the second stage in order
+ * and leaves the results in the same slot. Because the second stage sees exactly the
+ * same sequence of calls as in the synchronous cascade, the output is identical, but
+ * it's returned up to PIPELINE_SLOTS blocks later (which stretch_output_capacity()
+ * includes). Anything else that touches the second stage (the 1:1 passthrough, flush,
+ * and reset) first waits for the ring to empty, at which point the worker is idle.
+ */
+
+#define PIPELINE_SLOTS  4
+
+struct pipeline_slot {
+    int16_t *input, *output;
+    int input_samples, output_samples;      /* per channel */
+    float ratio;
+};
+
+struct pipeline {
+    struct pipeline_slot slots [PIPELINE_SLOTS];
+    int head, in_flight, slot_capacity, quit;
+    sem_t filled, done;
+    pthread_t thread;
+};
+
+static void semaphore_wait (sem_t *sem)
+{
+    while (sem_wait (sem) && errno == EINTR);
+}
+
+static void *pipeline_worker (void *arg)
+{
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) arg;
+    struct pipeline *pipeline = cnxt->pipeline;
+    int index = 0;
+
+    while (1) {
+        struct pipeline_slot *slot = pipeline->slots + index;
+
+        semaphore_wait (&pipeline->filled);
+
+        if (pipeline->quit)
+            break;
+
+        slot->output_samples = stretch_samples (cnxt->next, slot->input, slot->input_samples, slot->output, slot->ratio);
+        sem_post (&pipeline->done);
+        index = (index + 1) % PIPELINE_SLOTS;
+    }
+
+    return NULL;
+}
+
+static int init_pipeline (struct stretch_cnxt *cnxt)
+{
+    int block_samples = cnxt->longest / cnxt->num_chans * (cnxt->fast_mode ? 4 : 3), i;
+    struct pipeline *pipeline = calloc_aligned (&cnxt->allocator, 1, sizeof (struct pipeline));
+
+    if (!pipeline)
+        return 0;
+
+    pipeline->slot_capacity = stretch_output_capacity (cnxt->next, block_samples, 2.0);
+
+    for (i = 0; i < PIPELINE_SLOTS; ++i) {
+        pipeline->slots [i].input = calloc_aligned (&cnxt->allocator, block_samples * cnxt->num_chans, sizeof (int16_t));
+        pipeline->slots [i].output = calloc_aligned (&cnxt->allocator, pipeline->slot_capacity * cnxt->num_chans, sizeof (int16_t));
+
+        if (!pipeline->slots [i].input || !pipeline->slots [i].output)
+            break;
+    }
+
+    if (i < PIPELINE_SLOTS || sem_init (&pipeline->filled, 0, 0)) {
+        for (i = 0; i < PIPELINE_SLOTS; ++i) {
+            free_aligned (pipeline->slots [i].input);
+            free_aligned (pipeline->slots [i].output);
+        }
+
+        free_aligned (pipeline);
+        return 0;
+    }
+
+    sem_init (&pipeline->done, 0, 0);
+    cnxt->pipeline = pipeline;
+
+    if (pthread_create (&pipeline->thread, NULL, pipeline_worker, cnxt)) {
+        cnxt->pipeline = NULL;
+        sem_destroy (&pipeline->filled);
+        sem_destroy (&pipeline->done);
+
+        for (i = 0; i < PIPELINE_SLOTS; ++i) {
+            free_aligned (pipeline->slots [i].input);
+            free_aligned (pipeline->slots [i].output);
+        }
+
+        free_aligned (pipeline);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void free_pipeline (struct stretch_cnxt *cnxt)
+{
+    struct pipeline *pipeline = cnxt->pipeline;
+    int i;
+
+    pipeline_collect (cnxt, NULL, -1);
+    pipeline->quit = 1;
+    sem_post (&pipeline->filled);
+    pthread_join (pipeline->thread, NULL);
+    sem_destroy (&pipeline->filled);
+    sem_destroy (&pipeline->done);
+
+    for (i = 0; i < PIPELINE_SLOTS; ++i) {
+        free_aligned (pipeline->slots [i].input);
+        free_aligned (pipeline->slots [i].output);
+    }
+
+    free_aligned (pipeline);
+    cnxt->pipeline = NULL;
+}
+
+// Most samples (per channel) that can be returned from blocks already in flight.
+
+static int pipeline_capacity (struct stretch_cnxt *cnxt)
+{
+    return cnxt->pipeline->slot_capacity * PIPELINE_SLOTS;
+}
+
+/*
+ * Collect the finished blocks in order into "output" (if not NULL), waiting for at least
+ * "num_to_wait" of them (-1 for all in flight). Returns the samples (per channel) stored.
+ */
+
+static int pipeline_collect (struct stretch_cnxt *cnxt, int16_t *output, int num_to_wait)
+{
+    struct pipeline *pipeline = cnxt->pipeline;
+    int samples_collected = 0;
+
+    if (num_to_wait < 0)
+        num_to_wait = pipeline->in_flight;
+
+    while (pipeline->in_flight) {
+        struct pipeline_slot *slot = pipeline->slots + (pipeline->head + PIPELINE_SLOTS - pipeline->in_flight) % PIPELINE_SLOTS;
+
+        if (num_to_wait > 0) {
+            semaphore_wait (&pipeline->done);
+            num_to_wait--;
+        }
+        else if (sem_trywait (&pipeline->done))
+            break;
+
+        if (output) {
+            memcpy (output + samples_collected * cnxt->num_chans, slot->output,
+                slot->output_samples * cnxt->num_chans * sizeof (*output));
+
+            samples_collected += slot->output_samples;
+        }
+
+        pipeline->in_flight--;
+    }
+
+    return samples_collected;
+}
+
+static int pipeline_drain (struct stretch_cnxt *cnxt, int16_t *output)
+{
+    return pipeline_collect (cnxt, output, -1);
+}
+
+// TRUE if there are blocks on the ring whose output hasn't been returned yet (see stretch_save_state())
+
+static int pipeline_busy (struct stretch_cnxt *cnxt)
+{
+    return cnxt->pipeline && cnxt->pipeline->in_flight;
+}
+
+// Get the buffer for the next block, first collecting the oldest block if the ring is full.
+
+static int pipeline_slot (struct stretch_cnxt *cnxt, int16_t *output, int16_t **buffer)
+{
+    struct pipeline *pipeline = cnxt->pipeline;
+    int samples_collected = 0;
+
+    if (pipeline->in_flight == PIPELINE_SLOTS)
+        samples_collected = pipeline_collect (cnxt, output, 1);
+
+    *buffer = pipeline->slots [pipeline->head].input;
+    return samples_collected;
+}
+
+static void pipeline_submit (struct stretch_cnxt *cnxt, int num_samples, float ratio)
+{
+    struct pipeline *pipeline = cnxt->pipeline;
+    struct pipeline_slot *slot = pipeline->slots + pipeline->head;
+
+    slot->input_samples = num_samples;
+    slot->ratio = ratio;
+    pipeline->head = (pipeline->head + 1) % PIPELINE_SLOTS;
+    pipeline->in_flight++;
+    sem_post (&pipeline->filled);
+}
+
+/*
+ * The threads of stretch_set_search_threads(). Every instance has its own team, and the
+ * thread calling the period search scans the first part of each split search itself while
+ * the rest of the team (waiting on their semaphores) scan the other parts. Each part is a
+ * separate allocation, so that the results of the threads are on their own cache lines,
+ * and they're only read once the "done" semaphore has been posted for all of them.
+ */
+
+struct search_part {
+    struct search_team *team;
+    int first, last, best_period;           /* periods to try, and the best of them */
+    uint32_t best_factor;
+    sem_t start;
+    pthread_t thread;
+};
+
+struct search_team {
+    const int16_t *calcbuff;                /* the search in progress */
+    const uint32_t *sums;
+    uint32_t scaler, *results;
+    int num_threads, quit;
+    sem_t done;
+    struct search_part *parts [SEARCH_MAX_THREADS];     /* [0] is the calling thread's */
+};
+
+static void *search_worker (void *arg)
+{
+    struct search_part *part = (struct search_part *) arg;
+    struct search_team *team = part->team;
+
+    while (1) {
+        semaphore_wait (&part->start);
+
+        if (team->quit)
+            break;
+
+        part->best_period = scan_periods (team->calcbuff, team->sums, team->scaler,
+            part->first, part->last, team->results, &part->best_factor);
+
+        sem_post (&team->done);
+    }
+
+    return NULL;
+}
+
+static int init_team (struct stretch_cnxt *cnxt, int num_threads)
+{
+    struct search_team *team = calloc_aligned (&cnxt->allocator, 1, sizeof (struct search_team));
+
+    if (!team || sem_init (&team->done, 0, 0)) {
+        free_aligned (team);
+        return 0;
+    }
+
+    cnxt->team = team;
+
+    while (team->num_threads < num_threads) {
+        struct search_part *part = calloc_aligned (&cnxt->allocator, 1, sizeof (struct search_part));
+
+        if (!part)
+            break;
+
+        part->team = team;
+
+        if (team->num_threads) {
+            if (sem_init (&part->start, 0, 0)) {
+                free_aligned (part);
+                break;
+            }
+
+            if (pthread_create (&part->thread, NULL, search_worker, part)) {
+                sem_destroy (&part->start);
+                free_aligned (part);
+                break;
+            }
+        }
+
+        team->parts [team->num_threads++] = part;
+    }
+
+    if (team->num_threads < num_threads) {
+        free_team (cnxt);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void free_team (struct stretch_cnxt *cnxt)
+{
+    struct search_team *team = cnxt->team;
+    int i;
+
+    team->quit = 1;
+
+    for (i = 1; i < team->num_threads; ++i) {
+        sem_post (&team->parts [i]->start);
+        pthread_join (team->parts [i]->thread, NULL);
+        sem_destroy (&team->parts [i]->start);
+    }
+
+    for (i = 0; i < team->num_threads; ++i)
+        free_aligned (team->parts [i]);
 
-        sum += abs32 (cnxt->calcbuff [period * 2]) + abs32 (cnxt->calcbuff [period * 2 + 1]);
-        period++;
+    sem_destroy (&team->done);
+    free_aligned (team);
+    cnxt->team = NULL;
+}
+
+/*
+ * Search the periods from "first" to "last" (see scan_periods_template()) with the team.
+ * The cost of a period grows with its length, so the parts are split at the periods that
+ * divide the sum of the squares evenly, and the results of the parts are then combined in
+ * order with the single scan's rule (the best correlation, and the longest period of any
+ * that tie) so that the period returned is the same.
+ */
+
+static int team_search (struct search_team *team, const int16_t *calcbuff, const uint32_t *sums, uint32_t scaler,
+    int first, int last, uint32_t *results)
+{
+    double base = (double) first * first, squares = (double) (last + 1) * (last + 1) - base;
+    struct search_part *part;
+    uint32_t best_factor = 0;
+    int best_period = first, i;
+
+    team->calcbuff = calcbuff;
+    team->sums = sums;
+    team->scaler = scaler;
+    team->results = results;
+
+    for (i = 0; i < team->num_threads; ++i) {
+        part = team->parts [i];
+        part->first = i ? team->parts [i - 1]->last + 1 : first;
+
+        if (i < team->num_threads - 1)
+            part->last = (int) sqrt (base + squares * (i + 1) / team->num_threads) - 1;
+        else
+            part->last = last;
+
+        if (part->last < part->first)
+            part->last = part->first;
+
+        if (i)
+            sem_post (&part->start);
+    }
+
+    part = team->parts [0];
+    part->best_period = scan_periods (calcbuff, sums, scaler, part->first, part->last, results, &part->best_factor);
+
+    for (i = 1; i < team->num_threads; ++i)
+        semaphore_wait (&team->done);
+
+    for (i = 0; i < team->num_threads; ++i) {
+        part = team->parts [i];
+
+        if (part->first <= part->last && part->best_factor >= best_factor) {
+            best_factor = part->best_factor;
+            best_period = part->best_period;
+        }
+    }
+
+    return best_period;
+}
+
+#endif
+
+/*
+ * Handle pools are for applications that create and destroy many short-lived
+ * stretch sessions with identical parameters. All handles are allocated up front
+ * with stretch_init() and then handed out and taken back without touching the
+ * heap. A released handle is only marked dirty, and is reset (with every setting
+ * its last user made dropped) when it's next acquired. The settings that allocate
+ * (gap detection, an adaptive range, search threads and a loaded period map) are
+ * freed then, so only the handles that used them touch the heap again.
+ *
+ * To avoid contention on the pool lock, each thread keeps a small private cache
+ * of free handles that is refilled from (or spilled back to) the shared free list
+ * in batches. A thread's cache is returned to the shared list when it exits, and
+ * when the shared list runs out, the caches of all the threads are emptied into it
+ * before giving up, so that handles released by one thread (as in a producer and
+ * consumer pair) can always be acquired by another. Each cache has its own lock
+ * for that, which is only contended while the cache is being emptied, and which
+ * is always taken after the pool lock.
+ */
+
+#define POOL_CACHE_HANDLES  16      /* handles held in each thread's private cache */
+
+struct pool_cache {
+    struct pool_cache *next;
+    struct stretch_pool *pool;
+    int num_handles;
+    struct stretch_cnxt *handles [POOL_CACHE_HANDLES];
+#ifndef __plan9__
+    pthread_mutex_t lock;
+#endif
+};
+
+struct stretch_pool {
+    struct stretch_cnxt *free_list, **handles;
+    struct pool_cache *caches;
+    int num_handles;
+#ifndef __plan9__
+    pthread_mutex_t lock;
+    pthread_key_t cache_key;
+#endif
+};
+
+#ifndef __plan9__
+#define pool_lock(pool)     pthread_mutex_lock (&(pool)->lock)
+#define pool_unlock(pool)   pthread_mutex_unlock (&(pool)->lock)
+#define cache_lock(cache)   pthread_mutex_lock (&(cache)->lock)
+#define cache_unlock(cache) pthread_mutex_unlock (&(cache)->lock)
+#else
+#define pool_lock(pool)
+#define pool_unlock(pool)
+#define cache_lock(cache)
+#define cache_unlock(cache)
+#endif
+
+/* move up to "count" handles from the thread cache back to the shared free list (both locks held) */
+
+static void pool_spill (struct pool_cache *cache, int count)
+{
+    while (count-- && cache->num_handles) {
+        struct stretch_cnxt *cnxt = cache->handles [--cache->num_handles];
+
+        cnxt->pool_link = cache->pool->free_list;
+        cache->pool->free_list = cnxt;
+    }
+}
+
+/* empty the caches of all the threads into the shared free list (pool lock held) */
+
+static void pool_reclaim (struct stretch_pool *pool)
+{
+    struct pool_cache *cache;
+
+    for (cache = pool->caches; cache; cache = cache->next) {
+        cache_lock (cache);
+        pool_spill (cache, cache->num_handles);
+        cache_unlock (cache);
+    }
+}
+
+#ifndef __plan9__
+
+/* called on thread exit with that thread's cache for this pool */
+
+static void pool_cache_release (void *data)
+{
+    struct pool_cache *cache = (struct pool_cache *) data, **cp;
+    struct stretch_pool *pool = cache->pool;
+
+    pool_lock (pool);
+    cache_lock (cache);
+    pool_spill (cache, cache->num_handles);
+    cache_unlock (cache);
+
+    for (cp = &pool->caches; *cp; cp = &(*cp)->next)
+        if (*cp == cache) {
+            *cp = cache->next;
+            break;
+        }
+
+    pool_unlock (pool);
+    pthread_mutex_destroy (&cache->lock);
+    free (cache);
+}
+
+static struct pool_cache *pool_get_cache (struct stretch_pool *pool)
+{
+    struct pool_cache *cache = pthread_getspecific (pool->cache_key);
+
+    if (!cache && (cache = calloc (1, sizeof (struct pool_cache)))) {
+        cache->pool = pool;
+
+        if (pthread_mutex_init (&cache->lock, NULL)) {
+            free (cache);
+            return NULL;
+        }
+
+        if (pthread_setspecific (pool->cache_key, cache)) {
+            pthread_mutex_destroy (&cache->lock);
+            free (cache);
+            return NULL;
+        }
+
+        pool_lock (pool);
+        cache->next = pool->caches;
+        pool->caches = cache;
+        pool_unlock (pool);
+    }
+
+    return cache;
+}
+
+#else
+#define pool_get_cache(pool)    NULL
+#endif
+
+/*
+ * Create a pool of "num_handles" stretch handles, all initialized with the given
+ * parameters (see stretch_init()). Returns NULL if any handle could not be created.
+ */
+
+StretchPool stretch_pool_init (int shortest_period, int longest_period, int num_chans, int flags, int num_handles)
+{
+    struct stretch_pool *pool;
+    int i;
+
+    if (num_handles < 1 || !(pool = calloc (1, sizeof (struct stretch_pool))))
+        return NULL;
+
+    if (!(pool->handles = calloc (num_handles, sizeof (*pool->handles)))) {
+        free (pool);
+        return NULL;
+    }
+
+#ifndef __plan9__
+    if (pthread_key_create (&pool->cache_key, pool_cache_release)) {
+        free (pool->handles);
+        free (pool);
+        return NULL;
+    }
+
+    pthread_mutex_init (&pool->lock, NULL);
+#endif
+
+    for (i = 0; i < num_handles; ++i) {
+        if (!(pool->handles [i] = stretch_init (shortest_period, longest_period, num_chans, flags))) {
+            stretch_pool_deinit (pool);
+            return NULL;
+        }
+
+        pool->handles [i]->pool_link = pool->free_list;
+        pool->free_list = pool->handles [i];
+        pool->num_handles++;
+    }
+
+    return (StretchPool) pool;
+}
+
+/*
+ * Get a ready-to-use handle from the pool, in the same state as if freshly created
+ * with stretch_init(). Returns NULL if all handles in the pool are in use (including
+ * by other threads). This is safe to call from multiple threads.
+ */
+
+StretchHandle stretch_pool_acquire (StretchPool handle)
+{
+    struct stretch_pool *pool = (struct stretch_pool *) handle;
+    struct pool_cache *cache = pool_get_cache (pool);
+    struct stretch_cnxt *cnxt = NULL;
+
+    if (cache) {
+        cache_lock (cache);
+
+        if (cache->num_handles)
+            cnxt = cache->handles [--cache->num_handles];
+
+        cache_unlock (cache);
+    }
+
+    if (!cnxt) {
+        pool_lock (pool);
+
+        /* handles released on other threads may be sitting in their caches */
+
+        if (!pool->free_list)
+            pool_reclaim (pool);
+
+        if ((cnxt = pool->free_list)) {
+            pool->free_list = cnxt->pool_link;
+
+            /* refill half the thread cache while we hold the lock */
+
+            if (cache) {
+                cache_lock (cache);
+
+                while (pool->free_list && cache->num_handles < POOL_CACHE_HANDLES / 2) {
+                    cache->handles [cache->num_handles++] = pool->free_list;
+                    pool->free_list = pool->free_list->pool_link;
+                }
+
+                cache_unlock (cache);
+            }
+        }
+
+        pool_unlock (pool);
+    }
+
+    if (cnxt && cnxt->pool_dirty) {
+        if (!restore_defaults (cnxt)) {
+            fprintf (stderr, "stretch_pool_acquire(): out of memory!\n");
+            stretch_pool_release (pool, cnxt);
+            return NULL;
+        }
+
+        cnxt->pool_dirty = 0;
+    }
+
+    return (StretchHandle) cnxt;
+}
+
+/*
+ * Put a pool handle back in the state that stretch_init() left it in. Unlike stretch_reset(),
+ * which only drops the stream, this also drops every setting made since stretch_init() (see
+ * stretch_reset() for the list), freeing the gap detection, adaptive range, search threads
+ * and loaded map, and giving the resampler the pitch ratio and filter of a new one. Returns
+ * FALSE for out of memory (which only shrinking the input buffer back from gap mode can hit).
+ */
+
+static int restore_defaults (struct stretch_cnxt *cnxt)
+{
+    struct stretch_cnxt *instance;
+
+    if (cnxt->gap && !stretch_set_gap (cnxt, 0.0, 0.0, 0))
+        return 0;
+
+    if (cnxt->map_mode != MAP_SHARED)
+        free_map (cnxt->map);
+
+    cnxt->map = NULL;
+    cnxt->map_mode = MAP_NONE;
+
+    if (cnxt->resampler) {
+        cnxt->resampler->fixed_step = 0.0;
+        cnxt->resampler->step = 1.0;
+        resampler_filter (cnxt->resampler, 1.0);
+    }
+
+    for (instance = cnxt; instance; instance = instance->next) {
+        atomic_put (&instance->control, 0);
+        atomic_put (&instance->error_policy, STRETCH_ERROR_CARRY);
+        atomic_put (&instance->frame_budget, 0);
+        atomic_put (&instance->max_level, 0);
+        instance->block_hook = NULL;
+        instance->hook_context = NULL;
+        instance->unvoiced_threshold = 0.0;
+        free_adaptive (instance);
+
+        if (instance->team)
+            free_team (instance);
+    }
+
+    stretch_reset (cnxt);
+    return 1;
+}
+
+/*
+ * Return a handle obtained with stretch_pool_acquire() to the pool. Any buffered
+ * audio is discarded. The handle may be released from a different thread than
+ * the one that acquired it.
+ */
+
+void stretch_pool_release (StretchPool handle, StretchHandle stretcher)
+{
+    struct stretch_pool *pool = (struct stretch_pool *) handle;
+    struct stretch_cnxt *cnxt = (struct stretch_cnxt *) stretcher;
+    struct pool_cache *cache = pool_get_cache (pool);
+
+    cnxt->pool_dirty = 1;
+
+    if (cache) {
+        int cache_full;
+
+        cache_lock (cache);
+
+        if (!(cache_full = cache->num_handles == POOL_CACHE_HANDLES))
+            cache->handles [cache->num_handles++] = cnxt;
+
+        cache_unlock (cache);
+
+        /* the pool lock comes first, so the cache is locked again to spill half of it */
+
+        if (cache_full) {
+            pool_lock (pool);
+            cache_lock (cache);
+            pool_spill (cache, POOL_CACHE_HANDLES / 2);
+            cache->handles [cache->num_handles++] = cnxt;
+            cache_unlock (cache);
+            pool_unlock (pool);
+        }
+    }
+    else {
+        pool_lock (pool);
+        cnxt->pool_link = pool->free_list;
+        pool->free_list = cnxt;
+        pool_unlock (pool);
+    }
+}
+
+/*
+ * Free the pool and all of its handles. No handles may be in use and no other
+ * thread may be using the pool when this is called.
+ */
+
+void stretch_pool_deinit (StretchPool handle)
+{
+    struct stretch_pool *pool = (struct stretch_pool *) handle;
+    int i;
+
+#ifndef __plan9__
+    while (pool->caches) {
+        struct pool_cache *cache = pool->caches;
+
+        pool->caches = cache->next;
+        pthread_mutex_destroy (&cache->lock);
+        free (cache);
+    }
+
+    pthread_key_delete (pool->cache_key);
+    pthread_mutex_destroy (&pool->lock);
+#endif
+
+    for (i = 0; i < pool->num_handles; ++i)
+        stretch_deinit (pool->handles [i]);
+
+    free (pool->handles);
+    free (pool);
+}
+
+/*
+ * The period searches below are the innermost loops of the stretcher, so they're
+ * written once as inline "templates" taking the channel count as a parameter, and
+ * then instantiated for mono and stereo with a constant there (plus a version for
+ * any other count). With the channel count known, the compiler can use constant
+ * strides and vectorize the loops, and stretch_init() selects the right variant
+ * for the handle from the period_kernels table.
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_TEMPLATE static inline __attribute__((always_inline))
+#else
+#define KERNEL_TEMPLATE static
+#endif
+
+// differences summed by a search of the periods from "first" to "last"
+
+static inline int search_work (int first, int last)
+{
+    return (first + last) * (last - first + 1) / 2;
+}
+
+/*
+ * The pitch detection is done by finding the period that produces the
+ * maximum value for the following correlation formula applied to two
+ * consecutive blocks of the given period length:
+ *
+ *         sum of the absolute values of each sample in both blocks
+ *   ---------------------------------------------------------------------
+ *   sum of the absolute differences of each corresponding pair of samples
+ *
+ * This formula was chosen for two reasons.  First, it produces output values
+ * that can directly compared regardless of the pitch period.  Second, the
+ * numerator is just a difference of the running sums kept with the analysis
+ * lanes (see update_lanes()), and only the denominator need be calculated.
+ */
+
+/*
+ * Try every period from "first" to "last" on the analysis lane and return the one with
+ * the best correlation (the longest of any that tie), storing that correlation in
+ * "best_factor" and, if "results" isn't NULL, every correlation in results [period].
+ * Both searches below scan their whole range with this, and the search threads (see
+ * stretch_set_search_threads()) each scan a part of it.
+ */
+
+KERNEL_TEMPLATE int scan_periods_template (const int16_t *calcbuff, const uint32_t *sums, uint32_t scaler,
+    int first, int last, uint32_t *results, uint32_t *best_factor)
+{
+    uint32_t sum, diff, factor, best = 0;
+    int period, best_period = first;
+    int i;
+
+    /* this loop actually cycles through all period lengths (that are searched) */
+
+    for (period = first; period <= last; ++period) {
+        const int16_t *ref = calcbuff, *comp = calcbuff + period;
+
+        /* compute sum of absolute differences */
+
+        for (diff = i = 0; i < period; ++i)
+            diff += abs32 ((int32_t) ref [i] - comp [i]);
+
+        /*
+         * Here we calculate and store the resulting correlation
+         * factor.  Note that we must watch for a difference of
+         * zero, meaning a perfect match.  Also, for increased
+         * precision using integer math, we scale the sum.
+         */
+
+        sum = sums [period * 2] - sums [0];
+        factor = diff ? (sum * scaler) / diff : MAX_CORR;
+
+        if (results)
+            results [period] = factor;
+
+        if (factor >= best) {           /* check if best yet */
+            best = factor;
+            best_period = period;
+        }
     }
 
-    if (best_period * cnxt->num_chans * 2 != cnxt->shortest && best_period * cnxt->num_chans * 2 != cnxt->longest) {
-        uint32_t high_side_diff = cnxt->results [best_period] - cnxt->results [best_period+1];
-        uint32_t low_side_diff = cnxt->results [best_period] - cnxt->results [best_period-1];
+    *best_factor = best;
+    return best_period;
+}
+
+KERNEL_TEMPLATE int find_period_template (struct stretch_cnxt *cnxt, const int num_chans)
+{
+    const int shortest = cnxt->search_lo / num_chans, longest = cnxt->longest / num_chans, start = cnxt->tail / num_chans;
+    const int highest = cnxt->search_hi / num_chans;
+    const int16_t *calcbuff = (num_chans == 1 ? cnxt->inbuff : cnxt->mono_lane) + start;
+    const uint32_t *sums = cnxt->mono_sums + start;
+    uint32_t sum, scaler, best_factor = 0;
+    int best_period;
+
+    // if silence return longest period, else calculate scaler based on largest sum
+
+    if ((sum = sums [longest * 2] - sums [0]))
+        scaler = (MAX_CORR - 1) / sum;
+    else
+        return cnxt->longest;
+
+    if (cnxt->team && search_work (shortest, highest) >= SEARCH_MIN_WORK)
+        best_period = team_search (cnxt->team, calcbuff, sums, scaler, shortest, highest, NULL);
+    else
+        best_period = scan_periods_template (calcbuff, sums, scaler, shortest, highest, NULL, &best_factor);
+
+    return best_period * num_chans;
+}
+
+/*
+ * This pitch detection function is similar to find_period_template() above, except that
+ * it is optimized for speed. It searches the 2:1 averaged analysis lane, and only
+ * for every other period length. Because the time is essentially proportional to
+ * both the number of samples and the number of period lengths to try, this scheme
+ * can reduce the time by a factor approaching 4x. The correlation results on either
+ * side of the peak are compared to calculate a more accurate center of the period.
+ */
+
+KERNEL_TEMPLATE int find_period_fast_template (struct stretch_cnxt *cnxt, const int num_chans)
+{
+    const int shortest = cnxt->search_lo / (num_chans * 2), longest = cnxt->longest / (num_chans * 2), start = cnxt->tail / num_chans;
+    const int highest = cnxt->search_hi / (num_chans * 2);
+    const int16_t *calcbuff = cnxt->pair_lanes [start & 1] + (start >> 1);
+    const uint32_t *sums = cnxt->pair_sums [start & 1] + (start >> 1);
+    uint32_t sum, scaler, best_factor = 0;
+    uint32_t *results = cnxt->results;
+    int best_period;
+
+    // if silence return longest period, else calculate scaler based on largest sum
+
+    if ((sum = sums [longest * 2] - sums [0]))
+        scaler = (MAX_CORR - 1) / sum;
+    else
+        return cnxt->longest;
+
+    if (cnxt->team && search_work (shortest, highest) >= SEARCH_MIN_WORK)
+        best_period = team_search (cnxt->team, calcbuff, sums, scaler, shortest, highest, results);
+    else
+        best_period = scan_periods_template (calcbuff, sums, scaler, shortest, highest, results, &best_factor);
+
+    if (best_period != shortest && best_period != highest) {
+        uint32_t high_side_diff = results [best_period] - results [best_period+1];
+        uint32_t low_side_diff = results [best_period] - results [best_period-1];
 
         if ((low_side_diff + 1) / 2 > high_side_diff)
             best_period = best_period * 2 + 1;
@@ -580,9 +4596,38 @@ static int find_period_fast (struct stretch_cnxt *cnxt, int16_t *samples)
     else
         best_period *= 2;           /* shortest or longest use as is */
 
-    return best_period * cnxt->num_chans;
+    return best_period * num_chans;
+}
+
+#ifndef __plan9__
+
+// the search threads' scan (see team_search())
+
+static int scan_periods (const int16_t *calcbuff, const uint32_t *sums, uint32_t scaler,
+    int first, int last, uint32_t *results, uint32_t *best_factor)
+{
+    return scan_periods_template (calcbuff, sums, scaler, first, last, results, best_factor);
 }
 
+#endif
+
+#define PERIOD_KERNEL(name, template, num_chans) \
+    static int name (struct stretch_cnxt *cnxt) { return template (cnxt, num_chans); }
+
+PERIOD_KERNEL (find_period_any, find_period_template, cnxt->num_chans)
+PERIOD_KERNEL (find_period_mono, find_period_template, 1)
+PERIOD_KERNEL (find_period_stereo, find_period_template, 2)
+PERIOD_KERNEL (find_period_fast_any, find_period_fast_template, cnxt->num_chans)
+PERIOD_KERNEL (find_period_fast_mono, find_period_fast_template, 1)
+PERIOD_KERNEL (find_period_fast_stereo, find_period_fast_template, 2)
+
+// indexed by [fast_mode] [num_chans], with index 0 for any other channel count
+
+static int (*const period_kernels [2] [3]) (struct stretch_cnxt *cnxt) = {
+    { find_period_any, find_period_mono, find_period_stereo },
+    { find_period_fast_any, find_period_fast_mono, find_period_fast_stereo }
+};
+
 /*
  * To combine the two periods into one, each corresponding pair of samples
  * are averaged with a linearly sliding scale.  At the beginning of the period
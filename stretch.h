@@ -23,24 +23,107 @@
 #ifndef STRETCH_H
 #define STRETCH_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define STRETCH_FAST_FLAG    0x1    // use "fast" version of period determination code
 #define STRETCH_DUAL_FLAG    0x2    // cascade two instances (doubles usable ratio range)
+#define STRETCH_PITCH_FLAG   0x4    // resample to original duration (ratio shifts pitch instead)
+#define STRETCH_THREADED_FLAG 0x8   // run second instance of dual on its own thread
+
+#define STRETCH_ERROR_CARRY  0      // keep the ratio error when the ratio changes (default)
+#define STRETCH_ERROR_RESET  1      // drop the ratio error when the ratio changes
+#define STRETCH_ERROR_RAMP   2      // spread the ratio error over the next few blocks
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void *StretchHandle;
+typedef void *StretchPool;
+typedef void *StretchFanout;
+
+typedef int (*StretchInputCallback) (void *context, int16_t *samples, int max_num_samples);
+
+// what the stretcher did with one block (see stretch_set_block_hook()), all per channel
+
+typedef struct {
+    int stage;                          // 0 for the first instance, 1 for the cascaded one
+    int64_t position;                   // stream position of the block's input
+    int period, search_level;           // chosen period and governor level
+    float ratio, process_ratio;         // ratio for the block, transformation applied (0.5 to 2.0)
+    float error_before, error_after;    // accumulated ratio error (in samples)
+    int input_samples, output_samples;  // consumed and generated
+    int64_t start_ns;                   // monotonic clock at start of block
+    int search_ns, merge_ns;            // time in the period search (or map) and the merging
+} StretchBlockEvent;
+
+typedef void (*StretchBlockHook) (void *context, const StretchBlockEvent *event);
+
+// optional source of all the memory of a handle (see stretch_init_ex())
+
+typedef struct {
+    void *(*allocate) (void *context, size_t bytes, size_t alignment);
+    void (*deallocate) (void *context, void *ptr, size_t bytes, size_t alignment);
+    void *context;
+} StretchAllocator;
 
 StretchHandle stretch_init (int shortest_period, int longest_period, int num_chans, int flags);
+StretchHandle stretch_init_ex (int shortest_period, int longest_period, int num_chans, int flags, const StretchAllocator *allocator);
 int stretch_output_capacity (StretchHandle handle, int max_num_samples, float max_ratio);
 int stretch_samples (StretchHandle handle, const int16_t *samples, int num_samples, int16_t *output, float ratio);
 int stretch_flush (StretchHandle handle, int16_t *output);
 void stretch_reset (StretchHandle handle);
+int stretch_pull (StretchHandle handle, int16_t *output, int num_samples, float ratio, StretchInputCallback input, void *context);
+int stretch_push (StretchHandle handle, const int16_t *samples, int num_samples);
+int stretch_step (StretchHandle handle, int max_blocks, float ratio);
+int stretch_read (StretchHandle handle, int16_t *output, int max_samples);
+
+// shims for one array per channel, which just copy to and from interleaved buffers
+// around stretch_samples() and stretch_flush()
+
+int stretch_samples_copy_planar (StretchHandle handle, const int16_t *const samples[], int num_samples, int16_t *const output[], float ratio);
+int stretch_flush_copy_planar (StretchHandle handle, int16_t *const output[]);
+
+int stretch_set_gap (StretchHandle handle, float gap_ratio, float threshold_dB, int window_samples);
+void stretch_gap_stats (StretchHandle handle, int *total_frames, int *silence_frames, int *used_frames);
+void stretch_set_pitch_ratio (StretchHandle handle, float ratio);
+void stretch_set_ratio (StretchHandle handle, float ratio, float first_ratio);
+int stretch_set_error_policy (StretchHandle handle, int policy);
+int stretch_set_governor (StretchHandle handle, int sample_rate, float budget, int max_level);
+int stretch_governor_level (StretchHandle handle);
+int stretch_set_unvoiced (StretchHandle handle, float threshold);
+int stretch_unvoiced_blocks (StretchHandle handle);
+int stretch_set_adaptive (StretchHandle handle, int sample_rate, float learn_seconds);
+int stretch_adaptive_range (StretchHandle handle, int *shortest_period, int *longest_period);
+int stretch_set_search_threads (StretchHandle handle, int num_threads);
+void stretch_set_block_hook (StretchHandle handle, StretchBlockHook hook, void *context);
+void stretch_trace_hook (void *file, const StretchBlockEvent *event);
 void stretch_deinit (StretchHandle handle);
 
+uint32_t stretch_map_checksum (StretchHandle handle, uint32_t checksum, const int16_t *samples, int num_samples);
+int stretch_analyze (StretchHandle handle, const int16_t *samples, int num_samples);
+int stretch_map_bytes (StretchHandle handle);
+int stretch_map_save (StretchHandle handle, void *buffer);
+int stretch_map_load (StretchHandle handle, const void *buffer, int num_bytes, uint32_t num_samples, uint32_t checksum);
+
+int stretch_state_size (StretchHandle handle);
+int stretch_save_state (StretchHandle handle, void *buffer);
+int stretch_load_state (StretchHandle handle, const void *buffer, int num_bytes);
+
+StretchFanout stretch_fanout_init (int shortest_period, int longest_period, int num_chans, int flags, int num_outputs);
+int stretch_fanout_output_capacity (StretchFanout fanout, int max_num_samples, float max_ratio);
+int stretch_fanout_samples (StretchFanout fanout, const int16_t *samples, int num_samples,
+    int16_t *const outputs [], const float ratios [], int num_generated []);
+int stretch_fanout_flush (StretchFanout fanout, int16_t *const outputs [], int num_flushed []);
+void stretch_fanout_reset (StretchFanout fanout);
+void stretch_fanout_deinit (StretchFanout fanout);
+
+StretchPool stretch_pool_init (int shortest_period, int longest_period, int num_chans, int flags, int num_handles);
+StretchHandle stretch_pool_acquire (StretchPool pool);
+void stretch_pool_release (StretchPool pool, StretchHandle handle);
+void stretch_pool_deinit (StretchPool pool);
+
 #ifdef __cplusplus
 }
 #endif
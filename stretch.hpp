@@ -0,0 +1,277 @@
+////////////////////////////////////////////////////////////////////////////
+//                        **** AUDIO-STRETCH ****                         //
+//                      Time Domain Harmonic Scaler                       //
+//                    Copyright (c) 2022 David Bryant                     //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// stretch.hpp
+
+// C++17 interface to the TDHS library (see stretch.h).
+//
+// stretch::Stretcher<Sample, Channels> owns one StretchHandle and takes all of
+// its memory (including its own conversion buffers) from a std::pmr memory
+// resource, via stretch_init_ex(). It is move-only. The buffer sizing that
+// stretch_output_capacity() requires is done once, at construction, from the
+// largest input and ratio that will be passed, and process() and flush() then
+// write into storage the caller reuses (see make_output_buffer()), so that once
+// constructed nothing is allocated.
+//
+// Sample is int16_t (passed straight through) or float (-1.0 to +1.0, which is
+// converted to and from 16-bit internally). Channels is fixed at compile time,
+// and mono and stereo select the library's specialized period search kernels.
+// Spans hold interleaved samples, and counts are in frames (samples per channel)
+// as in the C interface. Misuse (an input that isn't whole frames or is larger
+// than the maximum, or an output smaller than output_capacity()) throws
+// std::length_error, and failure to initialize throws std::runtime_error (or
+// whatever the memory resource throws).
+//
+//     std::pmr::monotonic_buffer_resource arena;
+//     stretch::Stretcher<int16_t, 2> stretcher (44100 / 333, 44100 / 55, 0, 1024, 2.0f, &arena);
+//     auto output = stretcher.make_output_buffer ();
+//
+//     while (...) {
+//         auto stretched = stretcher.process (input, output, ratio);
+//         ...
+//     }
+//
+//     for (auto flushed = stretcher.flush (output); !flushed.empty (); flushed = stretcher.flush (output))
+//         ...
+//
+// stretch::span is std::span when the library is available (C++20), and else a
+// minimal equivalent.
+
+#ifndef STRETCH_HPP
+#define STRETCH_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+
+#ifdef __cpp_lib_span
+#include <span>
+#endif
+
+#include "stretch.h"
+
+namespace stretch {
+
+#ifdef __cpp_lib_span
+template <typename T> using span = std::span<T>;
+#else
+template <typename T> class span {
+  public:
+    constexpr span () noexcept : data_ (nullptr), size_ (0) {}
+    constexpr span (T *data, std::size_t size) noexcept : data_ (data), size_ (size) {}
+    template <std::size_t N> constexpr span (T (&array) [N]) noexcept : data_ (array), size_ (N) {}
+
+    template <typename Container, typename = std::enable_if_t<
+        std::is_convertible_v<decltype (std::declval<Container &> ().data ()), T *>>>
+    constexpr span (Container &container) noexcept : data_ (container.data ()), size_ (container.size ()) {}
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U (*) [], T (*) []>>>
+    constexpr span (const span<U> &other) noexcept : data_ (other.data ()), size_ (other.size ()) {}
+
+    constexpr T *data () const noexcept { return data_; }
+    constexpr std::size_t size () const noexcept { return size_; }
+    constexpr bool empty () const noexcept { return !size_; }
+    constexpr T &operator [] (std::size_t index) const noexcept { return data_ [index]; }
+    constexpr T *begin () const noexcept { return data_; }
+    constexpr T *end () const noexcept { return data_ + size_; }
+    constexpr span first (std::size_t count) const noexcept { return span (data_, count); }
+
+  private:
+    T *data_;
+    std::size_t size_;
+};
+#endif
+
+template <typename Sample = int16_t, int Channels = 2>
+class Stretcher {
+    static_assert (std::is_same_v<Sample, int16_t> || std::is_same_v<Sample, float>, "samples must be int16_t or float");
+    static_assert (Channels >= 1, "there must be at least one channel");
+
+    static constexpr bool converted = !std::is_same_v<Sample, int16_t>;
+
+  public:
+    using sample_type = Sample;
+    static constexpr int channels = Channels;
+
+    // The periods and flags are as for stretch_init(), and max_input_frames and max_ratio
+    // are the largest that will be passed to process() (as for stretch_output_capacity()).
+
+    Stretcher (int shortest_period, int longest_period, int flags, std::size_t max_input_frames, float max_ratio,
+        std::pmr::memory_resource *resource = std::pmr::get_default_resource ())
+            : resource_ (resource), max_input_frames_ (max_input_frames)
+    {
+        StretchAllocator allocator = { allocate, deallocate, resource };
+
+        if (!(handle_ = stretch_init_ex (shortest_period, longest_period, Channels, flags, &allocator)))
+            throw std::runtime_error ("stretch_init_ex() failed");
+
+        output_frames_ = stretch_output_capacity (handle_, static_cast<int> (max_input_frames), max_ratio);
+
+        if constexpr (converted) {
+            try {
+                scratch_ = static_cast<int16_t *> (resource_->allocate (scratch_bytes (), alignof (int16_t)));
+            }
+            catch (...) {
+                stretch_deinit (handle_);
+                throw;
+            }
+        }
+    }
+
+    Stretcher (const Stretcher &) = delete;
+    Stretcher &operator= (const Stretcher &) = delete;
+
+    Stretcher (Stretcher &&other) noexcept
+        : handle_ (std::exchange (other.handle_, nullptr)), resource_ (other.resource_), max_input_frames_ (other.max_input_frames_),
+          output_frames_ (other.output_frames_), scratch_ (std::exchange (other.scratch_, nullptr)) {}
+
+    Stretcher &operator= (Stretcher &&other) noexcept
+    {
+        if (this != &other) {
+            release ();
+            handle_ = std::exchange (other.handle_, nullptr);
+            resource_ = other.resource_;
+            max_input_frames_ = other.max_input_frames_;
+            output_frames_ = other.output_frames_;
+            scratch_ = std::exchange (other.scratch_, nullptr);
+        }
+
+        return *this;
+    }
+
+    ~Stretcher () { release (); }
+
+    // frames that the output of every process() or flush() call must have room for
+
+    std::size_t output_capacity () const noexcept { return output_frames_; }
+
+    // an output buffer of that size, allocated from the stretcher's memory resource
+
+    std::pmr::vector<Sample> make_output_buffer () const
+    {
+        return std::pmr::vector<Sample> (output_frames_ * Channels, Sample (), resource_);
+    }
+
+    // stretch the input by the ratio, returning the part of the output written (see stretch_samples())
+
+    span<Sample> process (span<const Sample> input, span<Sample> output, float ratio)
+    {
+        std::size_t num_frames = input.size () / Channels;
+        int generated;
+
+        if (input.size () % Channels || num_frames > max_input_frames_)
+            throw std::length_error ("stretch::Stretcher::process(): bad input size");
+
+        check_output (output);
+
+        if constexpr (converted) {
+            int16_t *input_scratch = scratch_ + output_frames_ * Channels;
+
+            for (std::size_t i = 0; i < input.size (); ++i)
+                input_scratch [i] = to_int16 (input [i]);
+
+            generated = stretch_samples (handle_, input_scratch, static_cast<int> (num_frames), scratch_, ratio);
+            return from_int16 (output, generated);
+        }
+        else {
+            generated = stretch_samples (handle_, input.data (), static_cast<int> (num_frames), output.data (), ratio);
+            return output.first (generated * Channels);
+        }
+    }
+
+    // flush the remaining audio at the end of the stream, in as many calls as it takes (until empty)
+
+    span<Sample> flush (span<Sample> output)
+    {
+        check_output (output);
+
+        if constexpr (converted)
+            return from_int16 (output, stretch_flush (handle_, scratch_));
+        else
+            return output.first (stretch_flush (handle_, output.data ()) * Channels);
+    }
+
+    void reset () noexcept { stretch_reset (handle_); }
+
+    // for the rest of the C interface (stretch_set_gap(), stretch_set_governor(), ...)
+
+    StretchHandle native_handle () const noexcept { return handle_; }
+    std::pmr::memory_resource *resource () const noexcept { return resource_; }
+
+  private:
+    StretchHandle handle_ = nullptr;
+    std::pmr::memory_resource *resource_;
+    std::size_t max_input_frames_, output_frames_ = 0;
+    int16_t *scratch_ = nullptr;                // converted output, then input (float samples only)
+
+    std::size_t scratch_bytes () const noexcept { return (output_frames_ + max_input_frames_) * Channels * sizeof (int16_t); }
+
+    void release () noexcept
+    {
+        if (scratch_)
+            resource_->deallocate (scratch_, scratch_bytes (), alignof (int16_t));
+
+        if (handle_)
+            stretch_deinit (handle_);
+
+        scratch_ = nullptr;
+        handle_ = nullptr;
+    }
+
+    void check_output (span<Sample> output) const
+    {
+        if (output.size () < output_frames_ * Channels)
+            throw std::length_error ("stretch::Stretcher: output smaller than output_capacity()");
+    }
+
+    static int16_t to_int16 (float sample) noexcept
+    {
+        float scaled = std::nearbyint (sample * 32768.0f);
+        return static_cast<int16_t> (scaled > 32767.0f ? 32767.0f : scaled < -32768.0f ? -32768.0f : scaled);
+    }
+
+    span<Sample> from_int16 (span<Sample> output, int num_frames) const noexcept
+    {
+        for (std::size_t i = 0; i < static_cast<std::size_t> (num_frames) * Channels; ++i)
+            output [i] = scratch_ [i] * (1.0f / 32768.0f);
+
+        return output.first (num_frames * Channels);
+    }
+
+    // the library's allocator, which must not throw through C
+
+    static void *allocate (void *context, std::size_t bytes, std::size_t alignment) noexcept
+    {
+        try {
+            return static_cast<std::pmr::memory_resource *> (context)->allocate (bytes, alignment);
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    static void deallocate (void *context, void *ptr, std::size_t bytes, std::size_t alignment) noexcept
+    {
+        static_cast<std::pmr::memory_resource *> (context)->deallocate (ptr, bytes, alignment);
+    }
+};
+
+} // namespace stretch
+
+#endif
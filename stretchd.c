@@ -0,0 +1,831 @@
+////////////////////////////////////////////////////////////////////////////
+//                        **** AUDIO-STRETCH ****                         //
+//                      Time Domain Harmonic Scaler                       //
+//                    Copyright (c) 2022 David Bryant                     //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// stretchd.c
+
+// This module is a local daemon that serves many concurrent streaming sessions
+// of the TDHS library over a Unix domain socket (see stretchd.h for the protocol),
+// so that services don't each have to embed the library and keep handle pools.
+//
+// The main thread only accepts connections. Each one is handed to the worker
+// with the fewest sessions and stays pinned to it (along with its stretcher) for
+// its lifetime, so that the stretcher's buffers stay in that core's cache. Every
+// worker multiplexes its sessions with its own epoll instance using non-blocking
+// I/O, and does all the stretching for them. A session whose output isn't being
+// read stops being read itself until the client catches up (backpressure), which
+// bounds the memory of every session regardless of the client's behavior.
+//
+// The stretchers come from handle pools that each worker creates for the first
+// few stream formats (sample rate, channels and flags) it sees, so opening a
+// stream doesn't normally create one. When the pool of a format is all in use
+// (or the worker already has its maximum number of pools), a stretcher is
+// created for just that stream instead.
+//
+// This is Linux-only (epoll, accept4).
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "stretch.h"
+#include "stretchd.h"
+
+#define UPPER_FREQUENCY     333     // same period limits as the demo program
+#define LOWER_FREQUENCY     55
+#define MAX_EVENTS          64      // events handled per epoll_wait()
+#define ACCEPT_BACKOFF_MS   100     // pause after accept() fails for lack of resources
+#define MAX_PAYLOAD         (STRETCHD_MAX_SAMPLES * 2 * sizeof (int16_t))
+#define INPUT_BYTES         (sizeof (StretchdHeader) + MAX_PAYLOAD)
+#define MAX_POOLS           8       // stream formats pooled by each worker
+
+static const char *sign_on = "\n"
+" STRETCHD  Time Domain Harmonic Scaling Daemon  Version 0.4\n"
+" Copyright (c) 2022 David Bryant. All Rights Reserved.\n\n";
+
+static const char *usage =
+" Usage:     STRETCHD [-options] socket\n\n"
+" Options:  -w<n>   = number of worker threads (default = number of CPUs)\n"
+"           -s<n>   = maximum number of sessions (default = 1024)\n"
+"           -p<n>   = pooled handles per worker and stream format (default = 8)\n"
+"           -a      = pin each worker thread to its own CPU\n"
+"           -q      = quiet mode (display errors only)\n"
+"           -v      = verbose (display the stats of every session)\n\n"
+" Web:      Visit www.github.com/dbry/audio-stretch for latest version\n\n";
+
+typedef struct session {
+    struct session *next, *prev;        // worker's list of sessions
+    int fd, paused, closing;
+    StretchHandle stretcher;            // NULL between sessions
+    StretchPool pool;                   // that the stretcher came from (or NULL)
+    int num_chans, flags;
+    float ratio, max_ratio;
+    int16_t *output;                    // output of one stretcher call
+    unsigned char *input;               // received bytes (at most one frame)
+    int input_bytes;
+    unsigned char *pending;             // frames not yet sent
+    size_t pending_start, pending_end, pending_size;
+    StretchdStats stats;
+} Session;
+
+typedef struct {
+    pthread_t thread;
+    int index, epoll_fd, pipe_fds [2];  // the pipe hands over new sessions
+    int num_sessions;                   // also read by the main thread
+    Session *sessions;
+    struct {
+        int sample_rate, num_chans, flags;
+        StretchPool pool;
+    } pools [MAX_POOLS];
+    int num_pools;
+    uint64_t total_sessions, pooled_sessions, input_samples, output_samples, dsp_ns;
+} Worker;
+
+static int verbose_mode, quiet_mode, num_workers, pool_handles = 8;
+static volatile sig_atomic_t stopping;
+
+static void *worker_thread (void *arg);
+static void session_event (Worker *worker, Session *session, uint32_t events);
+static int handle_frame (Worker *worker, Session *session, StretchdHeader *header, unsigned char *payload);
+static StretchHandle open_stretcher (Worker *worker, Session *session, const StretchdOpen *open);
+static void release_stretcher (Session *session);
+static void end_session (Worker *worker, Session *session);
+static int send_frame (Session *session, uint32_t type, const void *payload, uint32_t length);
+static int send_error (Session *session, const char *message);
+static int write_pending (Session *session);
+static void close_session (Worker *worker, Session *session);
+static uint64_t clock_ns (void);
+
+static void stop_handler (int signum)
+{
+    (void) signum;
+    stopping = 1;
+}
+
+int main (argc, argv) int argc; char **argv;
+{
+    int asked_help = 0, pin_workers = 0, max_sessions = 1024, listen_fd, i;
+    char *socket_path = NULL;
+    struct sockaddr_un address;
+    struct sigaction action;
+    sigset_t signals, old_signals;
+    Worker *workers;
+    struct stat st;
+
+    num_workers = sysconf (_SC_NPROCESSORS_ONLN);
+
+    // loop through command-line arguments
+
+    while (--argc) {
+        if ((**++argv == '-') && (*argv)[1])
+            while (*++*argv)
+                switch (**argv) {
+
+                    case 'W': case 'w':
+                        num_workers = strtol (++*argv, argv, 10);
+
+                        if (num_workers < 1 || num_workers > 1024) {
+                            fprintf (stderr, "\nnumber of workers must be from 1 to 1024!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'S': case 's':
+                        max_sessions = strtol (++*argv, argv, 10);
+
+                        if (max_sessions < 1) {
+                            fprintf (stderr, "\nmaximum number of sessions must be at least 1!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'P': case 'p':
+                        pool_handles = strtol (++*argv, argv, 10);
+
+                        if (pool_handles < 0 || pool_handles > 1024) {
+                            fprintf (stderr, "\nnumber of pooled handles must be from 0 to 1024!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'A': case 'a':
+                        pin_workers = 1;
+                        break;
+
+                    case 'H': case 'h':
+                        asked_help = 1;
+                        break;
+
+                    case 'V': case 'v':
+                        verbose_mode = 1;
+                        break;
+
+                    case 'Q': case 'q':
+                        quiet_mode = 1;
+                        break;
+
+                    default:
+                        fprintf (stderr, "\nillegal option: %c !\n", **argv);
+                        return -1;
+                }
+        else if (!socket_path)
+            socket_path = *argv;
+        else {
+            fprintf (stderr, "\nextra unknown argument: %s !\n", *argv);
+            return -1;
+        }
+    }
+
+    if (!quiet_mode)
+        fprintf (stderr, "%s", sign_on);
+
+    if (!socket_path || asked_help) {
+        printf ("%s", usage);
+        return 0;
+    }
+
+    if (num_workers < 1)
+        num_workers = 1;
+
+    if (strlen (socket_path) >= sizeof (address.sun_path)) {
+        fprintf (stderr, "socket path \"%s\" is too long!\n", socket_path);
+        return 1;
+    }
+
+    // a stale socket from a previous run is replaced, but nothing else is
+
+    if (!lstat (socket_path, &st)) {
+        if (!S_ISSOCK (st.st_mode)) {
+            fprintf (stderr, "\"%s\" exists and is not a socket!\n", socket_path);
+            return 1;
+        }
+
+        unlink (socket_path);
+    }
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy (address.sun_path, socket_path);
+
+    if ((listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind (listen_fd, (struct sockaddr *) &address, sizeof (address)) || listen (listen_fd, SOMAXCONN)) {
+            fprintf (stderr, "can't listen on \"%s\": %s\n", socket_path, strerror (errno));
+            return 1;
+    }
+
+    // the workers get no signals, so that they interrupt the accept() of the main thread
+
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = stop_handler;
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+    signal (SIGPIPE, SIG_IGN);
+
+    sigfillset (&signals);
+    pthread_sigmask (SIG_BLOCK, &signals, &old_signals);
+
+    workers = calloc (num_workers, sizeof (Worker));
+
+    for (i = 0; i < num_workers; ++i) {
+        workers [i].index = i;
+
+        if ((workers [i].epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) < 0 || pipe2 (workers [i].pipe_fds, O_CLOEXEC) ||
+            pthread_create (&workers [i].thread, NULL, worker_thread, workers + i)) {
+                fprintf (stderr, "can't start worker %d: %s\n", i, strerror (errno));
+                return 1;
+        }
+
+        if (pin_workers) {
+            cpu_set_t cpus;
+
+            CPU_ZERO (&cpus);
+            CPU_SET (i % sysconf (_SC_NPROCESSORS_ONLN), &cpus);
+
+            if (pthread_setaffinity_np (workers [i].thread, sizeof (cpus), &cpus) && !quiet_mode)
+                fprintf (stderr, "warning: can't pin worker %d to a CPU\n", i);
+        }
+    }
+
+    pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+    if (!quiet_mode)
+        fprintf (stderr, "listening on \"%s\" with %d workers%s\n", socket_path, num_workers, pin_workers ? " (pinned)" : "");
+
+    while (!stopping) {
+        int fd = accept4 (listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC), total_sessions = 0, least_sessions = 0;
+        Worker *worker = NULL;
+        Session *session = NULL;
+
+        if (fd < 0) {
+            // out of descriptors or memory won't clear up right away, so wait a bit before retrying
+
+            if (errno != EINTR && errno != ECONNABORTED) {
+                struct timespec backoff = { 0, ACCEPT_BACKOFF_MS * 1000000L };
+
+                if (!quiet_mode)
+                    fprintf (stderr, "accept: %s\n", strerror (errno));
+
+                nanosleep (&backoff, NULL);
+            }
+
+            continue;
+        }
+
+        for (i = 0; i < num_workers; ++i) {
+            int num_sessions = __atomic_load_n (&workers [i].num_sessions, __ATOMIC_RELAXED);
+
+            if (!worker || num_sessions < least_sessions) {
+                least_sessions = num_sessions;
+                worker = workers + i;
+            }
+
+            total_sessions += num_sessions;
+        }
+
+        if (total_sessions >= max_sessions || !(session = calloc (1, sizeof (Session))) ||
+            !(session->input = malloc (INPUT_BYTES))) {
+                static const char message [] = "too many sessions";
+                StretchdHeader header = { STRETCHD_ERROR, sizeof (message) - 1 };
+
+                free (session);
+
+                // best effort, the socket buffer of a new connection is empty
+
+                if (send (fd, &header, sizeof (header), MSG_NOSIGNAL) == sizeof (header))
+                    send (fd, message, header.length, MSG_NOSIGNAL);
+
+                close (fd);
+                continue;
+        }
+
+        session->fd = fd;
+        __atomic_add_fetch (&worker->num_sessions, 1, __ATOMIC_RELAXED);
+
+        if (write (worker->pipe_fds [1], &session, sizeof (session)) != sizeof (session)) {
+            fprintf (stderr, "can't hand over session: %s\n", strerror (errno));
+            __atomic_sub_fetch (&worker->num_sessions, 1, __ATOMIC_RELAXED);
+            free (session->input);
+            free (session);
+            close (fd);
+        }
+    }
+
+    // closing the pipes makes each worker close its sessions and exit
+
+    close (listen_fd);
+    unlink (socket_path);
+
+    for (i = 0; i < num_workers; ++i) {
+        close (workers [i].pipe_fds [1]);
+        pthread_join (workers [i].thread, NULL);
+        close (workers [i].pipe_fds [0]);
+        close (workers [i].epoll_fd);
+
+        if (!quiet_mode && workers [i].total_sessions)
+            fprintf (stderr, "worker %d: %llu sessions (%llu pooled), %llu samples --> %llu samples, %.3f seconds DSP\n", i,
+                (unsigned long long) workers [i].total_sessions, (unsigned long long) workers [i].pooled_sessions,
+                (unsigned long long) workers [i].input_samples,
+                (unsigned long long) workers [i].output_samples, workers [i].dsp_ns / 1e9);
+    }
+
+    free (workers);
+    return 0;
+}
+
+static void *worker_thread (void *arg)
+{
+    Worker *worker = arg;
+    struct epoll_event event, events [MAX_EVENTS];
+    int running = 1, num_events, i;
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;      // marks the pipe
+
+    if (epoll_ctl (worker->epoll_fd, EPOLL_CTL_ADD, worker->pipe_fds [0], &event)) {
+        fprintf (stderr, "worker %d: epoll_ctl: %s\n", worker->index, strerror (errno));
+        return NULL;
+    }
+
+    while (running) {
+        if ((num_events = epoll_wait (worker->epoll_fd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            fprintf (stderr, "worker %d: epoll_wait: %s\n", worker->index, strerror (errno));
+            break;
+        }
+
+        for (i = 0; i < num_events; ++i)
+            if (events [i].data.ptr)
+                session_event (worker, events [i].data.ptr, events [i].events);
+            else {
+                Session *session;
+
+                if (read (worker->pipe_fds [0], &session, sizeof (session)) != sizeof (session)) {
+                    running = 0;
+                    continue;
+                }
+
+                event.events = EPOLLIN;
+                event.data.ptr = session;
+
+                if (epoll_ctl (worker->epoll_fd, EPOLL_CTL_ADD, session->fd, &event)) {
+                    fprintf (stderr, "worker %d: epoll_ctl: %s\n", worker->index, strerror (errno));
+                    close (session->fd);
+                    free (session->input);
+                    free (session);
+                    __atomic_sub_fetch (&worker->num_sessions, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+
+                if ((session->next = worker->sessions))
+                    session->next->prev = session;
+
+                worker->sessions = session;
+            }
+    }
+
+    while (worker->sessions)
+        close_session (worker, worker->sessions);
+
+    for (i = 0; i < worker->num_pools; ++i)
+        stretch_pool_deinit (worker->pools [i].pool);
+
+    return NULL;
+}
+
+// Handle the readiness of one session: send what we can, receive what we can, and
+// process all the complete frames received unless the session is stopped by
+// backpressure, in which case the frames wait (along with the socket) until the
+// pending output drains to the low-water mark.
+
+static void session_event (Worker *worker, Session *session, uint32_t events)
+{
+    struct epoll_event event;
+
+    if (events & EPOLLOUT) {
+        if (!write_pending (session)) {
+            close_session (worker, session);
+            return;
+        }
+    }
+
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !session->paused && !session->closing) {
+        int bytes_read = read (session->fd, session->input + session->input_bytes, INPUT_BYTES - session->input_bytes);
+
+        if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN && errno != EINTR)) {
+            close_session (worker, session);
+            return;
+        }
+
+        if (bytes_read > 0)
+            session->input_bytes += bytes_read;
+    }
+    else if ((events & (EPOLLHUP | EPOLLERR)) && !(events & EPOLLOUT)) {
+        close_session (worker, session);
+        return;
+    }
+
+    while (!session->closing) {
+        int offset = 0;
+
+        if (session->paused) {
+            if (session->pending_end - session->pending_start > STRETCHD_LOW_WATER)
+                break;
+
+            session->paused = 0;
+        }
+
+        while (!session->paused && !session->closing && session->input_bytes - offset >= (int) sizeof (StretchdHeader)) {
+            StretchdHeader header;
+
+            memcpy (&header, session->input + offset, sizeof (header));
+
+            if (header.length > MAX_PAYLOAD) {
+                send_error (session, "frame too long");
+                break;
+            }
+
+            if (session->input_bytes - offset < (int) (sizeof (header) + header.length))
+                break;
+
+            if (!handle_frame (worker, session, &header, session->input + offset + sizeof (header))) {
+                close_session (worker, session);
+                return;
+            }
+
+            offset += sizeof (header) + header.length;
+
+            // try to get rid of the output right away, and stop reading if we can't
+
+            if (session->pending_end - session->pending_start > STRETCHD_HIGH_WATER) {
+                if (!write_pending (session)) {
+                    close_session (worker, session);
+                    return;
+                }
+
+                if (session->pending_end - session->pending_start > STRETCHD_HIGH_WATER) {
+                    session->stats.stalls++;
+                    session->paused = 1;
+                }
+            }
+        }
+
+        if (offset) {
+            memmove (session->input, session->input + offset, session->input_bytes - offset);
+            session->input_bytes -= offset;
+        }
+
+        if (!write_pending (session)) {
+            close_session (worker, session);
+            return;
+        }
+
+        // loop only if the write just released the backpressure
+
+        if (!session->paused || session->pending_end - session->pending_start > STRETCHD_LOW_WATER)
+            break;
+    }
+
+    if (session->closing && session->pending_start == session->pending_end) {
+        close_session (worker, session);
+        return;
+    }
+
+    event.events = (session->paused || session->closing ? 0 : EPOLLIN) |
+        (session->pending_start < session->pending_end ? EPOLLOUT : 0);
+    event.data.ptr = session;
+
+    if (epoll_ctl (worker->epoll_fd, EPOLL_CTL_MOD, session->fd, &event))
+        close_session (worker, session);
+}
+
+// Process one complete frame from the client. Protocol errors are reported to the
+// client (which ends the connection), and FALSE is returned only for local errors.
+
+static int handle_frame (Worker *worker, Session *session, StretchdHeader *header, unsigned char *payload)
+{
+    StretchdReady ready;
+    StretchdOpen open;
+    uint64_t start_ns;
+    int num_samples;
+    float ratio;
+
+    switch (header->type) {
+        case STRETCHD_OPEN:
+            if (session->stretcher)
+                return send_error (session, "session already open");
+
+            if (header->length != sizeof (open))
+                return send_error (session, "bad open frame");
+
+            memcpy (&open, payload, sizeof (open));
+
+            if (open.sample_rate < 8000 || open.sample_rate > 48000)
+                return send_error (session, "sample rate must be 8000 to 48000");
+
+            if (open.num_chans < 1 || open.num_chans > 2)
+                return send_error (session, "must be mono or stereo");
+
+            if (open.flags & ~(STRETCH_FAST_FLAG | STRETCH_DUAL_FLAG | STRETCH_PITCH_FLAG))
+                return send_error (session, "unsupported flags");
+
+            session->max_ratio = (open.flags & STRETCH_DUAL_FLAG) ? 4.0 : 2.0;
+
+            if (!(open.ratio >= 1.0 / session->max_ratio && open.ratio <= session->max_ratio))
+                return send_error (session, "ratio out of range");
+
+            if (!(session->stretcher = open_stretcher (worker, session, &open)))
+                return send_error (session, "can't initialize stretcher");
+
+            free (session->output);
+            session->output = malloc (stretch_output_capacity (session->stretcher, STRETCHD_MAX_SAMPLES, session->max_ratio) *
+                open.num_chans * sizeof (int16_t));
+
+            if (!session->output) {
+                release_stretcher (session);
+                return send_error (session, "can't allocate required memory");
+            }
+
+            session->num_chans = open.num_chans;
+            session->flags = open.flags;
+            session->ratio = open.ratio;
+            memset (&session->stats, 0, sizeof (session->stats));
+            session->stats.worker = worker->index;
+            ready.worker = worker->index;
+            ready.num_workers = num_workers;
+            return send_frame (session, STRETCHD_READY, &ready, sizeof (ready));
+
+        case STRETCHD_RATIO:
+            if (!session->stretcher)
+                return send_error (session, "no session open");
+
+            if (header->length != sizeof (ratio))
+                return send_error (session, "bad ratio frame");
+
+            memcpy (&ratio, payload, sizeof (ratio));
+
+            if (!(ratio >= 1.0 / session->max_ratio && ratio <= session->max_ratio))
+                return send_error (session, "ratio out of range");
+
+            session->ratio = ratio;
+            return 1;
+
+        case STRETCHD_AUDIO:
+            if (!session->stretcher)
+                return send_error (session, "no session open");
+
+            if (header->length % (session->num_chans * sizeof (int16_t)) ||
+                (num_samples = header->length / (session->num_chans * sizeof (int16_t))) > STRETCHD_MAX_SAMPLES)
+                    return send_error (session, "bad audio frame");
+
+            start_ns = clock_ns ();
+            num_samples = stretch_samples (session->stretcher, (const int16_t *) payload, num_samples, session->output, session->ratio);
+            start_ns = clock_ns () - start_ns;
+
+            session->stats.dsp_ns += start_ns;
+
+            if (start_ns > session->stats.max_call_ns)
+                session->stats.max_call_ns = start_ns;
+
+            session->stats.input_samples += header->length / (session->num_chans * sizeof (int16_t));
+            session->stats.input_frames++;
+
+            if (num_samples) {
+                session->stats.output_samples += num_samples;
+                session->stats.output_frames++;
+                return send_frame (session, STRETCHD_AUDIO, session->output, num_samples * session->num_chans * sizeof (int16_t));
+            }
+
+            return 1;
+
+        case STRETCHD_STATS:
+            if (!session->stretcher)
+                return send_error (session, "no session open");
+
+            return send_frame (session, STRETCHD_STATS, &session->stats, sizeof (session->stats));
+
+        case STRETCHD_END:
+            if (!session->stretcher)
+                return send_error (session, "no session open");
+
+            // flush until empty (it takes two calls for dual instances)
+
+            while (1) {
+                start_ns = clock_ns ();
+                num_samples = stretch_flush (session->stretcher, session->output);
+                session->stats.dsp_ns += clock_ns () - start_ns;
+
+                if (!num_samples)
+                    break;
+
+                session->stats.output_samples += num_samples;
+                session->stats.output_frames++;
+
+                if (!send_frame (session, STRETCHD_AUDIO, session->output, num_samples * session->num_chans * sizeof (int16_t)))
+                    return 0;
+            }
+
+            if (!send_frame (session, STRETCHD_STATS, &session->stats, sizeof (session->stats)))
+                return 0;
+
+            end_session (worker, session);
+            return 1;
+
+        default:
+            return send_error (session, "unknown frame type");
+    }
+}
+
+// Get a stretcher for a new stream, from the worker's pool for its format if there is one
+// (creating the pool if there's room for another) and it has a handle free, or else a new
+// one that's freed at the end of the stream. Pool handles come back with every setting
+// of their last stream dropped, so they start out just like new ones.
+
+static StretchHandle open_stretcher (Worker *worker, Session *session, const StretchdOpen *open)
+{
+    int shortest = open->sample_rate / UPPER_FREQUENCY, longest = open->sample_rate / LOWER_FREQUENCY, i;
+    StretchHandle stretcher;
+
+    session->pool = NULL;
+
+    for (i = 0; i < worker->num_pools; ++i)
+        if (worker->pools [i].sample_rate == open->sample_rate && worker->pools [i].num_chans == open->num_chans &&
+            worker->pools [i].flags == open->flags) {
+                session->pool = worker->pools [i].pool;
+                break;
+        }
+
+    if (!session->pool && pool_handles && worker->num_pools < MAX_POOLS &&
+        (session->pool = stretch_pool_init (shortest, longest, open->num_chans, open->flags, pool_handles))) {
+            worker->pools [worker->num_pools].sample_rate = open->sample_rate;
+            worker->pools [worker->num_pools].num_chans = open->num_chans;
+            worker->pools [worker->num_pools].flags = open->flags;
+            worker->pools [worker->num_pools++].pool = session->pool;
+
+            if (verbose_mode)
+                fprintf (stderr, "worker %d: pooling %d handles for %d Hz, %d channel(s), flags 0x%x\n",
+                    worker->index, pool_handles, open->sample_rate, open->num_chans, open->flags);
+    }
+
+    if (session->pool && (stretcher = stretch_pool_acquire (session->pool)))
+        return stretcher;
+
+    session->pool = NULL;
+    return stretch_init (shortest, longest, open->num_chans, open->flags);
+}
+
+// return the stretcher of a session to its pool (or free it)
+
+static void release_stretcher (Session *session)
+{
+    if (session->pool)
+        stretch_pool_release (session->pool, session->stretcher);
+    else
+        stretch_deinit (session->stretcher);
+
+    session->stretcher = NULL;
+    session->pool = NULL;
+}
+
+// release the stretcher of a session and account for it in the worker's totals
+
+static void end_session (Worker *worker, Session *session)
+{
+    if (!session->stretcher)
+        return;
+
+    if (verbose_mode)
+        fprintf (stderr, "worker %d: session of %llu samples --> %llu samples (ratio = %.3f), "
+            "%.3f ms DSP (longest call %.1f us), %u stalls\n", worker->index,
+            (unsigned long long) session->stats.input_samples, (unsigned long long) session->stats.output_samples,
+            session->stats.input_samples ? (double) session->stats.output_samples / session->stats.input_samples : 0.0,
+            session->stats.dsp_ns / 1e6, session->stats.max_call_ns / 1e3, session->stats.stalls);
+
+    worker->total_sessions++;
+    worker->pooled_sessions += session->pool != NULL;
+    worker->input_samples += session->stats.input_samples;
+    worker->output_samples += session->stats.output_samples;
+    worker->dsp_ns += session->stats.dsp_ns;
+    release_stretcher (session);
+}
+
+// queue a frame to the client (it is sent by write_pending())
+
+static int send_frame (Session *session, uint32_t type, const void *payload, uint32_t length)
+{
+    StretchdHeader header = { type, length };
+    size_t needed = sizeof (header) + length;
+
+    if (session->pending_start == session->pending_end)
+        session->pending_start = session->pending_end = 0;
+
+    if (session->pending_end + needed > session->pending_size) {
+        if (session->pending_start) {
+            memmove (session->pending, session->pending + session->pending_start, session->pending_end - session->pending_start);
+            session->pending_end -= session->pending_start;
+            session->pending_start = 0;
+        }
+
+        if (session->pending_end + needed > session->pending_size) {
+            size_t size = session->pending_size ? session->pending_size : 65536;
+            unsigned char *pending;
+
+            while (size < session->pending_end + needed)
+                size *= 2;
+
+            if (!(pending = realloc (session->pending, size)))
+                return 0;
+
+            session->pending = pending;
+            session->pending_size = size;
+        }
+    }
+
+    memcpy (session->pending + session->pending_end, &header, sizeof (header));
+    memcpy (session->pending + session->pending_end + sizeof (header), payload, length);
+    session->pending_end += needed;
+    return 1;
+}
+
+// queue an error for the client and close the connection once it's sent
+
+static int send_error (Session *session, const char *message)
+{
+    session->closing = 1;
+    return send_frame (session, STRETCHD_ERROR, message, strlen (message));
+}
+
+// send as much of the pending output as the socket takes, FALSE on a broken connection
+
+static int write_pending (Session *session)
+{
+    while (session->pending_start < session->pending_end) {
+        ssize_t bytes_written = send (session->fd, session->pending + session->pending_start,
+            session->pending_end - session->pending_start, MSG_NOSIGNAL);
+
+        if (bytes_written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return errno == EAGAIN;
+        }
+
+        session->pending_start += bytes_written;
+    }
+
+    return 1;
+}
+
+static void close_session (Worker *worker, Session *session)
+{
+    end_session (worker, session);
+    epoll_ctl (worker->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    close (session->fd);
+
+    if (session->next)
+        session->next->prev = session->prev;
+
+    if (session->prev)
+        session->prev->next = session->next;
+    else
+        worker->sessions = session->next;
+
+    free (session->pending);
+    free (session->output);
+    free (session->input);
+    free (session);
+    __atomic_sub_fetch (&worker->num_sessions, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t clock_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,76 @@
+////////////////////////////////////////////////////////////////////////////
+//                        **** AUDIO-STRETCH ****                         //
+//                      Time Domain Harmonic Scaler                       //
+//                    Copyright (c) 2022 David Bryant                     //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// stretchd.h
+
+// Protocol of the stretch daemon (stretchd.c), shared with its clients.
+//
+// Each connection to the daemon's Unix domain socket (SOCK_STREAM) carries one
+// streaming session at a time. Everything is sent as frames, which are a header
+// followed by "length" bytes of payload, all in host byte order (the daemon is
+// local, so client and server always agree):
+//
+//   client                                  daemon
+//   ------                                  ------
+//   OPEN (StretchdOpen)           -->
+//                                 <--       READY (StretchdReady) or ERROR
+//   AUDIO (interleaved int16)     -->
+//                                 <--       AUDIO (stretched, when available)
+//   RATIO (float)                 -->       (applies to the following AUDIO)
+//   STATS (empty)                 -->
+//                                 <--       STATS (StretchdStats)
+//   END (empty)                   -->
+//                                 <--       AUDIO (flushed), then STATS
+//
+// After END the session is over and another OPEN may follow on the same
+// connection. An ERROR (text payload) ends the session and the connection.
+// AUDIO frames from the client must contain whole sample frames and may not
+// exceed STRETCHD_MAX_SAMPLES per channel.
+//
+// The daemon stops reading a connection whose stretched audio isn't being read
+// (see STRETCHD_HIGH_WATER), so a client must keep reading while it writes.
+
+#ifndef STRETCHD_H
+#define STRETCHD_H
+
+#include <stdint.h>
+
+#define STRETCHD_OPEN       1
+#define STRETCHD_READY      2
+#define STRETCHD_AUDIO      3
+#define STRETCHD_RATIO      4
+#define STRETCHD_STATS      5
+#define STRETCHD_END        6
+#define STRETCHD_ERROR      7
+
+#define STRETCHD_MAX_SAMPLES    8192            // per channel in one client AUDIO frame
+#define STRETCHD_HIGH_WATER     (256 * 1024)    // pending output bytes that stop reading a session
+#define STRETCHD_LOW_WATER      (64 * 1024)     // pending output bytes that resume it
+
+typedef struct {
+    uint32_t type, length;
+} StretchdHeader;
+
+typedef struct {
+    int32_t sample_rate, num_chans;             // 8000 to 48000 Hz, 1 or 2 channels
+    int32_t flags;                              // STRETCH_FAST_FLAG, STRETCH_DUAL_FLAG and STRETCH_PITCH_FLAG
+    float ratio;                                // 0.5 to 2.0 (0.25 to 4.0 with STRETCH_DUAL_FLAG)
+} StretchdOpen;
+
+typedef struct {
+    int32_t worker, num_workers;                // worker thread the session is pinned to
+} StretchdReady;
+
+typedef struct {
+    uint64_t input_samples, output_samples;     // per channel
+    uint64_t input_frames, output_frames;       // AUDIO frames received and sent
+    uint64_t dsp_ns, max_call_ns;               // time in the stretcher, and the longest call
+    uint32_t stalls, worker;                    // times reading was stopped by backpressure
+} StretchdStats;
+
+#endif
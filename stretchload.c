@@ -0,0 +1,447 @@
+////////////////////////////////////////////////////////////////////////////
+//                        **** AUDIO-STRETCH ****                         //
+//                      Time Domain Harmonic Scaler                       //
+//                    Copyright (c) 2022 David Bryant                     //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// stretchload.c
+
+// This module is a load generator for the stretch daemon (stretchd.c). It runs
+// the requested number of concurrent streams (one thread each), all sending the
+// same synthetic speech-like signal as fast as the daemon takes it, and then
+// reports the aggregate throughput as real-time streams per core, both in terms
+// of elapsed time (which includes all the I/O) and of the daemon's DSP time.
+//
+// This is Linux-only, like the daemon.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stretch.h"
+#include "stretchd.h"
+
+static const char *sign_on = "\n"
+" STRETCHLOAD  Load Generator for the Stretch Daemon  Version 0.4\n"
+" Copyright (c) 2022 David Bryant. All Rights Reserved.\n\n";
+
+static const char *usage =
+" Usage:     STRETCHLOAD [-options] socket\n\n"
+" Options:  -n<n>   = number of concurrent streams (default = 16)\n"
+"           -t<n.n> = seconds of audio per stream (default = 10)\n"
+"           -r<n.n> = stretch ratio (0.25 to 4.0, default = 1.25)\n"
+"           -k<n>   = sample rate (8000 to 48000 Hz, default = 44100)\n"
+"           -c<n>   = number of channels (1 or 2, default = 2)\n"
+"           -b<n>   = audio frame length (ms, default = 25)\n"
+"           -f      = fast pitch detection\n"
+"           -d      = force dual instance even for shallow ratios\n"
+"           -q      = quiet mode (display errors only)\n"
+"           -v      = verbose (display the stats of every stream)\n\n"
+" Web:      Visit www.github.com/dbry/audio-stretch for latest version\n\n";
+
+typedef struct {
+    pthread_t thread;
+    int index, failed, num_workers;
+    StretchdStats stats;                // from the daemon at the end of the stream
+    uint64_t received_samples;
+} Stream;
+
+static char *socket_path;
+static int sample_rate = 44100, num_chans = 2, frame_samples, total_samples, flags, verbose_mode, quiet_mode;
+static float ratio = 1.25;
+static int16_t *signal_samples;
+
+static void *stream_thread (void *arg);
+static int read_frame (int fd, StretchdHeader *header, void *payload, uint32_t max_length);
+static void generate_signal (void);
+static double clock_seconds (void);
+
+int main (argc, argv) int argc; char **argv;
+{
+    int asked_help = 0, num_streams = 16, frame_ms = 25, force_dual = 0, failed = 0, num_workers = 0, i;
+    double seconds = 10.0, start_time, elapsed, audio_seconds, dsp_seconds = 0.0;
+    uint64_t input_samples = 0, output_samples = 0;
+    Stream *streams;
+
+    // loop through command-line arguments
+
+    while (--argc) {
+        if ((**++argv == '-') && (*argv)[1])
+            while (*++*argv)
+                switch (**argv) {
+
+                    case 'N': case 'n':
+                        num_streams = strtol (++*argv, argv, 10);
+
+                        if (num_streams < 1 || num_streams > 4096) {
+                            fprintf (stderr, "\nnumber of streams must be from 1 to 4096!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'T': case 't':
+                        seconds = strtod (++*argv, argv);
+
+                        if (seconds <= 0.0 || seconds > 3600.0) {
+                            fprintf (stderr, "\nstream length must be up to 3600 seconds!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'R': case 'r':
+                        ratio = strtod (++*argv, argv);
+
+                        if (ratio < 0.25 || ratio > 4.0) {
+                            fprintf (stderr, "\nratio must be from 0.25 to 4.0!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'K': case 'k':
+                        sample_rate = strtol (++*argv, argv, 10);
+
+                        if (sample_rate < 8000 || sample_rate > 48000) {
+                            fprintf (stderr, "\nsample rate must be from 8000 to 48000 Hz!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'C': case 'c':
+                        num_chans = strtol (++*argv, argv, 10);
+
+                        if (num_chans < 1 || num_chans > 2) {
+                            fprintf (stderr, "\nnumber of channels must be 1 or 2!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'B': case 'b':
+                        frame_ms = strtol (++*argv, argv, 10);
+
+                        if (frame_ms < 1 || frame_ms > 100) {
+                            fprintf (stderr, "\nframe length must be from 1 to 100 ms!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'F': case 'f':
+                        flags |= STRETCH_FAST_FLAG;
+                        break;
+
+                    case 'D': case 'd':
+                        force_dual = 1;
+                        break;
+
+                    case 'H': case 'h':
+                        asked_help = 1;
+                        break;
+
+                    case 'V': case 'v':
+                        verbose_mode = 1;
+                        break;
+
+                    case 'Q': case 'q':
+                        quiet_mode = 1;
+                        break;
+
+                    default:
+                        fprintf (stderr, "\nillegal option: %c !\n", **argv);
+                        return -1;
+                }
+        else if (!socket_path)
+            socket_path = *argv;
+        else {
+            fprintf (stderr, "\nextra unknown argument: %s !\n", *argv);
+            return -1;
+        }
+    }
+
+    if (!quiet_mode)
+        fprintf (stderr, "%s", sign_on);
+
+    if (!socket_path || asked_help) {
+        printf ("%s", usage);
+        return 0;
+    }
+
+    if (force_dual || ratio < 0.5 || ratio > 2.0)
+        flags |= STRETCH_DUAL_FLAG;
+
+    frame_samples = sample_rate * (frame_ms / 1000.0);
+
+    if (frame_samples > STRETCHD_MAX_SAMPLES)
+        frame_samples = STRETCHD_MAX_SAMPLES;
+
+    total_samples = sample_rate * seconds;
+    generate_signal ();
+
+    if (!signal_samples || !(streams = calloc (num_streams, sizeof (Stream)))) {
+        fprintf (stderr, "can't allocate required memory!\n");
+        return 1;
+    }
+
+    start_time = clock_seconds ();
+
+    for (i = 0; i < num_streams; ++i) {
+        streams [i].index = i;
+
+        if (pthread_create (&streams [i].thread, NULL, stream_thread, streams + i)) {
+            fprintf (stderr, "can't start stream %d!\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < num_streams; ++i) {
+        pthread_join (streams [i].thread, NULL);
+
+        if (streams [i].failed) {
+            failed++;
+            continue;
+        }
+
+        if (streams [i].num_workers)
+            num_workers = streams [i].num_workers;
+
+        input_samples += streams [i].stats.input_samples;
+        output_samples += streams [i].received_samples;
+        dsp_seconds += streams [i].stats.dsp_ns / 1e9;
+
+        if (verbose_mode)
+            fprintf (stderr, "stream %d (worker %u): %llu samples --> %llu samples, %.3f seconds DSP, "
+                "longest call %.1f us, %u stalls\n", i, streams [i].stats.worker,
+                (unsigned long long) streams [i].stats.input_samples, (unsigned long long) streams [i].received_samples,
+                streams [i].stats.dsp_ns / 1e9, streams [i].stats.max_call_ns / 1e3, streams [i].stats.stalls);
+    }
+
+    elapsed = clock_seconds () - start_time;
+    audio_seconds = (double) input_samples / sample_rate;
+
+    if (failed)
+        fprintf (stderr, "%d of %d streams failed!\n", failed, num_streams);
+
+    if (input_samples && !quiet_mode) {
+        fprintf (stderr, "%d streams, %.2f seconds of audio in %.3f seconds (%.1fX real time), ratio = %.3f\n",
+            num_streams - failed, audio_seconds, elapsed, audio_seconds / elapsed, (double) output_samples / input_samples);
+        fprintf (stderr, "%d daemon workers: %.1f real-time streams per core (elapsed), %.1f per core (DSP only)\n",
+            num_workers, audio_seconds / elapsed / num_workers, dsp_seconds ? audio_seconds / dsp_seconds : 0.0);
+    }
+
+    free (signal_samples);
+    free (streams);
+    return failed ? 1 : 0;
+}
+
+// Run one stream: open the session, then send audio (and finally END) whenever the
+// socket takes it while reading the stretched audio as it comes back, until the
+// closing STATS frame arrives.
+
+static void *stream_thread (void *arg)
+{
+    Stream *stream = arg;
+    unsigned char *pending = malloc (sizeof (StretchdHeader) + STRETCHD_MAX_SAMPLES * 2 * sizeof (int16_t));
+    unsigned char *input = NULL;
+    size_t pending_start = 0, pending_end = 0, input_bytes = 0, input_size = 0;
+    int fd, position = 0, ended = 0, done = 0;
+    StretchdOpen open = { sample_rate, num_chans, flags, ratio };
+    StretchdHeader header = { STRETCHD_OPEN, sizeof (open) };
+    struct sockaddr_un address;
+    StretchdReady ready;
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strncpy (address.sun_path, socket_path, sizeof (address.sun_path) - 1);
+
+    if (!pending || (fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 || connect (fd, (struct sockaddr *) &address, sizeof (address))) {
+        fprintf (stderr, "stream %d: can't connect to \"%s\": %s\n", stream->index, socket_path, strerror (errno));
+        stream->failed = 1;
+        free (pending);
+        return NULL;
+    }
+
+    if (send (fd, &header, sizeof (header), MSG_NOSIGNAL) != sizeof (header) || send (fd, &open, sizeof (open), MSG_NOSIGNAL) != sizeof (open) ||
+        !read_frame (fd, &header, &ready, sizeof (ready)) || header.type != STRETCHD_READY) {
+            fprintf (stderr, "stream %d: session refused\n", stream->index);
+            stream->failed = 1;
+            close (fd);
+            free (pending);
+            return NULL;
+    }
+
+    stream->num_workers = ready.num_workers;
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+    while (!done && !stream->failed) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        ssize_t bytes;
+
+        // queue the next frame when the last one is gone
+
+        if (pending_start == pending_end && !ended) {
+            int num_samples = total_samples - position < frame_samples ? total_samples - position : frame_samples;
+
+            header.type = num_samples ? STRETCHD_AUDIO : STRETCHD_END;
+            header.length = num_samples * num_chans * sizeof (int16_t);
+            memcpy (pending, &header, sizeof (header));
+            memcpy (pending + sizeof (header), signal_samples + position * num_chans, header.length);
+            pending_start = 0;
+            pending_end = sizeof (header) + header.length;
+            position += num_samples;
+            ended = !num_samples;
+        }
+
+        if (pending_start < pending_end)
+            pfd.events |= POLLOUT;
+
+        if (poll (&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            stream->failed = 1;
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            bytes = send (fd, pending + pending_start, pending_end - pending_start, MSG_NOSIGNAL);
+
+            if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
+                fprintf (stderr, "stream %d: send: %s\n", stream->index, strerror (errno));
+                stream->failed = 1;
+                break;
+            }
+
+            if (bytes > 0)
+                pending_start += bytes;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            size_t offset = 0;
+
+            if (input_size - input_bytes < 65536) {
+                unsigned char *new_input = realloc (input, input_size + 65536);
+
+                if (!new_input) {
+                    stream->failed = 1;
+                    break;
+                }
+
+                input = new_input;
+                input_size += 65536;
+            }
+
+            bytes = recv (fd, input + input_bytes, input_size - input_bytes, 0);
+
+            if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+                fprintf (stderr, "stream %d: connection closed by the daemon\n", stream->index);
+                stream->failed = 1;
+                break;
+            }
+
+            if (bytes > 0)
+                input_bytes += bytes;
+
+            while (input_bytes - offset >= sizeof (header)) {
+                memcpy (&header, input + offset, sizeof (header));
+
+                if (input_bytes - offset < sizeof (header) + header.length)
+                    break;
+
+                if (header.type == STRETCHD_AUDIO)
+                    stream->received_samples += header.length / (num_chans * sizeof (int16_t));
+                else if (header.type == STRETCHD_STATS && ended && header.length == sizeof (stream->stats)) {
+                    memcpy (&stream->stats, input + offset + sizeof (header), sizeof (stream->stats));
+                    done = 1;
+                }
+                else if (header.type == STRETCHD_ERROR) {
+                    fprintf (stderr, "stream %d: daemon error: %.*s\n", stream->index, (int) header.length,
+                        (char *) input + offset + sizeof (header));
+                    stream->failed = 1;
+                }
+
+                offset += sizeof (header) + header.length;
+            }
+
+            memmove (input, input + offset, input_bytes - offset);
+            input_bytes -= offset;
+        }
+    }
+
+    close (fd);
+    free (pending);
+    free (input);
+    return NULL;
+}
+
+// read one whole frame (blocking), FALSE on error or if the payload doesn't fit
+
+static int read_frame (int fd, StretchdHeader *header, void *payload, uint32_t max_length)
+{
+    if (recv (fd, header, sizeof (*header), MSG_WAITALL) != sizeof (*header) || header->length > max_length)
+        return 0;
+
+    return !header->length || recv (fd, payload, header->length, MSG_WAITALL) == header->length;
+}
+
+// A speech-like test signal: a harmonic series gliding between 100 and 250 Hz
+// with a little noise, interrupted every second by a short burst of noise.
+
+static void generate_signal (void)
+{
+    uint32_t random = 0x3c6ef372;
+    double phase = 0.0;
+    int i, j;
+
+    if (!(signal_samples = malloc (total_samples * num_chans * sizeof (int16_t))))
+        return;
+
+    for (i = 0; i < total_samples; ++i) {
+        double t = (double) i / sample_rate, value = 0.0, noise;
+        int h;
+
+        phase += 2.0 * M_PI * (175.0 + 75.0 * sin (2.0 * M_PI * 0.7 * t)) / sample_rate;
+        random = random * 1664525 + 1013904223;
+        noise = ((int32_t) random >> 16) / 32768.0;
+
+        if (fmod (t, 1.0) < 0.1)
+            value = noise * 0.3;
+        else
+            for (h = 1; h <= 8; ++h)
+                value += sin (phase * h) * 0.25 / h;
+
+        value += noise * 0.01;
+
+        for (j = 0; j < num_chans; ++j)
+            signal_samples [i * num_chans + j] = (int16_t) floor (value * 32767.0 + 0.5);
+    }
+}
+
+static double clock_seconds (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
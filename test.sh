@@ -15,6 +15,24 @@ if [ ! -f samples/mono.wav ] || [ ! -f samples/stereo.wav ]; then
   $WVUNPACK samples/stereo.wv
 fi
 
+if [ "$1" = "quality" ]; then
+  shift
+  if [ ! -x ./audio-quality ]; then
+    echo "please build the quality-regression harness first (./build.sh quality)"
+    exit 1
+  fi
+  exec ./audio-quality "$@" samples/*.wav
+fi
+
+if [ "$1" = "api" ]; then
+  shift
+  if [ ! -x ./audio-apitest ]; then
+    echo "please build the interface regression test first (./build.sh api)"
+    exit 1
+  fi
+  exec ./audio-apitest "$@"
+fi
+
 STARTER=""
 if [ "$1" = "gdb" ]; then
   STARTER="gdb -q -ex run -ex quit --args"
@@ -34,6 +52,8 @@ fi
 
 if [ -z "$1" ] && [ -z "$2" ]; then
   echo "usage: $0 [mono|stereo] [f|n] [s|x]"
+  echo "       $0 quality [harness options]"
+  echo "       $0 api [test options]"
   echo "  'f': fast pitch detection"
   echo "  'n': normal pitch detection"
   echo "  's': simple range for ratio: 0.5 .. 2.0"
@@ -9,6 +9,13 @@ enum{
 	Sampsz = Nchan * 2,
 };
 
+typedef struct Calls Calls;
+struct Calls{
+	vlong *ns;	/* duration of each stretch call */
+	int n;
+	vlong dsp, io;
+};
+
 void
 usage(void)
 {
@@ -22,40 +29,66 @@ usage(void)
 		"-c	cycle through all ratios, starting higher\n"
 		"-C	cycle through all ratios, starting lower\n"
 		"-d	force dual instance even for shallow ratios\n"
-		"-s	scale rate to preserve duration (not pitch)\n"
+		"-s	resample to preserve duration (not pitch)\n"
 		"-f	fast pitch detection (default >= 32 kHz)\n"
-		"-n	normal pitch detection (default < 32 kHz)\n",
+		"-n	normal pitch detection (default < 32 kHz)\n"
+		"-v	verbose, including the latency of the stretch calls\n",
 		argv0);
 	exits("usage");
 }
 
-double
-rms_level_dB (int16_t *audio, int samples, int channels)
+void
+addcall(Calls *c, vlong t)
+{
+	if((c->n & c->n-1) == 0 && (c->n == 0 || c->n >= 1024)
+	&& (c->ns = realloc(c->ns, (c->n ? c->n*2 : 1024) * sizeof *c->ns)) == nil)
+		sysfatal("realloc: %r");
+	c->ns[c->n++] = t;
+	c->dsp += t;
+}
+
+int
+vlongcmp(void *a, void *b)
 {
-	double rms_sum = 0.0;
-	int i;
+	vlong x, y;
 
-	if (channels == 1)
-		for (i = 0; i < samples; ++i)
-			rms_sum += (double) audio [i] * audio [i];
-	else
-		for (i = 0; i < samples; ++i) {
-			double average = (audio [i * 2] + audio [i * 2 + 1]) / 2.0;
-			rms_sum += average * average;
-		}
+	x = *(vlong*)a;
+	y = *(vlong*)b;
+	return x < y ? -1 : x > y;
+}
 
-	return log10 (rms_sum / samples / (32768.0 * 32767.0 * 0.5)) * 10.0;
+/* latency percentiles (nearest rank) of the stretch calls, and speed vs. real time */
+void
+latency(Calls *c, double secs)
+{
+	static double pct[] = {50, 90, 99, 100};
+	static char *name[] = {"p50", "p90", "p99", "max"};
+	int i, r;
+
+	if(c->n == 0)
+		return;
+	qsort(c->ns, c->n, sizeof *c->ns, vlongcmp);
+	fprint(2, "stretch call latency (%d calls):", c->n);
+	for(i = 0; i < nelem(pct); i++){
+		r = ceil(pct[i] / 100 * c->n);
+		fprint(2, "%s %s = %.1f us", i ? "," : "", name[i], c->ns[r > 0 ? r-1 : 0] / 1e3);
+	}
+	fprint(2, "\n");
+	if(c->dsp + c->io > 0)
+		fprint(2, "%.2f seconds of audio in %.3f seconds (%.1fX real time), %.3f DSP + %.3f I/O\n",
+			secs, (c->dsp + c->io) / 1e9, secs * 1e9 / (c->dsp + c->io), c->dsp / 1e9, c->io / 1e9);
 }
 
 void
 threadmain(int argc, char **argv)
 {
-	int n, m, fd, ofd, pfd[2], cycle, dual, fast, normal, doscale, lf, uf, wsz, flags, maxnsamp, silence, nibuf, min_period, max_period, non_silence_frames, silence_frames, used_silence_frames, max_generated_stretch, max_generated_flush, samples_to_stretch, consecutive_silence_frames, verbose;
-	char *r;
-	s16int *prebuf, *ibuf, *obuf;
+	int n, m, fd, ofd, cycle, dual, fast, normal, doscale, lf, uf, wsz, flags, maxnsamp, silence, nibuf, min_period, max_period, total_frames, silence_frames, used_silence_frames, max_generated_stretch, max_generated_flush, verbose;
+	s16int *ibuf, *obuf;
 	u32int insamp, outsamp;
 	float max_ratio;
-	double level, ratio, gap, smin;
+	double ratio, gap, smin;
+	vlong t;
+	Calls calls;
 	StretchHandle S;
 
 	fd = 0;
@@ -64,7 +97,7 @@ threadmain(int argc, char **argv)
 	dual = 0;	/* force dual instance */
 	fast = 0;	/* force fast pitch detection */
 	normal = 0;	/* force normal pitch detection */
-	doscale = 0;	/* scale rate to preserve duration */
+	doscale = 0;	/* resample to preserve duration */
 	lf = 55;	/* freq lower bound */
 	uf = 333;	/* freq upper bound */
 	gap = 0.0;	/* gap/silence stretch ratio */
@@ -105,6 +138,8 @@ threadmain(int argc, char **argv)
 		flags |= STRETCH_DUAL_FLAG;
 	if((fast || Nrate >= 32000) && !normal)
 		flags |= STRETCH_FAST_FLAG;
+	if(doscale)
+		flags |= STRETCH_PITCH_FLAG;
 	if(verbose){
 		fprint(2, "file sample rate is %d Hz (%s), buffer size is %d samples\n",
 			Nrate, Nchan == 2 ? "stereo" : "mono", nibuf);
@@ -114,121 +149,83 @@ threadmain(int argc, char **argv)
 	}
 	if((S = stretch_init(min_period, max_period, Nchan, flags)) == NULL)
 		sysfatal("initialization failed");
+	if(silence && !stretch_set_gap(S, gap, smin, nibuf))
+		sysfatal("stretch_set_gap failed");
+	if(doscale)
+		stretch_set_pitch_ratio(S, ratio);
 	if(cycle)
 		max_ratio = (flags & STRETCH_DUAL_FLAG) ? 4.0 : 2.0;
 	else if(silence && gap > max_ratio)
 		max_ratio = gap;
 	maxnsamp = stretch_output_capacity(S, nibuf, max_ratio);
-	obuf = prebuf = nil;
+	obuf = nil;
 	if((ibuf = malloc(nibuf * Sampsz)) == nil
-	|| (obuf = malloc(maxnsamp * Sampsz)) == nil
-	|| silence && (prebuf = malloc(nibuf * Sampsz)) == nil)
+	|| (obuf = malloc(maxnsamp * Sampsz)) == nil)
 		sysfatal("malloc: %r");
-	non_silence_frames = 0,
-	silence_frames = 0,
-	used_silence_frames = 0;
 	max_generated_stretch = 0,
 	max_generated_flush = 0;
-	samples_to_stretch = 0,
-	consecutive_silence_frames = 1;
+	memset(&calls, 0, sizeof calls);
 
-	if(doscale){
-		if(pipe(pfd) < 0)
-			sysfatal("pipe: %r");
-		switch(rfork(RFPROC|RFFDG)){
-		case -1:
-			sysfatal("rfork: %r");
-		case 0:
-			close(0);
-			close(pfd[1]);
-			dup(pfd[0], 0);
-			if((r = smprint("s16c2r%d", (u32int)(Nrate * ratio + 0.5))) == nil)
-				sysfatal("smprint: %r");
-			execl("/bin/audio/pcmconv", "pcmconv", "-i", r, "-o", "s16c2r44100", nil);
-			sysfatal("execl: %r");
-		default:
-			close(1);
-			close(pfd[0]);
-			ofd = pfd[1];
-		}
-	}
 	for(;;){
-		n = read(fd, silence ? prebuf : ibuf, Sampsz * nibuf);
+		t = nsec();
+		n = read(fd, ibuf, Sampsz * nibuf);
+		calls.io += nsec() - t;
 		n /= Sampsz;
 		if(n < 0)
 			sysfatal("read: %r");
-		if(!silence && n == 0)
+		if(n == 0)
 			break;
 		insamp += n;
-		if(silence){
-			if(n != 0){
-				level = rms_level_dB(prebuf, n, Nchan);
-				if(level > smin){
-					consecutive_silence_frames = 0;
-					non_silence_frames++;
-				}
-				else{
-					consecutive_silence_frames++;
-					silence_frames++;
-				}
-			}
-		}
-		else
-			samples_to_stretch = n;
 		if(cycle){
 			if(flags & STRETCH_DUAL_FLAG)
 				ratio = (sin((double) outsamp / Nrate / 2.0) *(cycle & 1 ? 1.875 : -1.875)) + 2.125;
 			else
 				ratio = (sin((double) outsamp / Nrate) * (cycle & 1 ? 0.75 : -0.75)) + 1.25;
 		}
-		if(samples_to_stretch){
-			if(consecutive_silence_frames >= 3){
-				m = stretch_samples(S, ibuf, samples_to_stretch, obuf, gap);
-				used_silence_frames++;
-			}else
-				m = stretch_samples(S, ibuf, samples_to_stretch, obuf, ratio);
-			if(m){
-				if(m > max_generated_stretch)
-					max_generated_stretch = m;
-				write(ofd, obuf, Sampsz * m);
-				outsamp += m;
-				if(m > maxnsamp)
-					sysfatal("sample generation overflow");
-			}
-		}
-		if(silence){
-			if(n){
-				memcpy(ibuf, prebuf, n * Sampsz);
-				samples_to_stretch = n;
-			}else
-				break;
+		t = nsec();
+		m = stretch_samples(S, ibuf, n, obuf, ratio);
+		addcall(&calls, nsec() - t);
+		if(m){
+			if(m > max_generated_stretch)
+				max_generated_stretch = m;
+			t = nsec();
+			write(ofd, obuf, Sampsz * m);
+			calls.io += nsec() - t;
+			outsamp += m;
+			if(m > maxnsamp)
+				sysfatal("sample generation overflow");
 		}
 	}
 	for(;;){
-		if((n = stretch_flush(S, obuf)) == 0)
+		t = nsec();
+		n = stretch_flush(S, obuf);
+		addcall(&calls, nsec() - t);
+		if(n == 0)
 			break;
 		if(n > max_generated_flush)
 			max_generated_flush = n;
 		if(n > maxnsamp)
 			sysfatal("flush overflow");
+		t = nsec();
 		write(ofd, obuf, Sampsz * n);
+		calls.io += nsec() - t;
 		outsamp += n / Sampsz;
 	}
     if(insamp && verbose){
         fprint(2, "done, %ud samples --> %ud samples (ratio = %.3f)\n",
             insamp, outsamp, (double)outsamp / insamp);
         if(doscale)
-            fprint(2, "sample rate changed from %d Hz to %ud Hz\n",
-                Nrate, (u32int)(Nrate * ratio + 0.5));
+            fprint(2, "pitch shifted by %.3f\n", ratio);
         fprint(2, "max expected samples = %d, actually seen = %d stretch, %d flush\n",
             maxnsamp, max_generated_stretch, max_generated_flush);
-        if(silence_frames || non_silence_frames) {
-            int total_frames = silence_frames + non_silence_frames;
+        stretch_gap_stats(S, &total_frames, &silence_frames, &used_silence_frames);
+        if(total_frames)
             fprint(2, "%d silence frames detected (%.2f%%), %d actually used (%.2f%%)\n",
                 silence_frames, silence_frames * 100.0 / total_frames,
-                used_silence_frames, used_silence_frames * 100.0 / total_frames); 
-        }
+                used_silence_frames, used_silence_frames * 100.0 / total_frames);
+        latency(&calls, (double)insamp / Nrate);
     }
+	free(calls.ns);
 	stretch_deinit(S);
 	exits(nil);
 }